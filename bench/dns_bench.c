@@ -0,0 +1,145 @@
+/*
+** dns_bench.c -- lookups per second, getaddrinfo() vs the DNS cache
+**
+** usage: dns_bench [seconds_per_case] [name...]
+**
+** Names default to localhost, so nothing has to leave the machine: give it
+** /etc/hosts entries to measure the cache without a network. The async
+** case fires a burst of lookups at a cold cache, the way the batch client
+** starts a host's first connections, and reports how many shared a query.
+*/
+
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dns_cache.h"
+
+#define BURST 64
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double bench_getaddrinfo(char **names, int count, double seconds)
+{
+	struct addrinfo hints, *res;
+	double start = now(), elapsed;
+	long n = 0;
+	int rv;
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	do {
+		if ((rv = getaddrinfo(names[n % count], "80", &hints, &res)) != 0) {
+			fprintf(stderr, "dns_bench: %s: %s\n", names[n % count],
+				gai_strerror(rv));
+			exit(1);
+		}
+		freeaddrinfo(res);
+		n++;
+	} while ((elapsed = now() - start) < seconds);
+	return n / elapsed;
+}
+
+static double bench_cached(char **names, int count, double seconds,
+	struct dns_stats *stats)
+{
+	struct dns_cache *dc = dns_cache_create(1, DNS_TTL, DNS_NEGATIVE_TTL);
+	struct dns_entry *e;
+	double start = now(), elapsed;
+	long n = 0;
+
+	do {
+		for (int i = 0; i < 1000; i++, n++) {
+			if (dns_resolve(dc, names[n % count], "80", SOCK_STREAM,
+					&e) != 0) {
+				fprintf(stderr, "dns_bench: %s: lookup failed\n",
+					names[n % count]);
+				exit(1);
+			}
+			dns_release(dc, e);
+		}
+	} while ((elapsed = now() - start) < seconds);
+	dns_get_stats(dc, stats);
+	dns_cache_destroy(dc);
+	return n / elapsed;
+}
+
+static void count_answer(void *ctx, void *tag, struct dns_entry *e, int err)
+{
+	struct dns_cache *dc = ctx;
+
+	(void)tag;
+	if (e == NULL) {
+		fprintf(stderr, "dns_bench: lookup failed: %s\n", gai_strerror(err));
+		exit(1);
+	}
+	dns_release(dc, e);
+}
+
+// BURST async lookups per round on a fresh cache; returns rounds per second
+static double bench_async(char **names, int count, double seconds,
+	struct dns_stats *stats)
+{
+	double start = now(), elapsed;
+	long rounds = 0;
+	struct dns_stats total = { 0 };
+
+	do {
+		struct dns_cache *dc = dns_cache_create(DNS_THREADS, DNS_TTL,
+			DNS_NEGATIVE_TTL);
+		struct pollfd pfd = { dns_event_fd(dc), POLLIN, 0 };
+		struct dns_entry *e;
+		struct dns_stats s;
+		int pending = 0, i, rv;
+
+		for (i = 0; i < BURST; i++) {
+			rv = dns_resolve_async(dc, names[i % count], "80",
+				SOCK_STREAM, NULL, &e);
+			if (rv == DNS_PENDING)
+				pending++;
+			else if (rv == 0)
+				dns_release(dc, e);
+		}
+		while (pending > 0 && poll(&pfd, 1, -1) > 0)
+			pending -= dns_poll(dc, count_answer, dc);
+		dns_get_stats(dc, &s);
+		total.hits += s.hits;
+		total.misses += s.misses;
+		total.coalesced += s.coalesced;
+		dns_cache_destroy(dc);
+		rounds++;
+	} while ((elapsed = now() - start) < seconds);
+	*stats = total;
+	return rounds / elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+	double seconds = argc > 1 ? atof(argv[1]) : 1.0;
+	char *fallback[] = { "localhost" };
+	char **names = argc > 2 ? argv + 2 : fallback;
+	int count = argc > 2 ? argc - 2 : 1;
+	struct dns_stats stats;
+	double rate;
+
+	printf("%-28s %14s %10s %10s %10s\n", "case", "lookups/s", "hits",
+		"misses", "joined");
+	rate = bench_getaddrinfo(names, count, seconds);
+	printf("%-28s %14.0f %10s %10s %10s\n", "getaddrinfo", rate, "-", "-", "-");
+	rate = bench_cached(names, count, seconds, &stats);
+	printf("%-28s %14.0f %10lu %10lu %10lu\n", "dns_resolve (cached)", rate,
+		stats.hits, stats.misses, stats.coalesced);
+	rate = bench_async(names, count, seconds, &stats);
+	printf("%-28s %14.0f %10lu %10lu %10lu\n", "dns_resolve_async (cold)",
+		rate * BURST, stats.hits, stats.misses, stats.coalesced);
+	return 0;
+}
@@ -0,0 +1,173 @@
+/*
+** parser_bench.c -- parsed responses per second, old parseResponse() vs
+** the incremental responseParser
+**
+** usage: parser_bench [seconds_per_case]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "response_parser.h"
+
+struct httpResponse {
+    char *httpStatusCd;
+    int  contentLength;
+    char* header;
+    char *body;
+};
+
+// parseResponse() as it was in http_client.c, kept verbatim as the baseline
+static struct httpResponse *parseResponse(char* buf, struct httpResponse *httpResponseDtl){
+    char* body = strstr(buf, "\r\n\r\n");
+    char* header = 0;
+    if(body) {
+        header = (char *)malloc((body - buf) + 1);
+        if(header) {
+            httpResponseDtl->header = header;
+            memcpy(header, buf, body - buf);
+            header[body - buf] = 0;
+        }
+    }
+
+    if(body != NULL){
+        httpResponseDtl->body = body;
+    }
+
+    char* headerItem;
+    headerItem = strtok(header, "\r\n");
+    //"HTTP/1.0 200 OK"
+    int count = 0;
+    while(headerItem != NULL){
+        if( headerItem != NULL ){
+            if(count == 0){//First one always HTTP
+                httpResponseDtl->httpStatusCd = headerItem;
+            }
+
+            if(count > 0){
+                if(strstr(headerItem,"Content-Length") != NULL){
+                    int contentLength;
+                    char tmp[256];
+                    tmp[0]='\0';
+                    while (sscanf(headerItem,"%[^0123456789]%s",tmp,headerItem)>1||sscanf(headerItem,"%d%s",&contentLength,headerItem))
+                    {
+                        if (tmp[0]=='\0')
+                        {
+                            httpResponseDtl->contentLength = contentLength;
+                            break;
+                        }
+                        tmp[0]='\0';
+                    }
+                }
+            }
+            count++;
+            headerItem = strtok(NULL, "\r\n");
+        }
+    }
+
+    return httpResponseDtl;
+
+
+}
+
+static const char smallResponse[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Server: httpexperiments\r\n"
+    "Content-Type: image/png\r\n"
+    "Content-Length: 5969\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n";
+
+static const char cdnResponse[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Date: Sat, 17 Oct 2026 06:35:44 GMT\r\n"
+    "Content-Type: application/pdf\r\n"
+    "Content-Length: 1048576\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: public, max-age=31536000, immutable\r\n"
+    "ETag: \"5f2b1c7a-100000\"\r\n"
+    "Last-Modified: Wed, 05 Aug 2026 18:23:22 GMT\r\n"
+    "Accept-Ranges: bytes\r\n"
+    "Age: 81234\r\n"
+    "Via: 1.1 varnish, 1.1 varnish\r\n"
+    "X-Served-By: cache-iad-kiad7000025-IAD, cache-ord1733-ORD\r\n"
+    "X-Cache: HIT, HIT\r\n"
+    "X-Cache-Hits: 12, 4\r\n"
+    "X-Timer: S1792219344.123456,VS0,VE0\r\n"
+    "Vary: Accept-Encoding\r\n"
+    "Strict-Transport-Security: max-age=31536000; includeSubDomains\r\n"
+    "Server: nginx/1.25.3\r\n"
+    "\r\n";
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static volatile long sink;
+
+static double benchLegacy(const char *response, double seconds) {
+    char buf[4096];
+    struct httpResponse r;
+    long n = 0;
+    double start = now(), elapsed;
+
+    strcpy(buf, response);
+    do {
+        for (int i = 0; i < 1000; i++) {
+            memset(&r, 0, sizeof r);
+            parseResponse(buf, &r);
+            sink += r.contentLength;
+            free(r.header);
+        }
+        n += 1000;
+    } while ((elapsed = now() - start) < seconds);
+    return n / elapsed;
+}
+
+// split > 0 feeds the header in two pieces, as if it came in two recv()s
+static double benchParser(const char *response, size_t split, double seconds) {
+    struct responseParser parser;
+    size_t len = strlen(response);
+    long n = 0;
+    double start = now(), elapsed;
+
+    do {
+        for (int i = 0; i < 1000; i++) {
+            responseParserInit(&parser);
+            if (split > 0) {
+                responseParserFeed(&parser, response, split);
+            }
+            if (responseParserFeed(&parser, response, len) != 1) {
+                fprintf(stderr, "parser_bench: parse failed\n");
+                exit(1);
+            }
+            sink += parser.head.contentLength;
+        }
+        n += 1000;
+    } while ((elapsed = now() - start) < seconds);
+    return n / elapsed;
+}
+
+int main(int argc, char *argv[]) {
+    double seconds = argc > 1 ? atof(argv[1]) : 1.0;
+    const struct {
+        const char *name;
+        const char *response;
+    } cases[] = {
+        { "small (5 headers)", smallResponse },
+        { "cdn (18 headers)", cdnResponse },
+    };
+
+    printf("%-20s %16s %16s %16s\n", "response", "parseResponse/s", "parser/s", "parser split/s");
+    for (size_t i = 0; i < sizeof cases / sizeof cases[0]; i++) {
+        double legacy = benchLegacy(cases[i].response, seconds);
+        double fresh = benchParser(cases[i].response, 0, seconds);
+        double split = benchParser(cases[i].response, strlen(cases[i].response) / 2, seconds);
+        printf("%-20s %16.0f %16.0f %16.0f\n", cases[i].name, legacy, fresh, split);
+    }
+    return 0;
+}
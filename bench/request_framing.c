@@ -0,0 +1,141 @@
+/*
+** request_framing.c -- checks that a request body is never parsed as the
+** next pipelined request
+**
+** usage: request_framing
+**
+** Feeds requests straight into http_conn_parse(), the parser every server
+** mode shares, and checks which responses get queued for them and whether
+** the connection is kept. A request that carries a body gets one answer
+** and closes the connection, since the body is never read; so does every
+** error. Framing that two parsers could read differently (conflicting
+** Content-Lengths, Content-Length with Transfer-Encoding) is a 400.
+** Exits non-zero if any case fails.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <netinet/in.h>
+
+#include "server.h"
+
+struct framing_case {
+	const char *name;
+	const char *input;
+	int responses;   // queued for the input
+	int status;      // of the first
+	int closing;     // the connection is done afterwards
+};
+
+static const struct framing_case cases[] = {
+	{ "POST body is not a request",
+		"POST / HTTP/1.1\r\nContent-Length: 40\r\n\r\n"
+		"GET /file1 HTTP/1.1\r\nHost: x\r\n\r\n12345678",
+		1, 405, 1 },
+	{ "GET with a body closes",
+		"GET /file1 HTTP/1.1\r\nContent-Length: 33\r\n\r\n"
+		"GET /file1 HTTP/1.1\r\nHost: x\r\n\r\n",
+		1, 200, 1 },
+	{ "chunked body closes",
+		"POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+		"21\r\nGET /file1 HTTP/1.1\r\nHost: x\r\n\r\n\r\n0\r\n\r\n",
+		1, 405, 1 },
+	{ "Content-Length with Transfer-Encoding",
+		"POST / HTTP/1.1\r\nContent-Length: 4\r\n"
+		"Transfer-Encoding: chunked\r\n\r\n0\r\n\r\n",
+		1, 400, 1 },
+	{ "conflicting Content-Lengths",
+		"POST / HTTP/1.1\r\nContent-Length: 4\r\n"
+		"Content-Length: 40\r\n\r\nabcd",
+		1, 400, 1 },
+	{ "unreadable Content-Length",
+		"POST / HTTP/1.1\r\nContent-Length: 4x\r\n\r\nabcd",
+		1, 400, 1 },
+	{ "404 closes",
+		"GET /missing HTTP/1.1\r\n\r\nGET /file1 HTTP/1.1\r\n\r\n",
+		1, 404, 1 },
+	{ "Content-Length: 0 keeps pipelining",
+		"GET /file1 HTTP/1.1\r\nContent-Length: 0\r\n\r\n"
+		"GET /file1 HTTP/1.1\r\n\r\n",
+		2, 200, 0 },
+	{ NULL, NULL, 0, 0, 0 }
+};
+
+// server.c has main() and isn't linked in, this is all it would bring
+void *get_in_addr(struct sockaddr *sa)
+{
+	if (sa->sa_family == AF_INET)
+		return &((struct sockaddr_in *)sa)->sin_addr;
+	return &((struct sockaddr_in6 *)sa)->sin6_addr;
+}
+
+static int run_case(const struct framing_case *fc,
+	const struct server_config *cfg, struct http_conn *c)
+{
+	size_t len = strlen(fc->input);
+	int queued;
+
+	http_conn_init(c, -1, NULL);
+	memcpy(c->in, fc->input, len);
+	c->in_len = len;
+	queued = http_conn_parse(c, cfg);
+
+	if (queued != fc->responses || queued == 0 ||
+			c->res[0].status != fc->status ||
+			c->closing != fc->closing ||
+			c->res[queued - 1].keep_alive == fc->closing) {
+		fprintf(stderr, "request_framing: %s: %d responses, status %d, "
+			"closing %d; want %d, %d, %d\n", fc->name, queued,
+			queued > 0 ? c->res[0].status : 0, c->closing,
+			fc->responses, fc->status, fc->closing);
+		http_conn_release(c);
+		return -1;
+	}
+	http_conn_release(c);
+	return 0;
+}
+
+int main(void)
+{
+	char root[] = "/tmp/request_framingXXXXXX", path[PATH_MAX];
+	const struct framing_case *fc;
+	struct server_config cfg;
+	struct http_conn *c;
+	FILE *fp;
+	int failed = 0;
+
+	if (mkdtemp(root) == NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+	snprintf(path, sizeof path, "%s/file1", root);
+	if ((fp = fopen(path, "w")) == NULL) {
+		perror(path);
+		return 1;
+	}
+	fputs("file1\n", fp);
+	fclose(fp);
+
+	memset(&cfg, 0, sizeof cfg);
+	cfg.docroot = root;
+	cfg.idle_timeout = KEEPALIVE_TIMEOUT;
+	cfg.max_requests = MAX_REQUESTS;
+
+	if ((c = malloc(sizeof *c)) == NULL) {
+		perror("malloc");
+		return 1;
+	}
+	for (fc = cases; fc->name != NULL; fc++)
+		if (run_case(fc, &cfg, c) == -1)
+			failed = 1;
+	free(c);
+
+	unlink(path);
+	rmdir(root);
+	if (!failed)
+		printf("request_framing: %d cases ok\n", (int)(fc - cases));
+	return failed;
+}
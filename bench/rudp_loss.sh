@@ -0,0 +1,35 @@
+#!/bin/sh
+#
+# rudp_loss.sh -- reliable UDP throughput on loopback under injected loss
+#
+# usage: bench/rudp_loss.sh [build_dir] [size_mb] [delay_ms] [loss%...]
+#
+# Sends a size_mb file from talker -T to listener -T once per loss rate
+# (default 0 1 2 5 10), with both ends' shims dropping that share of what
+# they send and holding the rest back delay_ms, checks the copy and prints
+# the sender's summary.
+
+BUILD=${1:-build}
+SIZE_MB=${2:-64}
+DELAY=${3:-0}
+[ $# -gt 3 ] && shift 3 || set -- 0 1 2 5 10
+
+TALKER=$(cd "$BUILD" && pwd)/talker
+LISTENER=$(cd "$BUILD" && pwd)/listener
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+dd if=/dev/urandom of="$WORK/big.bin" bs=1M count="$SIZE_MB" 2>/dev/null
+
+for loss in "$@"; do
+	$LISTENER -T "$WORK/copy.bin" -L "$loss" -D "$DELAY" 2>/dev/null &
+	pid=$!
+	sleep 0.5
+
+	echo "loss $loss%, delay $DELAY ms:"
+	$TALKER -T "$WORK/big.bin" -L "$loss" -D "$DELAY" 127.0.0.1 |
+		sed 's/^talker: /    /'
+	wait $pid
+	cmp -s "$WORK/copy.bin" "$WORK/big.bin" || echo "    copy mismatch"
+	rm -f "$WORK/copy.bin"
+done
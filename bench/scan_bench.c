@@ -0,0 +1,145 @@
+/*
+** scan_bench.c -- header delimiter scanning throughput per kernel
+**
+** usage: scan_bench [seconds_per_case]
+**
+** Splits realistic header blocks of 200 B to 8 KB into lines and finds each
+** line's colon, the way both parsers do, with every http_scan kernel and
+** with the two approaches it replaced: strstr + strtok over a copy (the old
+** parseResponse) and a memchr per delimiter (the first server parser).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "http_scan.h"
+
+static const char *sample_lines[] = {
+	"Date: Sat, 17 Oct 2026 06:35:44 GMT",
+	"Content-Type: text/html; charset=utf-8",
+	"Cache-Control: public, max-age=31536000, immutable",
+	"ETag: \"5f2b1c7a-100000\"",
+	"Last-Modified: Wed, 05 Aug 2026 18:23:22 GMT",
+	"Vary: Accept-Encoding, Origin",
+	"X-Served-By: cache-iad-kiad7000025-IAD, cache-ord1733-ORD",
+	"Set-Cookie: session=8c1f9a0e4b2d7c63a5e1; Path=/; Secure; HttpOnly; SameSite=Lax",
+	"Strict-Transport-Security: max-age=31536000; includeSubDomains; preload",
+	"Content-Security-Policy: default-src 'self'; img-src 'self' https://images.example.com",
+	"Accept-Ranges: bytes",
+	"X-Cache: HIT, MISS",
+};
+
+static volatile long sink;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// a response header block of about target bytes
+static size_t build_block(char *buf, size_t target)
+{
+	size_t len, i = 0;
+
+	len = sprintf(buf, "HTTP/1.1 200 OK\r\nContent-Length: 5969\r\n");
+	while (len + 100 < target) {
+		len += sprintf(buf + len, "%s\r\n",
+			sample_lines[i++ % (sizeof sample_lines /
+				sizeof sample_lines[0])]);
+	}
+	len += sprintf(buf + len, "\r\n");
+	return len;
+}
+
+static long walk_scan(const char *buf, size_t len)
+{
+	struct http_lines lines;
+	size_t start, line;
+	long colon, sum = 0;
+
+	http_lines_init(&lines, buf, len);
+	while (http_lines_next(&lines, &start, &line, &colon))
+		sum += colon + line;
+	return sum;
+}
+
+static long walk_memchr(const char *buf, size_t len)
+{
+	const char *p = buf, *end = buf + len, *eol, *colon;
+	long sum = 0;
+
+	while ((eol = memchr(p, '\n', end - p)) != NULL) {
+		colon = memchr(p, ':', eol - p);
+		sum += (colon ? colon - p : -1) + (eol - p);
+		p = eol + 1;
+	}
+	return sum;
+}
+
+static long walk_strtok(const char *buf, size_t len)
+{
+	char copy[16384];
+	const char *body = strstr(buf, "\r\n\r\n");
+	char *line, *colon;
+	long sum = 0;
+
+	(void)len;
+	memcpy(copy, buf, body - buf);
+	copy[body - buf] = '\0';
+	for (line = strtok(copy, "\r\n"); line; line = strtok(NULL, "\r\n")) {
+		colon = strchr(line, ':');
+		sum += (colon ? colon - line : -1) + strlen(line);
+	}
+	return sum;
+}
+
+static double run(long (*walk)(const char *, size_t), const char *buf,
+	size_t len, double seconds)
+{
+	double start = now(), elapsed;
+	long n = 0;
+	int i;
+
+	do {
+		for (i = 0; i < 1000; i++)
+			sink += walk(buf, len);
+		n += 1000;
+	} while ((elapsed = now() - start) < seconds);
+	return n * len / elapsed / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+	double seconds = argc > 1 ? atof(argv[1]) : 0.5;
+	const size_t sizes[] = { 200, 1024, 4096, 8192 };
+	const char *kernels[] = { "scalar", "sse2", "avx2" };
+	char buf[16384];
+	size_t i, k, len;
+
+	printf("dispatch picks %s\n", http_scan_kernel());
+	printf("%6s %10s %10s", "bytes", "strtok", "memchr");
+	for (k = 0; k < 3; k++)
+		printf(" %10s", kernels[k]);
+	printf("   (MB/s)\n");
+
+	for (i = 0; i < sizeof sizes / sizeof sizes[0]; i++) {
+		len = build_block(buf, sizes[i]);
+		printf("%6zu %10.0f %10.0f", len,
+			run(walk_strtok, buf, len, seconds),
+			run(walk_memchr, buf, len, seconds));
+		for (k = 0; k < 3; k++) {
+			if (http_scan_select(kernels[k]) == -1) {
+				printf(" %10s", "n/a");
+				continue;
+			}
+			printf(" %10.0f", run(walk_scan, buf, len, seconds));
+		}
+		printf("\n");
+	}
+	return 0;
+}
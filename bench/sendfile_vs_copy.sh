@@ -0,0 +1,45 @@
+#!/bin/sh
+#
+# sendfile_vs_copy.sh -- large file throughput, sendfile() vs read/write
+#
+# usage: bench/sendfile_vs_copy.sh [build_dir] [size_mb] [runs]
+#
+# Starts the server once with the default sendfile body path and once with
+# -c (read/write copy), fetches a size_mb file with http_client runs times
+# for each and prints the average MB/s.
+
+BUILD=${1:-build}
+SIZE_MB=${2:-256}
+RUNS=${3:-5}
+PORT=3490
+
+SERVER=$(cd "$BUILD" && pwd)/server
+CLIENT=$(cd "$BUILD" && pwd)/http_client
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+dd if=/dev/urandom of="$WORK/big.bin" bs=1M count="$SIZE_MB" 2>/dev/null
+
+for mode in sendfile copy; do
+	flags="-m epoll -q -d $WORK"
+	[ "$mode" = copy ] && flags="$flags -c"
+
+	$SERVER $flags >/dev/null &
+	pid=$!
+	sleep 0.5
+
+	start=$(date +%s.%N)
+	i=0
+	while [ $i -lt "$RUNS" ]; do
+		(cd "$WORK" && $CLIENT "http://127.0.0.1:$PORT/big.bin" >/dev/null)
+		i=$((i + 1))
+	done
+	end=$(date +%s.%N)
+
+	cmp -s "$WORK/output" "$WORK/big.bin" || echo "$mode: body mismatch"
+	echo "$mode $SIZE_MB $RUNS $start $end" |
+		awk '{ printf "%-8s %8.1f MB/s\n", $1, $2 * $3 / ($5 - $4) }'
+
+	kill $pid
+	wait $pid 2>/dev/null || :
+done
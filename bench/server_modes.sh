@@ -0,0 +1,47 @@
+#!/bin/sh
+#
+# server_modes.sh -- requests/s of the fork, epoll and io_uring servers
+#
+# usage: bench/server_modes.sh [build_dir] [requests] [concurrency]
+#
+# Starts the server in each mode and fetches a small file requests times
+# with the batch client, concurrency at a time: once over keep-alive
+# connections and once with -r 1, so that every request pays for a new
+# connection. The bodies the client saves go to tmpfs when there is one,
+# since writing them to disk would measure the disk.
+
+BUILD=${1:-build}
+REQUESTS=${2:-20000}
+CONC=${3:-32}
+PORT=3490
+
+SERVER=$(cd "$BUILD" && pwd)/server
+CLIENT=$(cd "$BUILD" && pwd)/http_client
+WORK=$(mktemp -d)
+OUT=$(mktemp -d -p /dev/shm 2>/dev/null || mktemp -d)
+trap 'rm -rf "$WORK" "$OUT"' EXIT
+
+mkdir "$WORK/root"
+head -c 4096 /dev/urandom >"$WORK/root/small.bin"
+i=0
+while [ $i -lt "$REQUESTS" ]; do
+	echo "http://127.0.0.1:$PORT/small.bin"
+	i=$((i + 1))
+done >"$WORK/urls"
+
+for churn in "" "-r 1"; do
+	for mode in fork epoll uring; do
+		$SERVER -m $mode -q -d "$WORK/root" $churn >/dev/null 2>&1 &
+		pid=$!
+		sleep 0.5
+
+		printf '%-6s %-10s ' $mode "${churn:-keepalive}"
+		mkdir "$OUT/run"
+		$CLIENT -b "$WORK/urls" -c "$CONC" -o "$OUT/run" |
+			awk '/req\/s/ { print $2, "req/s" }'
+
+		kill $pid
+		wait $pid 2>/dev/null || :
+		rm -rf "$OUT/run"
+	done
+done
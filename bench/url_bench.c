@@ -0,0 +1,218 @@
+/*
+** url_bench.c -- URLs parsed per second, old getUriDetails() vs urlParse()
+**
+** usage: url_bench [seconds_per_case]
+**
+** getUriDetails() cuts up the string it is given, so each of its runs
+** starts by copying the URL into a scratch buffer, as a caller parsing
+** more than once would have to. urlParse() also has the request target
+** and Host header copied out, which is what the client does with it.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mempool.h"
+#include "url_parser.h"
+
+struct uriInfo {
+    char  *protocol;
+    char  *server;
+    char  *serverPort;
+    char  *fullPathWithoutPort;
+    char  *port;
+    char  *path;
+};
+
+// getUriDetails() as it was in http_client.c, kept verbatim as the baseline
+static struct uriInfo *getUriDetails(char str[], struct uriInfo *iUriInfo, struct arena *arena){
+    char *token;
+
+    /* get the first token */
+    token = strtok(str, "//");
+
+    /* walk through other tokens */
+    int count = 0;
+    while( token != NULL ) {
+        if(count == 0) {
+              iUriInfo->protocol = token;
+              token = strtok(NULL, "/");
+        }
+        else if(count == 1){
+             iUriInfo->server = token;
+             token = strtok(NULL, "\0");
+        }
+        else {
+           iUriInfo->path = token;
+            token = strtok(NULL, "\0");
+        }
+        count++;
+    }
+
+    //Parse the port from the server if its there
+    if(iUriInfo->server != NULL){
+        char *port;
+        port = strtok(iUriInfo->server, ":");
+        iUriInfo->server = port;
+        if(port != NULL){
+            port = strtok(NULL, ":");
+            if(port != NULL){
+                iUriInfo->port = port;
+            }else{
+                iUriInfo->port = "80";
+            }
+
+        }
+    }
+
+    if(iUriInfo->protocol != NULL && iUriInfo->server != NULL){
+        int fullPathSize = strlen(iUriInfo->protocol)  + strlen("//") + strlen(iUriInfo->server) + strlen("/") + 1;
+        if(iUriInfo->path != NULL){
+            fullPathSize += strlen(iUriInfo->path);
+        }
+
+        char * newBuffer = (char *)arena_alloc(arena, fullPathSize);
+        strcpy(newBuffer,iUriInfo->protocol);
+        strcat(newBuffer,"//");
+        strcat(newBuffer,iUriInfo->server);
+        strcat(newBuffer,"/");
+        if(iUriInfo->path != NULL) {
+            strcat(newBuffer, iUriInfo->path);
+        }
+        iUriInfo->fullPathWithoutPort = newBuffer;
+    }
+
+    if(iUriInfo->port != NULL && iUriInfo->server != NULL){
+        int fullPathSize = strlen(iUriInfo->protocol)  + strlen("//") + strlen(iUriInfo->server) + strlen(":") + strlen(iUriInfo->port) + 1 ;
+
+        char * newBuffer = (char *)arena_alloc(arena, fullPathSize);
+        strcpy(newBuffer,iUriInfo->protocol);
+        strcat(newBuffer,"//");
+        strcat(newBuffer,iUriInfo->server);
+        strcat(newBuffer,":");
+        strcat(newBuffer, iUriInfo->port);
+
+        iUriInfo->serverPort = newBuffer;
+    }
+
+    if(iUriInfo->path != NULL ){
+        int fullPathSize = strlen("/") + strlen(iUriInfo->path) + 1;
+        char * newBuffer = (char *)arena_alloc(arena, fullPathSize);
+        strcpy(newBuffer,"/");
+        strcat(newBuffer,iUriInfo->path);
+
+        iUriInfo->path = newBuffer;
+    }
+
+
+
+    return iUriInfo;
+
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static volatile long sink;
+
+static double benchLegacy(const char *url, double seconds) {
+    char buf[1024];
+    struct uriInfo info;
+    struct arena arena;
+    size_t len = strlen(url) + 1;
+    long n = 0;
+    double start = now(), elapsed;
+
+    arena_init(&arena, 0, NULL);
+    do {
+        for (int i = 0; i < 1000; i++) {
+            memcpy(buf, url, len);
+            memset(&info, 0, sizeof info);
+            getUriDetails(buf, &info, &arena);
+            sink += info.path[1];
+            arena_reset(&arena);
+        }
+        n += 1000;
+    } while ((elapsed = now() - start) < seconds);
+    arena_destroy(&arena);
+    return n / elapsed;
+}
+
+static double benchParser(const char *url, double seconds) {
+    char target[1024], host[300];
+    struct urlParts parts;
+    size_t len = strlen(url);
+    long n = 0;
+    double start = now(), elapsed;
+
+    do {
+        for (int i = 0; i < 1000; i++) {
+            if (urlParse(url, len, &parts) == -1) {
+                fprintf(stderr, "url_bench: parse failed: %s\n", url);
+                exit(1);
+            }
+            urlCopyTarget(url, &parts, target, sizeof target);
+            urlCopyHostHeader(url, &parts, host, sizeof host);
+            sink += parts.portNumber + target[1] + host[0];
+        }
+        n += 1000;
+    } while ((elapsed = now() - start) < seconds);
+    return n / elapsed;
+}
+
+// parse only, no copies
+static double benchParseOnly(const char *url, double seconds) {
+    struct urlParts parts;
+    size_t len = strlen(url);
+    long n = 0;
+    double start = now(), elapsed;
+
+    do {
+        for (int i = 0; i < 1000; i++) {
+            urlParse(url, len, &parts);
+            sink += parts.path.len;
+        }
+        n += 1000;
+    } while ((elapsed = now() - start) < seconds);
+    return n / elapsed;
+}
+
+int main(int argc, char *argv[]) {
+    double seconds = argc > 1 ? atof(argv[1]) : 1.0;
+    const struct {
+        const char *name;
+        const char *url;
+        int legacy;        // getUriDetails() gets it right
+    } cases[] = {
+        { "local", "http://localhost:3490/image.png", 1 },
+        { "no port", "http://example.com/index.html", 1 },
+        { "cdn + query",
+          "http://images.cdn.example.net:8080/assets/v2/products/2026/10/"
+          "c7f3a9e1-4b2d-4e8f-9a61-0d2c5b7e8f13/hero-large.webp"
+          "?w=1280&h=720&fit=crop&auto=format,compress&q=75"
+          "&sig=9f86d081884c7d659a2feaa0c55ad015a3bf4f1b2b0b822cd15d6c15b0f00a08", 1 },
+        { "ipv6 + user", "http://user:pw@[2001:db8::1]:8080/a/b?c=d#frag", 0 },
+    };
+
+    printf("%-14s %6s %16s %16s %16s %10s\n", "url", "bytes", "getUriDetails/s",
+           "urlParse+copy/s", "urlParse/s", "MB/s");
+    for (size_t i = 0; i < sizeof cases / sizeof cases[0]; i++) {
+        size_t len = strlen(cases[i].url);
+        double legacy = cases[i].legacy ? benchLegacy(cases[i].url, seconds) : 0;
+        double fresh = benchParser(cases[i].url, seconds);
+        double bare = benchParseOnly(cases[i].url, seconds);
+        if (cases[i].legacy) {
+            printf("%-14s %6zu %16.0f %16.0f %16.0f %10.0f\n", cases[i].name, len, legacy,
+                   fresh, bare, bare * len / 1e6);
+        } else {
+            printf("%-14s %6zu %16s %16.0f %16.0f %10.0f\n", cases[i].name, len, "-",
+                   fresh, bare, bare * len / 1e6);
+        }
+    }
+    return 0;
+}
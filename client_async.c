@@ -0,0 +1,751 @@
+/*
+** client_async.c -- asynchronous HTTP/1.1 fetches on one epoll loop
+**
+** This is the engine the batch fetcher grew, taken out of it so anything
+** can drive it: per-host pools of keep-alive connections, a request on a
+** pooled connection the server has meanwhile closed retried once on a
+** fresh one, lookups through the DNS cache's resolver threads (answers
+** turn up on its eventfd), and responses framed by the response parser so
+** a connection goes back to its pool the moment its body is complete.
+**
+** New connections race their host's addresses as connectRace() does, but
+** without blocking: families alternate, a new attempt starts every
+** connectDelayMs (at once when one fails) while up to ASYNC_RACE_MAX carry
+** on, and the first to connect wins. The loop sleeps in epoll_wait() no
+** longer than the next attempt is due.
+**
+** A fetch with decode set sends Accept-Encoding and gets its body through
+** a decoder kept with the connection, so zlib's window is allocated once
+** per connection rather than per response.
+**
+** Finished fetches don't resume their coroutine on the spot but go on a
+** ready list run between epoll_wait() calls, so a coroutine is never
+** re-entered from inside the engine and may start its next fetch, on the
+** very connection the last one freed, straight away.
+*/
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "client_async.h"
+#include "client_connect.h"
+#include "client_decode.h"
+#include "client_log.h"
+#include "dns_cache.h"
+#include "url_parser.h"
+
+#define ASYNC_EVENTS 64
+#define ASYNC_CONN_SLAB 8          // connections per slab page
+#define ASYNC_REQUEST_MAX 4096
+
+enum connState {
+    CONN_CONNECTING,
+    CONN_SENDING,
+    CONN_HEAD,
+    CONN_BODY,
+    CONN_IDLE,
+    CONN_CLOSED                    // back in the slab, for events still queued
+};
+
+struct hostPool {
+    char *host;
+    char *port;
+    struct poolConn *idle;         // connections waiting for the next fetch
+    struct hostPool *next;
+};
+
+struct poolConn {
+    struct poolConn *next;         // in the host's idle list; the slab's link when free
+    int fd;                        // -1 until an attempt wins
+    enum connState state;
+    struct hostPool *host;
+    struct dns_entry *dns;         // the host's addresses when it was opened
+    const struct addrinfo *order[ASYNC_MAX_ADDRS];
+    int addrCount;
+    int nextAddr;                  // the next one to try
+    int attemptFd[ASYNC_RACE_MAX]; // connects in flight
+    const struct addrinfo *attemptAddr[ASYNC_RACE_MAX];
+    int attempts;
+    int lastErr;
+    double nextAttemptAt;
+    struct poolConn *nextRacing;
+    char peer[INET6_ADDRSTRLEN];
+    struct httpFetch *fetch;
+    int reused;                    // this isn't the connection's first request
+    char request[ASYNC_REQUEST_MAX];
+    size_t requestLen;
+    size_t sent;
+    char head[ASYNC_HEAD_MAX];
+    size_t received;
+    struct responseParser parser;
+    struct bodyReader body;
+    struct bodyDecoder *decoder;   // made the first time a body needs one
+    int decoding;                  // this body goes through it
+    struct poolConn *nextLive;     // every connection, to close them all at the end
+    struct poolConn **prevLive;
+};
+
+struct httpLoop {
+    int epfd;
+    struct dns_cache *dns;
+    struct hostPool *hosts;
+    struct poolConn *live;
+    struct poolConn *racing;       // still connecting
+    struct coTask *ready;          // to resume, oldest first
+    struct coTask **readyTail;
+    int tasks;                     // spawned and not yet done
+    struct arena strings;          // host pools
+    struct slab conns;             // struct poolConn
+    struct httpLoopStats stats;
+    char scratch[ASYNC_RECV_MAX];
+};
+
+double httpNowMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void makeReady(struct httpLoop *loop, struct coTask *task) {
+    task->nextReady = NULL;
+    *loop->readyTail = task;
+    loop->readyTail = &task->nextReady;
+}
+
+void coSpawn(struct httpLoop *loop, struct coTask *task, coFn fn) {
+    task->line = 0;
+    task->fn = fn;
+    task->loop = loop;
+    loop->tasks++;
+    makeReady(loop, task);
+}
+
+static void finishFetch(struct httpLoop *loop, struct httpFetch *f, const char *error) {
+    f->error = error;
+    f->finished = httpNowMs();
+    makeReady(loop, f->task);
+}
+
+static int discard(void *ctx, const char *data, size_t len) {
+    (void)ctx;
+    (void)data;
+    (void)len;
+    return 0;
+}
+
+static void watch(struct httpLoop *loop, struct poolConn *c, int op, unsigned events) {
+    struct epoll_event ev;
+
+    ev.events = events;
+    ev.data.ptr = c;
+    epoll_ctl(loop->epfd, op, c->fd, &ev);
+}
+
+static struct hostPool *findHost(struct httpLoop *loop, const char *host, const char *port) {
+    struct hostPool *h;
+
+    for (h = loop->hosts; h != NULL; h = h->next) {
+        if (strcmp(h->host, host) == 0 && strcmp(h->port, port) == 0) {
+            return h;
+        }
+    }
+    if ((h = arena_alloc(&loop->strings, sizeof *h)) == NULL) {
+        return NULL;
+    }
+    memset(h, 0, sizeof *h);
+    h->host = arena_strdup(&loop->strings, host);
+    h->port = arena_strdup(&loop->strings, port);
+    if (h->host == NULL || h->port == NULL) {
+        return NULL;
+    }
+    h->next = loop->hosts;
+    loop->hosts = h;
+    return h;
+}
+
+static void stopRacing(struct httpLoop *loop, struct poolConn *c) {
+    struct poolConn **pp;
+    int i;
+
+    for (i = 0; i < c->attempts; i++) {
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, c->attemptFd[i], NULL);
+        close(c->attemptFd[i]);
+    }
+    c->attempts = 0;
+    for (pp = &loop->racing; *pp != NULL; pp = &(*pp)->nextRacing) {
+        if (*pp == c) {
+            *pp = c->nextRacing;
+            break;
+        }
+    }
+}
+
+static void closeConn(struct httpLoop *loop, struct poolConn *c) {
+    struct poolConn **pp;
+
+    if (c->state == CONN_IDLE) {
+        for (pp = &c->host->idle; *pp != NULL; pp = &(*pp)->next) {
+            if (*pp == c) {
+                *pp = c->next;
+                break;
+            }
+        }
+    }
+    if (c->state == CONN_CONNECTING) {
+        stopRacing(loop, c);
+    }
+    if (c->fd != -1) {
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+        close(c->fd);
+    }
+    *c->prevLive = c->nextLive;
+    if (c->nextLive != NULL) {
+        c->nextLive->prevLive = c->prevLive;
+    }
+    dns_release(loop->dns, c->dns);
+    if (c->decoder != NULL) {
+        bodyDecoderFree(c->decoder);
+        free(c->decoder);
+        c->decoder = NULL;
+    }
+    c->fd = -1;
+    c->state = CONN_CLOSED;
+    slab_free(&loop->conns, c);
+}
+
+static void beginRequest(struct poolConn *c, struct httpFetch *f) {
+    c->fetch = f;
+    c->sent = 0;
+    c->received = 0;
+    c->requestLen = snprintf(c->request, sizeof c->request,
+                             "GET %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: httpexperiments\r\n"
+                             "Accept: */*\r\n%s%s\r\n",
+                             f->target, f->hostHeader,
+                             f->decode ? "Accept-Encoding: " DECODE_ACCEPT "\r\n" : "",
+                             f->headers != NULL ? f->headers : "");
+    responseParserInit(&c->parser);
+}
+
+static void startFetch(struct httpLoop *loop, struct httpFetch *f);
+
+// the request on a pooled connection died before a single response byte:
+// the server dropped the idle connection, so try once more on a new one
+static int retryStale(struct httpLoop *loop, struct poolConn *c) {
+    struct httpFetch *f = c->fetch;
+
+    if (!c->reused || c->received > 0 || c->state == CONN_BODY || f->retried) {
+        return 0;
+    }
+    f->retried = 1;
+    c->fetch = NULL;
+    closeConn(loop, c);
+    loop->stats.retried++;
+    LOG(LV_DEBUG, "%s: kept connection was closed, retrying", f->url);
+    startFetch(loop, f);
+    return 1;
+}
+
+static void failConn(struct httpLoop *loop, struct poolConn *c, const char *why) {
+    struct httpFetch *f = c->fetch;
+
+    if (retryStale(loop, c)) {
+        return;
+    }
+    c->fetch = NULL;
+    finishFetch(loop, f, why);
+    closeConn(loop, c);
+}
+
+// start connecting to the next address, unless ASYNC_RACE_MAX are under
+// way already. returns -1 if nothing is in flight and no address is left
+static int startAttempt(struct httpLoop *loop, struct poolConn *c) {
+    const struct addrinfo *ai;
+    struct epoll_event ev;
+    int fd;
+
+    while (c->nextAddr < c->addrCount && c->attempts < ASYNC_RACE_MAX) {
+        ai = c->order[c->nextAddr++];
+        if ((fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK, ai->ai_protocol)) == -1) {
+            c->lastErr = errno;
+            continue;
+        }
+        // one that connects on the spot just turns writable at once
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == -1 && errno != EINPROGRESS) {
+            c->lastErr = errno;
+            close(fd);
+            continue;
+        }
+        ev.events = EPOLLOUT;
+        ev.data.ptr = c;
+        epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev);
+        c->attemptFd[c->attempts] = fd;
+        c->attemptAddr[c->attempts++] = ai;
+        c->nextAttemptAt = httpNowMs() + connectDelayMs;
+        LOG(LV_DEBUG, "connecting to %s:%s (address %d of %d)", c->host->host, c->host->port,
+            c->nextAddr, c->addrCount);
+        return 0;
+    }
+    return c->attempts > 0 ? 0 : -1;
+}
+
+static void onWritable(struct httpLoop *loop, struct poolConn *c);
+
+// attempt w connected: it becomes the connection, the rest are dropped
+static void connected(struct httpLoop *loop, struct poolConn *c, int w) {
+    const struct addrinfo *ai = c->attemptAddr[w];
+    const void *a = ai->ai_family == AF_INET6
+                    ? (const void *)&((const struct sockaddr_in6 *)ai->ai_addr)->sin6_addr
+                    : (const void *)&((const struct sockaddr_in *)ai->ai_addr)->sin_addr;
+
+    c->fd = c->attemptFd[w];
+    c->attemptFd[w] = c->attemptFd[--c->attempts];
+    stopRacing(loop, c);
+    if (inet_ntop(ai->ai_family, a, c->peer, sizeof c->peer) == NULL) {
+        strcpy(c->peer, "?");
+    }
+    strcpy(c->fetch->peer, c->peer);
+    c->fetch->connected = httpNowMs();
+    loop->stats.opened++;
+    c->state = CONN_SENDING;
+    onWritable(loop, c);
+}
+
+static void onConnectEvent(struct httpLoop *loop, struct poolConn *c) {
+    struct pollfd pfd[ASYNC_RACE_MAX];
+    socklen_t len;
+    int i, err, failed = 0;
+
+    for (i = 0; i < c->attempts; i++) {
+        pfd[i].fd = c->attemptFd[i];
+        pfd[i].events = POLLOUT;
+    }
+    if (poll(pfd, c->attempts, 0) <= 0) {
+        return;
+    }
+    for (i = c->attempts - 1; i >= 0; i--) {
+        if (pfd[i].revents == 0) {
+            continue;
+        }
+        len = sizeof err;
+        if (getsockopt(c->attemptFd[i], SOL_SOCKET, SO_ERROR, &err, &len) == -1) {
+            err = errno;
+        }
+        if (err == 0) {
+            connected(loop, c, i);
+            return;
+        }
+        LOG(LV_DEBUG, "connecting to %s:%s: %s", c->host->host, c->host->port, strerror(err));
+        c->lastErr = err;
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, c->attemptFd[i], NULL);
+        close(c->attemptFd[i]);
+        c->attemptFd[i] = c->attemptFd[--c->attempts];
+        c->attemptAddr[i] = c->attemptAddr[c->attempts];
+        failed = 1;
+    }
+    // a failure starts the next attempt at once
+    if (failed && startAttempt(loop, c) == -1) {
+        failConn(loop, c, strerror(c->lastErr));
+    }
+}
+
+// open a new connection for f to one of the addresses in e
+static void openConn(struct httpLoop *loop, struct httpFetch *f, struct dns_entry *e) {
+    struct poolConn *c = slab_alloc(&loop->conns);
+
+    if (c == NULL) {
+        dns_release(loop->dns, e);
+        finishFetch(loop, f, "out of memory");
+        return;
+    }
+    memset(c, 0, sizeof *c);
+    c->fd = -1;
+    c->state = CONN_CONNECTING;
+    c->host = f->pool;
+    c->dns = e;
+    c->addrCount = connectOrder(dns_addrs(e), c->order, ASYNC_MAX_ADDRS);
+    c->lastErr = EHOSTUNREACH;
+    c->nextLive = loop->live;
+    c->prevLive = &loop->live;
+    if (loop->live != NULL) {
+        loop->live->prevLive = &c->nextLive;
+    }
+    loop->live = c;
+    c->nextRacing = loop->racing;
+    loop->racing = c;
+    beginRequest(c, f);
+    if (startAttempt(loop, c) == -1) {
+        failConn(loop, c, strerror(c->lastErr));
+    }
+}
+
+// put f on one of its host's idle connections
+static void reuseConn(struct httpLoop *loop, struct httpFetch *f) {
+    struct poolConn *c = f->pool->idle;
+
+    f->pool->idle = c->next;
+    c->reused = 1;
+    loop->stats.reused++;
+    f->reused = 1;
+    f->resolved = f->connected = httpNowMs();
+    strcpy(f->peer, c->peer);
+    beginRequest(c, f);
+    c->state = CONN_SENDING;
+    watch(loop, c, EPOLL_CTL_MOD, EPOLLOUT);
+}
+
+// dns_poll() callback: a fetch's lookup finished on a resolver thread
+static void onResolved(void *ctx, void *tag, struct dns_entry *e, int err) {
+    struct httpLoop *loop = ctx;
+    struct httpFetch *f = tag;
+
+    if (e == NULL) {
+        finishFetch(loop, f, gai_strerror(err));
+        return;
+    }
+    f->resolved = httpNowMs();
+    if (f->pool->idle != NULL) {
+        // a connection came free while we waited
+        dns_release(loop->dns, e);
+        reuseConn(loop, f);
+    } else {
+        openConn(loop, f, e);
+    }
+}
+
+static void startFetch(struct httpLoop *loop, struct httpFetch *f) {
+    struct dns_entry *e;
+    int rv;
+
+    if (f->pool->idle != NULL) {
+        reuseConn(loop, f);
+        return;
+    }
+    // looked up afresh for every new connection, so the cache's TTL holds
+    // even over a long run
+    rv = dns_resolve_async(loop->dns, f->host, f->port, SOCK_STREAM, f, &e);
+    if (rv == 0) {
+        f->resolved = httpNowMs();
+        openConn(loop, f, e);
+    } else if (rv != DNS_PENDING) {
+        finishFetch(loop, f, gai_strerror(rv));
+    }
+}
+
+void httpGet(struct coTask *task, struct httpFetch *f) {
+    struct httpLoop *loop = task->loop;
+    const char *url = f->url;
+    struct urlParts uri;
+
+    f->task = task;
+    f->error = NULL;
+    f->statusCode = 0;
+    f->bodyBytes = 0;
+    f->wireBytes = 0;
+    f->reused = 0;
+    f->retried = 0;
+    f->peer[0] = '\0';
+    f->started = httpNowMs();
+    f->resolved = f->connected = f->firstByte = f->finished = -1;
+
+    if (urlParse(url, strlen(url), &uri) == -1 || !urlSchemeIs(url, &uri, "http") ||
+        uri.host.len == 0 || urlCopyHost(url, &uri, f->host, sizeof f->host) == -1 ||
+        urlCopyTarget(url, &uri, f->target, sizeof f->target) == -1 ||
+        urlCopyHostHeader(url, &uri, f->hostHeader, sizeof f->hostHeader) == -1) {
+        finishFetch(loop, f, "not an http:// URL");
+        return;
+    }
+    snprintf(f->port, sizeof f->port, "%d", uri.portNumber);
+    // the request line, Host, the fixed headers and the caller's must fit
+    if (strlen(f->target) + strlen(f->hostHeader) + 112 +
+        (f->headers != NULL ? strlen(f->headers) : 0) >= ASYNC_REQUEST_MAX) {
+        finishFetch(loop, f, "request too long");
+        return;
+    }
+    if ((f->pool = findHost(loop, f->host, f->port)) == NULL) {
+        finishFetch(loop, f, "out of memory");
+        return;
+    }
+    startFetch(loop, f);
+}
+
+// the response is complete: hand the connection back to its host's pool
+// if it can carry another request, otherwise close it
+static void completeFetch(struct httpLoop *loop, struct poolConn *c, int reusable) {
+    struct httpFetch *f = c->fetch;
+
+    f->wireBytes = c->body.received;
+    f->bodyBytes = c->decoding ? c->decoder->decoded : c->body.received;
+    if (c->decoding && bodyDecoderFinish(c->decoder) == -1) {
+        failConn(loop, c, "compressed body cut short");
+        return;
+    }
+    c->fetch = NULL;
+    finishFetch(loop, f, NULL);
+
+    if (!reusable) {
+        closeConn(loop, c);
+        return;
+    }
+    c->state = CONN_IDLE;
+    c->next = c->host->idle;
+    c->host->idle = c;
+    // while idle, readable means the server closed it
+    watch(loop, c, EPOLL_CTL_MOD, EPOLLIN | EPOLLRDHUP);
+}
+
+// body bytes arrived in data: decode them and finish the fetch when it's done
+static void feedBody(struct httpLoop *loop, struct poolConn *c, const char *data, size_t len) {
+    struct httpFetch *f = c->fetch;
+    size_t used;
+    int done;
+
+    // a coded body reaches the fetch's sink through the decoder
+    if (c->decoding) {
+        done = bodyReaderFeed(&c->body, data, len, &used, bodyDecoderFeed, c->decoder);
+    } else {
+        done = bodyReaderFeed(&c->body, data, len, &used, f->sink != NULL ? f->sink : discard,
+                              f->ctx);
+    }
+
+    if (done == -1) {
+        failConn(loop, c, "malformed response body, or it couldn't be written");
+    } else if (done == 1) {
+        // anything after the body is a response nobody asked for
+        completeFetch(loop, c, bodyReaderReusable(&c->body, &c->parser.head) && used == len);
+    }
+}
+
+static void onHeadComplete(struct httpLoop *loop, struct poolConn *c) {
+    struct httpFetch *f = c->fetch;
+
+    LOG(LV_DEBUG, "status %d, %zu byte header, content-length %lld%s", c->parser.head.statusCode,
+        c->parser.head.headerLength, c->parser.head.contentLength,
+        c->parser.head.chunked ? ", chunked" : "");
+    c->state = CONN_BODY;
+    f->statusCode = c->parser.head.statusCode;
+    if (f->onHead != NULL && f->onHead(f->ctx, f, &c->parser.head) == -1) {
+        failConn(loop, c, "abandoned after the response header");
+        return;
+    }
+    bodyReaderInit(&c->body, &c->parser.head, 0);
+    c->decoding = 0;
+    if (f->decode) {
+        if (c->decoder == NULL && (c->decoder = calloc(1, sizeof *c->decoder)) == NULL) {
+            failConn(loop, c, "out of memory");
+            return;
+        }
+        if ((c->decoding = bodyDecoderStart(c->decoder, &c->parser.head,
+                                            f->sink != NULL ? f->sink : discard, f->ctx)) == -1) {
+            c->decoding = 0;
+            failConn(loop, c, "unknown Content-Encoding");
+            return;
+        }
+    }
+    feedBody(loop, c, c->head + c->parser.head.headerLength,
+             c->received - c->parser.head.headerLength);
+}
+
+static void onReadable(struct httpLoop *loop, struct poolConn *c) {
+    ssize_t n;
+    int parsed;
+
+    if (c->state == CONN_HEAD) {
+        n = recv(c->fd, c->head + c->received, sizeof c->head - c->received, 0);
+    } else {
+        n = recv(c->fd, loop->scratch, sizeof loop->scratch, 0);
+    }
+    if (n == -1) {
+        if (errno != EAGAIN && errno != EINTR) {
+            failConn(loop, c, strerror(errno));
+        }
+        return;
+    }
+    if (n == 0) {
+        if (c->state == CONN_BODY && bodyReaderEof(&c->body)) {
+            completeFetch(loop, c, 0);
+        } else {
+            failConn(loop, c, "connection closed early");
+        }
+        return;
+    }
+
+    if (c->state == CONN_BODY) {
+        LOG_DATA(LV_DEBUG, "received", loop->scratch, n);
+        feedBody(loop, c, loop->scratch, n);
+        return;
+    }
+    if (c->received == 0) {
+        c->fetch->firstByte = httpNowMs();
+    }
+    LOG_DATA(LV_DEBUG, "received", c->head + c->received, n);
+    c->received += n;
+    if ((parsed = responseParserFeed(&c->parser, c->head, c->received)) == -1) {
+        failConn(loop, c, "malformed response header");
+    } else if (parsed == 1) {
+        onHeadComplete(loop, c);
+    } else if (c->received == sizeof c->head) {
+        failConn(loop, c, "response header too large");
+    }
+}
+
+static void onWritable(struct httpLoop *loop, struct poolConn *c) {
+    ssize_t n;
+
+    while (c->sent < c->requestLen) {
+        n = send(c->fd, c->request + c->sent, c->requestLen - c->sent, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno != EAGAIN && errno != EINTR) {
+                failConn(loop, c, strerror(errno));
+            }
+            return;
+        }
+        c->sent += n;
+    }
+    c->state = CONN_HEAD;
+    watch(loop, c, EPOLL_CTL_MOD, EPOLLIN | EPOLLRDHUP);
+}
+
+// an idle connection turned readable: the server closed it, unless the
+// event is stale (its slot was freed and taken again in the same batch)
+static void onIdleEvent(struct httpLoop *loop, struct poolConn *c) {
+    char byte;
+
+    if (recv(c->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) == -1 && errno == EAGAIN) {
+        return;
+    }
+    closeConn(loop, c);
+}
+
+// ms until a racing connection is due another attempt, -1 if none is
+static int raceTimeout(const struct httpLoop *loop) {
+    const struct poolConn *c;
+    double due = -1, now;
+
+    for (c = loop->racing; c != NULL; c = c->nextRacing) {
+        if (c->nextAddr < c->addrCount && c->attempts < ASYNC_RACE_MAX &&
+            (due < 0 || c->nextAttemptAt < due)) {
+            due = c->nextAttemptAt;
+        }
+    }
+    if (due < 0) {
+        return -1;
+    }
+    now = httpNowMs();
+    return due <= now ? 0 : (int)(due - now) + 1;
+}
+
+static void raceTimers(struct httpLoop *loop) {
+    struct poolConn *c, *next;
+    double now = httpNowMs();
+
+    for (c = loop->racing; c != NULL; c = next) {
+        next = c->nextRacing;
+        if (c->nextAddr < c->addrCount && c->attempts < ASYNC_RACE_MAX && now >= c->nextAttemptAt) {
+            startAttempt(loop, c);
+        }
+    }
+}
+
+static void runReady(struct httpLoop *loop) {
+    struct coTask *task;
+
+    while ((task = loop->ready) != NULL) {
+        if ((loop->ready = task->nextReady) == NULL) {
+            loop->readyTail = &loop->ready;
+        }
+        if (task->fn(task) == CO_DONE) {
+            loop->tasks--;
+        }
+    }
+}
+
+int httpLoopRun(struct httpLoop *loop) {
+    struct epoll_event events[ASYNC_EVENTS];
+    struct poolConn *c;
+    int n, i;
+
+    for (;;) {
+        runReady(loop);
+        if (loop->tasks == 0) {
+            return 0;
+        }
+        if ((n = epoll_wait(loop->epfd, events, ASYNC_EVENTS, raceTimeout(loop))) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            return -1;
+        }
+        for (i = 0; i < n; i++) {
+            c = events[i].data.ptr;
+            if (c == NULL) {
+                dns_poll(loop->dns, onResolved, loop);
+            } else if (c->state == CONN_CLOSED) {
+                continue;
+            } else if (c->state == CONN_IDLE) {
+                onIdleEvent(loop, c);
+            } else if (c->state == CONN_CONNECTING) {
+                onConnectEvent(loop, c);
+            } else if (c->state == CONN_SENDING) {
+                onWritable(loop, c);
+            } else {
+                onReadable(loop, c);
+            }
+        }
+        raceTimers(loop);
+    }
+}
+
+struct httpLoop *httpLoopCreate(int dnsThreads) {
+    struct httpLoop *loop = calloc(1, sizeof *loop);
+    struct epoll_event ev;
+
+    if (loop == NULL) {
+        return NULL;
+    }
+    loop->readyTail = &loop->ready;
+    arena_init(&loop->strings, 0, NULL);
+    slab_init(&loop->conns, sizeof(struct poolConn), ASYNC_CONN_SLAB, &loop->stats.conns);
+    if ((loop->epfd = epoll_create1(0)) == -1) {
+        free(loop);
+        return NULL;
+    }
+    if ((loop->dns = dns_cache_create(dnsThreads, DNS_TTL, DNS_NEGATIVE_TTL)) == NULL) {
+        close(loop->epfd);
+        free(loop);
+        return NULL;
+    }
+    // lookup answers show up as an event with no connection attached
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(loop->epfd, EPOLL_CTL_ADD, dns_event_fd(loop->dns), &ev);
+    return loop;
+}
+
+void httpLoopDestroy(struct httpLoop *loop) {
+    while (loop->live != NULL) {
+        closeConn(loop, loop->live);
+    }
+    slab_destroy(&loop->conns);
+    arena_destroy(&loop->strings);
+    dns_cache_destroy(loop->dns);
+    close(loop->epfd);
+    free(loop);
+}
+
+void httpLoopGetStats(const struct httpLoop *loop, struct httpLoopStats *stats) {
+    *stats = loop->stats;
+}
+
+struct dns_cache *httpLoopDns(struct httpLoop *loop) {
+    return loop->dns;
+}
@@ -0,0 +1,125 @@
+/*
+** client_async.h -- asynchronous HTTP/1.1 fetches on one epoll loop, awaited
+** from stackless coroutines
+**
+** A coroutine is a function taking its struct coTask, with its body between
+** CO_BEGIN and CO_END. CO_AWAIT(task, httpGet(task, &fetch)) starts a fetch
+** and returns to the loop; once the response is in (or the fetch failed)
+** the loop calls the function again and it carries on after the CO_AWAIT.
+** Locals don't survive that: anything needed afterwards lives in a struct
+** that embeds the coTask as its first member, e.g.
+**
+**     struct getter { struct coTask task; struct httpFetch fetch; };
+**
+**     static int get(struct coTask *task) {
+**         struct getter *g = (struct getter *)task;
+**         CO_BEGIN(task);
+**         g->fetch.url = "http://localhost:3490/";
+**         CO_AWAIT(task, httpGet(task, &g->fetch));
+**         printf("%d\n", g->fetch.statusCode);
+**         CO_END(task);
+**     }
+**
+** Any number of coroutines can be spawned on a loop, each with fetches in
+** flight; connections are kept per host and reused, lookups go through a
+** DNS cache on resolver threads, and a host's addresses are raced happy
+** eyeballs style, all without blocking the loop or starting a thread per
+** request. A fetch can ask for a compressed body, which is decoded on the
+** way to its sink (client_decode.h). A loop belongs to the thread that
+** runs it.
+*/
+
+#ifndef CLIENT_ASYNC_H
+#define CLIENT_ASYNC_H
+
+#include <netinet/in.h>
+
+#include "coroutine.h"
+#include "mempool.h"
+#include "response_parser.h"
+
+#define ASYNC_HEAD_MAX 16384       // response header block limit per connection
+#define ASYNC_RECV_MAX 65536       // body bytes read per recv()
+#define ASYNC_TARGET_MAX 2048      // longest path and query
+#define ASYNC_MAX_ADDRS 16         // addresses tried per new connection
+#define ASYNC_RACE_MAX 4           // connects in flight at once per connection
+
+struct httpLoop;
+struct coTask;
+
+typedef int (*coFn)(struct coTask *task);
+
+struct coTask {
+    int line;                      // where the last CO_AWAIT left off, 0 to start
+    coFn fn;
+    struct httpLoop *loop;
+    struct coTask *nextReady;
+};
+
+struct hostPool;
+
+struct httpFetch {
+    // set by the caller
+    const char *url;
+    const char *headers;           // extra header lines, each ending in \r\n, or NULL
+    // the response head is in: look at it and point sink somewhere (or
+    // leave it NULL to drop the body). -1 abandons the fetch
+    int (*onHead)(void *ctx, struct httpFetch *fetch, const struct responseHead *head);
+    bodySink sink;
+    void *ctx;
+    int decode;                    // ask for gzip (or zstd) and hand sink the decoded body
+
+    // filled in by then the coroutine resumes
+    const char *error;             // NULL if a response came back, else why not
+    int statusCode;
+    long long bodyBytes;           // decoded
+    long long wireBytes;           // as they came, before decoding
+    int reused;                    // went out on a connection kept from before
+    char peer[INET6_ADDRSTRLEN];   // the address it was sent to
+    // when each phase ended, ms on CLOCK_MONOTONIC: the lookup and connect
+    // take no time on a reused connection. -1 if never reached
+    double started, resolved, connected, firstByte, finished;
+
+    // the loop's
+    struct coTask *task;
+    struct hostPool *pool;
+    int retried;
+    char host[256];
+    char port[8];
+    char hostHeader[272];
+    char target[ASYNC_TARGET_MAX];
+};
+
+struct httpLoopStats {
+    int opened;                    // connections made
+    int reused;                    // requests that went on a kept connection
+    int retried;                   // requests resent after a kept connection died
+    struct pool_stats conns;
+};
+
+// dnsThreads resolver threads for lookups that aren't cached. NULL if out of
+// memory or descriptors
+struct httpLoop *httpLoopCreate(int dnsThreads);
+
+// closes every kept connection. coroutines still pending are dropped
+void httpLoopDestroy(struct httpLoop *loop);
+
+// run task's fn from the start, on the next httpLoopRun()
+void coSpawn(struct httpLoop *loop, struct coTask *task, coFn fn);
+
+// start fetching fetch->url for task, which is resumed when it's done.
+// meant for CO_AWAIT: it never finishes before returning, even on a bad URL
+void httpGet(struct coTask *task, struct httpFetch *fetch);
+
+// run until every spawned coroutine has reached CO_END. returns 0, or -1 if
+// epoll failed
+int httpLoopRun(struct httpLoop *loop);
+
+void httpLoopGetStats(const struct httpLoop *loop, struct httpLoopStats *stats);
+
+// the loop's cache, for lookups made outside a fetch
+struct dns_cache *httpLoopDns(struct httpLoop *loop);
+
+double httpNowMs(void);
+
+#endif
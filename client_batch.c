@@ -0,0 +1,336 @@
+/*
+** client_batch.c -- fetch a list of URLs over pooled keep-alive connections
+**
+** Every URL becomes a job. `concurrency` coroutines on one client_async
+** loop take jobs off the list in turn, each awaiting its fetch before
+** taking the next, so at most that many are in flight. The loop keeps each
+** host's connections whose last response left them reusable, so thousands
+** of objects from a few hosts cost a handful of TCP handshakes; a pooled
+** connection the server has meanwhile closed costs a retry, not a failure,
+** and lookups that aren't cached run on resolver threads without holding
+** the other fetches up.
+**
+** Once the list is loaded nothing on the loop calls malloc() but to open
+** a connection: the jobs' strings sit in one arena for the whole batch,
+** connections come from a slab that only grows when more are open at once
+** than ever before, and each has its body decoder made once.
+**
+** Bodies are asked for compressed unless -I says not to, and written out
+** decoded; the report says how much that saved on the wire.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "client_async.h"
+#include "client_batch.h"
+#include "dns_cache.h"
+#include "mempool.h"
+#include "url_parser.h"
+
+struct batchJob {
+    char *url;
+    char *path;                    // path and query, to name the output after
+    size_t index;
+    int ok;
+    double latency;
+    long long bytes;
+    long long wireBytes;
+};
+
+struct batch;
+
+// one of the coroutines working through the list
+struct batchWorker {
+    struct coTask task;
+    struct batch *b;
+    struct batchJob *job;
+    struct httpFetch fetch;
+    FILE *out;
+};
+
+struct batch {
+    const struct batchOptions *opts;
+    struct httpLoop *loop;
+    struct batchJob *jobs;
+    size_t jobCount;
+    size_t nextJob;
+    struct arena strings;          // urls and paths, for the whole batch
+    struct batchWorker *workers;
+    size_t done;
+    size_t failed;
+    long long bytes;
+    long long wireBytes;
+};
+
+static double nowSeconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// the request target of an http:// url, copied into the arena
+static char *urlPath(struct arena *a, const char *url) {
+    struct urlParts uri;
+    size_t size;
+    char *path;
+
+    if (urlParse(url, strlen(url), &uri) == -1 || !urlSchemeIs(url, &uri, "http") ||
+        uri.host.len == 0) {
+        return NULL;
+    }
+    // room for a '/' in front of an empty path, and the NUL
+    size = uri.path.len + (uri.query.off >= 0 ? uri.query.len + 1 : 0) + 2;
+    if ((path = arena_alloc(a, size)) == NULL ||
+        urlCopyTarget(url, &uri, path, size) == -1) {
+        return NULL;
+    }
+    return path;
+}
+
+// read the URL list, skipping blank lines and #comments
+static int loadJobs(struct batch *b) {
+    FILE *fp = strcmp(b->opts->listPath, "-") == 0 ? stdin : fopen(b->opts->listPath, "r");
+    size_t cap = 0, lineCap = 0;
+    ssize_t n;
+    char *line = NULL;
+    struct batchJob *job, *grown;
+    int rv = 0;
+
+    if (fp == NULL) {
+        perror(b->opts->listPath);
+        return -1;
+    }
+    while ((n = getline(&line, &lineCap, fp)) != -1) {
+        while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r' || line[n - 1] == ' ')) {
+            line[--n] = '\0';
+        }
+        if (n == 0 || line[0] == '#') {
+            continue;
+        }
+        if (b->jobCount == cap) {
+            cap = cap ? cap * 2 : 256;
+            if ((grown = realloc(b->jobs, cap * sizeof *b->jobs)) == NULL) {
+                perror("realloc");
+                rv = -1;
+                break;
+            }
+            b->jobs = grown;
+        }
+        job = &b->jobs[b->jobCount];
+        memset(job, 0, sizeof *job);
+        job->url = arena_strdup(&b->strings, line);
+        job->index = b->jobCount;
+        if (job->url == NULL || (job->path = urlPath(&b->strings, job->url)) == NULL) {
+            fprintf(stderr, "client: skipping bad url %s\n", line);
+            continue;
+        }
+        b->jobCount++;
+    }
+    free(line);
+    if (fp != stdin) {
+        fclose(fp);
+    }
+    return rv;
+}
+
+// where job's body goes: outDir/000042-name, name from the last path segment
+static void outputPath(const struct batch *b, const struct batchJob *job, char *out, size_t size) {
+    const char *name = strrchr(job->path, '/') + 1;
+    size_t len, i;
+
+    len = snprintf(out, size, "%s/%06zu-", b->opts->outDir, job->index);
+    if (*name == '\0' || *name == '?') {
+        name = "index.html";
+    }
+    for (i = 0; name[i] != '\0' && name[i] != '?' && len + 1 < size; i++) {
+        char c = name[i];
+        int safe = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+                   (c >= '0' && c <= '9') || c == '.' || c == '-' || c == '_';
+        out[len++] = safe ? c : '_';
+    }
+    out[len] = '\0';
+}
+
+// the single fetch writes its markers into "output", do the same per job
+static void writeMarker(const struct batch *b, const struct batchJob *job, const char *marker) {
+    char path[4096];
+    FILE *fp;
+
+    outputPath(b, job, path, sizeof path);
+    if ((fp = fopen(path, "w")) != NULL) {
+        fputs(marker, fp);
+        fclose(fp);
+    }
+}
+
+static int writeBody(void *ctx, const char *data, size_t len) {
+    struct batchWorker *w = ctx;
+
+    return fwrite(data, 1, len, w->out) == len ? 0 : -1;
+}
+
+// the head is in: the body goes to the job's file, or nowhere for a 404
+// (it is still read, to keep the connection)
+static int openOutput(void *ctx, struct httpFetch *f, const struct responseHead *head) {
+    struct batchWorker *w = ctx;
+    char path[4096];
+
+    if (head->statusCode == 404) {
+        f->sink = NULL;
+        return 0;
+    }
+    outputPath(w->b, w->job, path, sizeof path);
+    if ((w->out = fopen(path, "wb")) == NULL) {
+        perror(path);
+        return -1;
+    }
+    f->sink = writeBody;
+    return 0;
+}
+
+static void finishJob(struct batchWorker *w) {
+    struct batch *b = w->b;
+    struct batchJob *job = w->job;
+    struct httpFetch *f = &w->fetch;
+
+    if (w->out != NULL) {
+        fclose(w->out);
+        w->out = NULL;
+    }
+    job->latency = (f->finished - f->started) / 1e3;
+    job->bytes = f->bodyBytes;
+    job->wireBytes = f->wireBytes;
+    job->ok = f->error == NULL && f->statusCode != 404;
+    if (job->ok) {
+        b->bytes += job->bytes;
+        b->wireBytes += job->wireBytes;
+    } else {
+        if (f->error != NULL) {
+            fprintf(stderr, "client: %s: %s\n", job->url, f->error);
+        }
+        b->failed++;
+        writeMarker(b, job, f->error == NULL ? "FILENOTFOUND" : "NOCONNECTION");
+    }
+    b->done++;
+}
+
+// take the next job, fetch it, repeat until the list runs out
+static int runWorker(struct coTask *task) {
+    struct batchWorker *w = (struct batchWorker *)task;
+    struct batch *b = w->b;
+
+    CO_BEGIN(task);
+    while (b->nextJob < b->jobCount) {
+        w->job = &b->jobs[b->nextJob++];
+        memset(&w->fetch, 0, sizeof w->fetch);
+        w->fetch.url = w->job->url;
+        w->fetch.onHead = openOutput;
+        w->fetch.ctx = w;
+        w->fetch.decode = !b->opts->identity;
+        CO_AWAIT(task, httpGet(task, &w->fetch));
+        finishJob(w);
+    }
+    CO_END(task);
+}
+
+static int compareDouble(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(const double *sorted, size_t n, double p) {
+    size_t i = (size_t)(p / 100 * n);
+    return sorted[i < n ? i : n - 1];
+}
+
+static void report(const struct batch *b, double elapsed) {
+    double *lat = malloc((b->jobCount + 1) * sizeof *lat);
+    struct httpLoopStats st;
+    struct dns_stats dns;
+    size_t i, n = 0, ok = 0;
+
+    for (i = 0; i < b->jobCount; i++) {
+        if (b->jobs[i].ok) {
+            ok++;
+            // without room for the latencies there's no percentile line
+            if (lat != NULL) {
+                lat[n++] = b->jobs[i].latency * 1e3;
+            }
+        }
+    }
+    httpLoopGetStats(b->loop, &st);
+    printf("batch: %zu urls, %zu ok, %zu failed in %.3f s\n",
+           b->jobCount, ok, b->failed, elapsed);
+    printf("batch: %.1f req/s, %.2f MB/s, %d connections opened, %d reused\n",
+           b->done / elapsed, b->bytes / elapsed / 1e6, st.opened, st.reused);
+    if (n > 0) {
+        qsort(lat, n, sizeof *lat, compareDouble);
+        printf("batch: latency ms p50 %.2f p90 %.2f p99 %.2f max %.2f\n",
+               percentile(lat, n, 50), percentile(lat, n, 90),
+               percentile(lat, n, 99), lat[n - 1]);
+    }
+    if (b->wireBytes < b->bytes) {
+        printf("batch: %.2f MB on the wire for %.2f MB of bodies, %.1f%% saved by compression\n",
+               b->wireBytes / 1e6, b->bytes / 1e6, 100.0 * (b->bytes - b->wireBytes) / b->bytes);
+    }
+    free(lat);
+    dns_get_stats(httpLoopDns(b->loop), &dns);
+    printf("batch: dns %lu hits, %lu misses, %lu joined a pending lookup\n",
+           dns.hits + dns.negative_hits, dns.misses, dns.coalesced);
+    printf("batch: alloc %lu connections from %lu mallocs, %lu strings in %lu chunks\n",
+           st.conns.allocs, st.conns.sys_allocs,
+           b->strings.st->allocs, b->strings.st->sys_allocs);
+}
+
+int runBatch(const struct batchOptions *opts) {
+    struct batch *b = calloc(1, sizeof *b);
+    double start;
+    int i, result = -1;
+
+    if (b == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    b->opts = opts;
+    arena_init(&b->strings, 64 * 1024, NULL);
+    if (loadJobs(b) == -1) {
+        goto out;
+    }
+    if (mkdir(opts->outDir, 0755) == -1 && errno != EEXIST) {
+        perror(opts->outDir);
+        goto out;
+    }
+    if ((b->loop = httpLoopCreate(DNS_THREADS)) == NULL) {
+        perror("httpLoopCreate");
+        goto out;
+    }
+    if ((b->workers = calloc(opts->concurrency, sizeof *b->workers)) == NULL) {
+        perror("calloc");
+        goto out;
+    }
+    for (i = 0; i < opts->concurrency; i++) {
+        b->workers[i].b = b;
+        coSpawn(b->loop, &b->workers[i].task, runWorker);
+    }
+
+    start = nowSeconds();
+    if (httpLoopRun(b->loop) == 0) {
+        report(b, nowSeconds() - start);
+        result = b->failed > 0;
+    }
+
+out:
+    if (b->loop != NULL) {
+        httpLoopDestroy(b->loop);
+    }
+    free(b->workers);
+    free(b->jobs);
+    arena_destroy(&b->strings);
+    free(b);
+    return result;
+}
@@ -0,0 +1,22 @@
+/*
+** client_batch.h -- fetch a list of URLs over pooled keep-alive connections
+*/
+
+#ifndef CLIENT_BATCH_H
+#define CLIENT_BATCH_H
+
+#define BATCH_CONCURRENCY 8 // requests in flight at once unless -c says otherwise
+
+struct batchOptions {
+    const char *listPath;          // one URL per line, "-" for stdin
+    const char *outDir;            // bodies are written here, one file each
+    int concurrency;
+    int identity;                  // don't ask for compressed bodies
+};
+
+// fetch every URL in the list on one epoll loop, print throughput and
+// latency percentiles. returns 0 if all of them succeeded, 1 if some
+// failed and -1 if the batch couldn't start at all.
+int runBatch(const struct batchOptions *opts);
+
+#endif
@@ -0,0 +1,179 @@
+/*
+** client_connect.c -- race connects across a host's addresses
+**
+** A blocking connect() per address means one unreachable address (typically
+** IPv6 on a network that doesn't route it) holds everything up for the
+** whole TCP timeout before the next is tried. Here the addresses are sorted
+** so the families alternate, as RFC 8305 section 4 has it, and each attempt
+** is a non-blocking connect started connectDelayMs after the previous one,
+** all of them waited on together with poll().
+*/
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "client_connect.h"
+#include "client_log.h"
+
+int connectDelayMs = CONNECT_DELAY_MS;
+
+static long long nowMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static const char *addrName(const struct addrinfo *ai, char *out, size_t size) {
+    const void *a = ai->ai_family == AF_INET6
+                    ? (const void *)&((const struct sockaddr_in6 *)ai->ai_addr)->sin6_addr
+                    : (const void *)&((const struct sockaddr_in *)ai->ai_addr)->sin_addr;
+    return inet_ntop(ai->ai_family, a, out, size) != NULL ? out : "?";
+}
+
+int connectOrder(const struct addrinfo *addrs, const struct addrinfo **order, int max) {
+    const struct addrinfo *ai, *other;
+    int n = 0;
+
+    // walk the list twice at once: one cursor on each family
+    ai = addrs;
+    other = addrs;
+    while (n < max && (ai != NULL || other != NULL)) {
+        while (ai != NULL && ai->ai_family != addrs->ai_family) {
+            ai = ai->ai_next;
+        }
+        while (other != NULL && other->ai_family == addrs->ai_family) {
+            other = other->ai_next;
+        }
+        if (ai != NULL) {
+            order[n++] = ai;
+            ai = ai->ai_next;
+        }
+        if (other != NULL && n < max) {
+            order[n++] = other;
+            other = other->ai_next;
+        }
+    }
+    return n;
+}
+
+// start a non-blocking connect. returns the socket, -1 if it failed already;
+// *connected says it needs no waiting
+static int startAttempt(const struct addrinfo *ai, int *connected) {
+    int fd;
+
+    *connected = 0;
+    if ((fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK, ai->ai_protocol)) == -1) {
+        return -1;
+    }
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+        *connected = 1;
+    } else if (errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int connectRace(const struct addrinfo *addrs, const struct addrinfo **winner) {
+    const struct addrinfo **order, **tried, *ai;
+    struct pollfd *pfd;
+    char name[INET6_ADDRSTRLEN];
+    long long nextStart, wait;
+    int count, next = 0, active = 0, fd = -1, connected, err, lastErr = 0, i;
+    socklen_t len;
+
+    for (count = 0, ai = addrs; ai != NULL; ai = ai->ai_next) {
+        count++;
+    }
+    if ((order = malloc(count * sizeof *order)) == NULL) {
+        return -1;
+    }
+    count = connectOrder(addrs, order, count);
+    pfd = calloc(count, sizeof *pfd);
+    tried = calloc(count, sizeof *tried);
+    if (pfd == NULL || tried == NULL) {
+        goto out;
+    }
+
+    nextStart = nowMs();
+    while (fd == -1 && (active > 0 || next < count)) {
+        // another attempt is due, or nothing else is left running
+        if (next < count && (active == 0 || nowMs() >= nextStart)) {
+            int s;
+
+            ai = order[next++];
+            s = startAttempt(ai, &connected);
+
+            LOG(LV_DEBUG, "trying %s", addrName(ai, name, sizeof name));
+            if (s == -1) {
+                lastErr = errno;
+                LOG(LV_DEBUG, "%s: %s", addrName(ai, name, sizeof name), strerror(errno));
+                continue; // on to the next address right away
+            }
+            if (connected) {
+                fd = s;
+                *winner = ai;
+                break;
+            }
+            pfd[active].fd = s;
+            pfd[active].events = POLLOUT;
+            tried[active++] = ai;
+            nextStart = nowMs() + connectDelayMs;
+        }
+
+        wait = next < count ? nextStart - nowMs() : -1;
+        if (next < count && wait < 0) {
+            wait = 0;
+        }
+        if (poll(pfd, active, (int)wait) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        for (i = 0; i < active; i++) {
+            if (pfd[i].revents == 0) {
+                continue;
+            }
+            len = sizeof err;
+            if (getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1) {
+                err = errno;
+            }
+            if (err == 0) {
+                fd = pfd[i].fd;
+                *winner = tried[i];
+                pfd[i] = pfd[--active];
+                tried[i] = tried[active];
+                break;
+            }
+            lastErr = err;
+            LOG(LV_DEBUG, "%s: %s", addrName(tried[i], name, sizeof name), strerror(err));
+            close(pfd[i].fd);
+            pfd[i] = pfd[--active];
+            tried[i--] = tried[active];
+            nextStart = nowMs(); // a failure starts the next attempt at once
+        }
+    }
+
+    // the losers
+    for (i = 0; i < active; i++) {
+        close(pfd[i].fd);
+    }
+    if (fd != -1) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    } else if (lastErr != 0) {
+        errno = lastErr; // for the caller's perror()
+    }
+out:
+    free(order);
+    free(pfd);
+    free(tried);
+    return fd;
+}
@@ -0,0 +1,26 @@
+/*
+** client_connect.h -- race connects across a host's addresses
+*/
+
+#ifndef CLIENT_CONNECT_H
+#define CLIENT_CONNECT_H
+
+#include <netdb.h>
+
+#define CONNECT_DELAY_MS 250 // RFC 8305's recommended connection attempt delay
+
+extern int connectDelayMs;
+
+// addrs in the order to try them, at most max: the first address's family,
+// then the other family, alternating while both last (RFC 8305 section 4).
+// returns how many were put in order.
+int connectOrder(const struct addrinfo *addrs, const struct addrinfo **order, int max);
+
+// connect to one of addrs, happy-eyeballs style: address families are
+// interleaved and a new attempt starts every connectDelayMs (or as soon as
+// one fails) while the earlier ones carry on. the first to connect wins
+// and the others are closed. returns the connected, blocking socket with
+// *winner set to its address, or -1.
+int connectRace(const struct addrinfo *addrs, const struct addrinfo **winner);
+
+#endif
@@ -0,0 +1,178 @@
+/*
+** client_decode.c -- undo a response's Content-Encoding as the body streams in
+**
+** Sits between the body reader and whatever the body is written to: each
+** piece of the coded body is inflated (or run through zstd) into a small
+** buffer that is handed on as it fills, so a body of any size is decoded
+** in constant memory and nothing waits for the end of it. The body reader
+** has already taken the chunked framing off by then.
+**
+** gzip allows several members back to back and zstd several frames, and
+** both are decoded as one stream. A body that stops in the middle of one
+** is reported as cut short rather than passed off as complete.
+*/
+
+#include <string.h>
+#include <strings.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "client_decode.h"
+#include "client_log.h"
+
+// "gzip", "x-gzip" or "zstd", nothing else stacked on top
+static int parseCoding(const struct strView *v, enum contentCoding *coding) {
+    const char *p;
+    size_t len;
+
+    if (v == NULL) {
+        *coding = CODING_IDENTITY;
+        return 0;
+    }
+    for (p = v->ptr, len = v->len; len > 0 && (*p == ' ' || *p == '\t'); p++, len--) {
+    }
+    while (len > 0 && (p[len - 1] == ' ' || p[len - 1] == '\t')) {
+        len--;
+    }
+    if (len == 0 || (len == 8 && strncasecmp(p, "identity", 8) == 0)) {
+        *coding = CODING_IDENTITY;
+    } else if ((len == 4 && strncasecmp(p, "gzip", 4) == 0) ||
+               (len == 6 && strncasecmp(p, "x-gzip", 6) == 0)) {
+        *coding = CODING_GZIP;
+#ifdef HAVE_ZSTD
+    } else if (len == 4 && strncasecmp(p, "zstd", 4) == 0) {
+        *coding = CODING_ZSTD;
+#endif
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+int bodyDecoderStart(struct bodyDecoder *d, const struct responseHead *head, bodySink sink,
+                     void *ctx) {
+    const struct strView *v = responseHeader(head, "Content-Encoding");
+
+    if (parseCoding(v, &d->coding) == -1) {
+        LOG(LV_ERROR, "can't decode Content-Encoding: %.*s", (int)v->len, v->ptr);
+        return -1;
+    }
+    d->sink = sink;
+    d->ctx = ctx;
+    d->frameEnded = 0;
+    d->fed = 0;
+    d->decoded = 0;
+    if (d->coding == CODING_GZIP) {
+        // 32 + 15: a gzip or zlib header, whichever it has, and any window
+        if (!d->zlibReady) {
+            memset(&d->z, 0, sizeof d->z);
+            if (inflateInit2(&d->z, 32 + 15) != Z_OK) {
+                return -1;
+            }
+            d->zlibReady = 1;
+        } else if (inflateReset(&d->z) != Z_OK) {
+            return -1;
+        }
+#ifdef HAVE_ZSTD
+    } else if (d->coding == CODING_ZSTD) {
+        if (d->zstd == NULL) {
+            if ((d->zstd = ZSTD_createDCtx()) == NULL) {
+                return -1;
+            }
+        } else {
+            ZSTD_DCtx_reset(d->zstd, ZSTD_reset_session_only);
+        }
+#endif
+    }
+    return d->coding != CODING_IDENTITY;
+}
+
+static int emit(struct bodyDecoder *d, size_t len) {
+    d->decoded += len;
+    return len > 0 ? d->sink(d->ctx, d->out, len) : 0;
+}
+
+static int inflateSome(struct bodyDecoder *d, const char *data, size_t len) {
+    size_t n;
+    int rv;
+
+    d->z.next_in = (Bytef *)data;
+    d->z.avail_in = len;
+    do {
+        if (d->frameEnded) {
+            // another member follows the one that just ended
+            if (inflateReset(&d->z) != Z_OK) {
+                return -1;
+            }
+            d->frameEnded = 0;
+        }
+        d->z.next_out = (Bytef *)d->out;
+        d->z.avail_out = sizeof d->out;
+        rv = inflate(&d->z, Z_NO_FLUSH);
+        if (rv != Z_OK && rv != Z_STREAM_END && rv != Z_BUF_ERROR) {
+            LOG(LV_ERROR, "gzip body: %s", d->z.msg != NULL ? d->z.msg : "corrupt");
+            return -1;
+        }
+        n = sizeof d->out - d->z.avail_out;
+        if (emit(d, n) == -1) {
+            return -1;
+        }
+        d->frameEnded = rv == Z_STREAM_END;
+        // a full buffer may have left output behind in zlib
+    } while (d->z.avail_in > 0 || (n == sizeof d->out && !d->frameEnded));
+    return 0;
+}
+
+#ifdef HAVE_ZSTD
+static int unzstdSome(struct bodyDecoder *d, const char *data, size_t len) {
+    ZSTD_inBuffer in = { data, len, 0 };
+    ZSTD_outBuffer out;
+    size_t rv;
+
+    do {
+        out.dst = d->out;
+        out.size = sizeof d->out;
+        out.pos = 0;
+        rv = ZSTD_decompressStream(d->zstd, &out, &in);
+        if (ZSTD_isError(rv)) {
+            LOG(LV_ERROR, "zstd body: %s", ZSTD_getErrorName(rv));
+            return -1;
+        }
+        if (emit(d, out.pos) == -1) {
+            return -1;
+        }
+        // 0 means a frame just ended; the next one starts afresh by itself
+        d->frameEnded = rv == 0;
+    } while (in.pos < in.size || out.pos == out.size);
+    return 0;
+}
+#endif
+
+int bodyDecoderFeed(void *ctx, const char *data, size_t len) {
+    struct bodyDecoder *d = ctx;
+
+    d->fed += len;
+#ifdef HAVE_ZSTD
+    if (d->coding == CODING_ZSTD) {
+        return unzstdSome(d, data, len);
+    }
+#endif
+    return inflateSome(d, data, len);
+}
+
+int bodyDecoderFinish(const struct bodyDecoder *d) {
+    // an empty body (a 304, say) has nothing to end
+    return d->fed == 0 || d->frameEnded ? 0 : -1;
+}
+
+void bodyDecoderFree(struct bodyDecoder *d) {
+    if (d->zlibReady) {
+        inflateEnd(&d->z);
+        d->zlibReady = 0;
+    }
+#ifdef HAVE_ZSTD
+    ZSTD_freeDCtx(d->zstd);
+    d->zstd = NULL;
+#endif
+}
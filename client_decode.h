@@ -0,0 +1,59 @@
+/*
+** client_decode.h -- undo a response's Content-Encoding as the body streams in
+*/
+
+#ifndef CLIENT_DECODE_H
+#define CLIENT_DECODE_H
+
+#include <zlib.h>
+
+#include "response_parser.h"
+
+#define DECODE_CHUNK 16384         // decoded bytes handed to the sink at a time
+
+// the Accept-Encoding value for what bodyDecoderStart() can undo
+#ifdef HAVE_ZSTD
+#define DECODE_ACCEPT "gzip, zstd"
+#else
+#define DECODE_ACCEPT "gzip"
+#endif
+
+enum contentCoding {
+    CODING_IDENTITY,
+    CODING_GZIP,
+    CODING_ZSTD
+};
+
+// zlib's and zstd's state are set up by the first body that needs them
+// and kept for the next, so one decoder can serve every response on a
+// connection. zero it before first use.
+struct bodyDecoder {
+    enum contentCoding coding;     // of the body being decoded
+    bodySink sink;                 // where the decoded bytes go
+    void *ctx;
+    int zlibReady;
+    z_stream z;
+    void *zstd;                    // a ZSTD_DCtx
+    int frameEnded;                // the last byte in ended a gzip member or zstd frame
+    long long fed;                 // coded bytes so far
+    long long decoded;
+    char out[DECODE_CHUNK];
+};
+
+// the body after head is coded as its Content-Encoding says: get ready to
+// hand sink the decoded bytes. returns 1 if it is coded, 0 if it isn't, and
+// -1 if it is coded in a way we can't undo (or out of memory).
+int bodyDecoderStart(struct bodyDecoder *d, const struct responseHead *head, bodySink sink,
+                     void *ctx);
+
+// bodySink decoding len coded bytes into the sink. ctx is the decoder
+int bodyDecoderFeed(void *ctx, const char *data, size_t len);
+
+// the coded body is complete: 0 if it ended where a gzip member or zstd
+// frame does, -1 if it was cut short
+int bodyDecoderFinish(const struct bodyDecoder *d);
+
+// free zlib's and zstd's state
+void bodyDecoderFree(struct bodyDecoder *d);
+
+#endif
@@ -0,0 +1,65 @@
+/*
+** client_log.c -- leveled logging for the client
+**
+** Everything goes to stderr, so stdout stays free for results.
+*/
+
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "client_log.h"
+
+#define SUMMARY_PREVIEW 48 // printable bytes shown in a summary line
+
+enum logLevel logLevel = LV_INFO;
+
+void logPrint(const char *fmt, ...) {
+    va_list ap;
+
+    fputs("client: ", stderr);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+}
+
+static char printable(char c) {
+    return c >= 0x20 && c < 0x7f ? c : '.';
+}
+
+static void hexDump(const char *data, size_t len) {
+    const unsigned char *p = (const unsigned char *)data;
+    size_t i, j;
+
+    for (i = 0; i < len; i += 16) {
+        fprintf(stderr, "  %06zx ", i);
+        for (j = i; j < i + 16; j++) {
+            if (j < len) {
+                fprintf(stderr, " %02x", p[j]);
+            } else {
+                fputs("   ", stderr);
+            }
+        }
+        fputs("  ", stderr);
+        for (j = i; j < i + 16 && j < len; j++) {
+            fputc(printable(data[j]), stderr);
+        }
+        fputc('\n', stderr);
+    }
+}
+
+void logData(const char *what, const char *data, size_t len) {
+    char preview[SUMMARY_PREVIEW + 1];
+    size_t i, n = len < SUMMARY_PREVIEW ? len : SUMMARY_PREVIEW;
+
+    // never reads past len: recv() buffers aren't NUL terminated
+    for (i = 0; i < n; i++) {
+        preview[i] = printable(data[i]);
+    }
+    preview[n] = '\0';
+    fprintf(stderr, "client: %s %zu bytes '%s%s'\n", what, len, preview,
+            len > n ? "..." : "");
+    if (logLevel >= LV_TRACE) {
+        hexDump(data, len);
+    }
+}
@@ -0,0 +1,33 @@
+/*
+** client_log.h -- leveled logging for the client
+**
+** LOG() and LOG_DATA() test the level before evaluating their arguments,
+** so a message below the current level costs one compare: nothing is
+** formatted and nothing is written.
+*/
+
+#ifndef CLIENT_LOG_H
+#define CLIENT_LOG_H
+
+#include <stddef.h>
+
+enum logLevel {
+    LV_ERROR,                      // failures, always shown
+    LV_INFO,                       // one line per connection (the default)
+    LV_DEBUG,                      // + a summary of everything received (-v)
+    LV_TRACE                       // + a hex dump of it (-vv)
+};
+
+extern enum logLevel logLevel;
+
+#define LOG(level, ...) \
+    do { if ((level) <= logLevel) logPrint(__VA_ARGS__); } while (0)
+
+// what/len summary at LV_DEBUG, the bytes themselves too at LV_TRACE
+#define LOG_DATA(level, what, data, len) \
+    do { if ((level) <= logLevel) logData((what), (data), (len)); } while (0)
+
+void logPrint(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void logData(const char *what, const char *data, size_t len);
+
+#endif
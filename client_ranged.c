@@ -0,0 +1,268 @@
+/*
+** client_ranged.c -- download one large object over parallel Range requests
+**
+** A HEAD request gives the size and whether the server takes byte ranges.
+** The object is then cut into equal parts, each fetched by its own thread
+** on its own connection, and every part's body goes straight from the
+** receive buffer to its place in the output file with pwrite(), so parts
+** can finish in any order and nothing is reassembled afterwards.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "client_connect.h"
+#include "client_log.h"
+#include "client_ranged.h"
+#include "response_parser.h"
+
+#define RANGED_BUF 65536
+#define RANGED_HEAD_MAX 16384
+
+struct rangedFetch {
+    const char *hostHeader;        // as the Host header has it
+    const char *path;
+    const struct addrinfo *addrs;
+    int fd;                        // the output file
+    long long size;
+};
+
+struct rangePart {
+    const struct rangedFetch *fetch;
+    long long first;
+    long long last;
+    long long written;
+    int result;                    // as fetchRanged()
+    pthread_t thread;
+    int threaded;
+};
+
+static int openConnection(const struct rangedFetch *f) {
+    const struct addrinfo *winner;
+
+    return connectRace(f->addrs, &winner);
+}
+
+static int sendAll(int fd, const char *p, size_t len) {
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = send(fd, p, len, MSG_NOSIGNAL)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// send method for the object with an optional extra header line, then read
+// until the response header block is complete. returns bytes in buf.
+static long requestHead(int fd, const struct rangedFetch *f, const char *method,
+                        const char *extra, char *buf, size_t cap,
+                        struct responseParser *parser) {
+    char req[2048];
+    size_t received = 0;
+    ssize_t n;
+    int len, parsed = 0;
+
+    len = snprintf(req, sizeof req,
+                   "%s %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: httpexperiments\r\n%s\r\n",
+                   method, f->path, f->hostHeader, extra);
+    if (len >= (int)sizeof req || sendAll(fd, req, len) == -1) {
+        return -1;
+    }
+
+    responseParserInit(parser);
+    while (parsed == 0 && received < cap) {
+        if ((n = recv(fd, buf + received, cap - received, 0)) <= 0) {
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        LOG_DATA(LV_DEBUG, "received", buf + received, n);
+        received += n;
+        parsed = responseParserFeed(parser, buf, received);
+    }
+    return parsed == 1 ? (long)received : -1;
+}
+
+// the body reader's sink: this part's bytes go to their own offset
+static int pwriteSink(void *ctx, const char *data, size_t len) {
+    struct rangePart *part = ctx;
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = pwrite(part->fetch->fd, data, len, part->first + part->written)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        len -= n;
+        part->written += n;
+    }
+    return 0;
+}
+
+// does Content-Range say exactly first-last of size?
+static int rangeMatches(const struct responseHead *head, const struct rangePart *part) {
+    const struct strView *v = responseHeader(head, "Content-Range");
+    long long first, last, size;
+    char copy[128];
+
+    if (v == NULL || v->len >= sizeof copy) {
+        return 0;
+    }
+    memcpy(copy, v->ptr, v->len);
+    copy[v->len] = '\0';
+    return sscanf(copy, "bytes %lld-%lld/%lld", &first, &last, &size) == 3 &&
+           first == part->first && last == part->last && size == part->fetch->size;
+}
+
+static void *fetchPart(void *arg) {
+    struct rangePart *part = arg;
+    struct responseParser parser;
+    struct bodyReader body;
+    char *buf = malloc(RANGED_BUF), range[96];
+    long received;
+    size_t used;
+    ssize_t n;
+    int fd, done;
+
+    part->result = -1;
+    if (buf == NULL || (fd = openConnection(part->fetch)) == -1) {
+        free(buf);
+        return NULL;
+    }
+    snprintf(range, sizeof range, "Range: bytes=%lld-%lld\r\n", part->first, part->last);
+    received = requestHead(fd, part->fetch, "GET", range, buf, RANGED_HEAD_MAX, &parser);
+    if (received == -1) {
+        goto out;
+    }
+    if (parser.head.statusCode != 206 || !rangeMatches(&parser.head, part)) {
+        // it answered with the whole object after all
+        LOG(LV_INFO, "range %lld-%lld answered with %d", part->first, part->last,
+            parser.head.statusCode);
+        part->result = 1;
+        goto out;
+    }
+
+    bodyReaderInit(&body, &parser.head, 0);
+    done = bodyReaderFeed(&body, buf + parser.head.headerLength,
+                          received - parser.head.headerLength, &used, pwriteSink, part);
+    while (done == 0) {
+        if ((n = recv(fd, buf, RANGED_BUF, 0)) == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            done = n == 0 && bodyReaderEof(&body) ? 1 : -1;
+            break;
+        }
+        LOG_DATA(LV_DEBUG, "received", buf, n);
+        done = bodyReaderFeed(&body, buf, n, &used, pwriteSink, part);
+    }
+    if (done == 1 && part->written == part->last - part->first + 1) {
+        part->result = 0;
+    }
+
+out:
+    close(fd);
+    free(buf);
+    return NULL;
+}
+
+// HEAD the object: its size, and whether it can be fetched in ranges
+static int probe(struct rangedFetch *f) {
+    struct responseParser parser;
+    const struct strView *ranges;
+    char buf[RANGED_HEAD_MAX];
+    int fd, ok;
+
+    if ((fd = openConnection(f)) == -1) {
+        return -1;
+    }
+    ok = requestHead(fd, f, "HEAD", "", buf, sizeof buf, &parser) != -1;
+    close(fd);
+    if (!ok) {
+        return -1;
+    }
+    ranges = responseHeader(&parser.head, "Accept-Ranges");
+    if (parser.head.statusCode != 200 || parser.head.contentLength <= 0 || ranges == NULL ||
+        ranges->len != 5 || strncasecmp(ranges->ptr, "bytes", 5) != 0) {
+        return 1;
+    }
+    f->size = parser.head.contentLength;
+    return 0;
+}
+
+int fetchRanged(const struct addrinfo *addrs, const char *hostHeader, const char *path,
+                int parts, const char *outPath) {
+    struct rangedFetch f = { hostHeader, path, addrs, -1, 0 };
+    struct rangePart *part;
+    long long each;
+    int i, rv, result = 0;
+
+    if ((rv = probe(&f)) != 0) {
+        return rv;
+    }
+    if (f.size / RANGED_MIN_PART < parts) {
+        parts = f.size / RANGED_MIN_PART;
+    }
+    if (parts < 2) {
+        return 1;
+    }
+
+    if ((f.fd = open(outPath, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1 ||
+        ftruncate(f.fd, f.size) == -1) {
+        perror(outPath);
+        if (f.fd != -1) {
+            close(f.fd);
+        }
+        return -1;
+    }
+
+    LOG(LV_INFO, "fetching %lld bytes as %d ranges", f.size, parts);
+    if ((part = calloc(parts, sizeof *part)) == NULL) {
+        perror("calloc");
+        close(f.fd);
+        return -1;
+    }
+    each = f.size / parts;
+    for (i = 0; i < parts; i++) {
+        part[i].fetch = &f;
+        part[i].first = i * each;
+        part[i].last = i == parts - 1 ? f.size - 1 : (i + 1) * each - 1;
+        if (pthread_create(&part[i].thread, NULL, fetchPart, &part[i]) == 0) {
+            part[i].threaded = 1;
+        } else {
+            fetchPart(&part[i]); // run it on this thread instead
+        }
+    }
+    for (i = 0; i < parts; i++) {
+        if (part[i].threaded) {
+            pthread_join(part[i].thread, NULL);
+        }
+        // one part that can't be ranged means single stream for all
+        if (part[i].result == 1 || (part[i].result == -1 && result == 0)) {
+            result = part[i].result;
+        }
+    }
+
+    free(part);
+    close(f.fd);
+    return result;
+}
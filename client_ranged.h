@@ -0,0 +1,21 @@
+/*
+** client_ranged.h -- download one large object over parallel Range requests
+*/
+
+#ifndef CLIENT_RANGED_H
+#define CLIENT_RANGED_H
+
+#include <netdb.h>
+
+#define RANGED_MIN_PART (1 << 20) // smaller parts aren't worth a connection
+
+// probe path at one of addrs with HEAD, sending hostHeader as it is ("host",
+// "host:port" or "[v6]:port"), then fetch it as up to `parts` byte ranges
+// on parallel connections, each written with pwrite() at its offset in
+// outPath. returns 0 on success, 1 if the server doesn't do ranges or the
+// object is too small to split (fetch it as a single stream instead) and
+// -1 on failure.
+int fetchRanged(const struct addrinfo *addrs, const char *hostHeader, const char *path,
+                int parts, const char *outPath);
+
+#endif
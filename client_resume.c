@@ -0,0 +1,235 @@
+/*
+** client_resume.c -- resumable single-stream downloads
+**
+** Progress lives in a sidecar next to the output ("output.ckpt"): the URL,
+** the object's size, how many bytes of the output are good and the
+** validators the server sent with them. A later run asks for the rest with
+** "Range: bytes=received-" and an If-Range carrying the ETag (or else
+** Last-Modified), so if the object changed in between the server sends it
+** whole and the partial file is simply overwritten.
+**
+** The output is flushed and fdatasync()ed before a checkpoint claims its
+** bytes, and the checkpoint itself is replaced with rename(), so even a
+** crash leaves a checkpoint that understates progress, never one that
+** overstates it.
+*/
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "client_log.h"
+#include "client_resume.h"
+
+static void copyView(char *out, size_t size, const struct strView *v) {
+    size_t n = 0;
+
+    if (v != NULL) {
+        n = v->len < size - 1 ? v->len : size - 1;
+        memcpy(out, v->ptr, n);
+    }
+    out[n] = '\0';
+}
+
+static int checkpointLoad(const char *path, struct checkpoint *ck) {
+    char line[2400], *value;
+    FILE *fp;
+    size_t n;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        return -1;
+    }
+    memset(ck, 0, sizeof *ck);
+    ck->size = -1;
+    ck->received = -1;
+    while (fgets(line, sizeof line, fp) != NULL) {
+        n = strlen(line);
+        while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r')) {
+            line[--n] = '\0';
+        }
+        if ((value = strchr(line, ' ')) == NULL) {
+            continue;
+        }
+        *value++ = '\0';
+        if (strcmp(line, "url") == 0) {
+            snprintf(ck->url, sizeof ck->url, "%s", value);
+        } else if (strcmp(line, "size") == 0) {
+            ck->size = atoll(value);
+        } else if (strcmp(line, "received") == 0) {
+            ck->received = atoll(value);
+        } else if (strcmp(line, "etag") == 0) {
+            snprintf(ck->etag, sizeof ck->etag, "%s", value);
+        } else if (strcmp(line, "last-modified") == 0) {
+            snprintf(ck->lastModified, sizeof ck->lastModified, "%s", value);
+        }
+    }
+    fclose(fp);
+    return ck->url[0] != '\0' && ck->received >= 0 ? 0 : -1;
+}
+
+static int checkpointSave(const char *path, const struct checkpoint *ck) {
+    char tmp[4200];
+    FILE *fp;
+
+    snprintf(tmp, sizeof tmp, "%s.tmp", path);
+    if ((fp = fopen(tmp, "w")) == NULL) {
+        return -1;
+    }
+    fprintf(fp, "url %s\nsize %lld\nreceived %lld\n", ck->url, ck->size, ck->received);
+    if (ck->etag[0] != '\0') {
+        fprintf(fp, "etag %s\n", ck->etag);
+    }
+    if (ck->lastModified[0] != '\0') {
+        fprintf(fp, "last-modified %s\n", ck->lastModified);
+    }
+    if (fclose(fp) != 0 || rename(tmp, path) == -1) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+// make the output durable up to ck.received, then say so in the sidecar
+static void checkpoint(struct resumeState *rs) {
+    if (fflush(rs->fp) != 0 || fdatasync(fileno(rs->fp)) == -1 ||
+        checkpointSave(rs->ckPath, &rs->ck) == -1) {
+        LOG(LV_ERROR, "can't checkpoint %s: %s", rs->ckPath, strerror(errno));
+    }
+    rs->sinceSave = 0;
+}
+
+long long resumeBegin(struct resumeState *rs, const char *outPath, const char *url) {
+    struct checkpoint ck;
+    struct stat st;
+
+    memset(rs, 0, sizeof *rs);
+    rs->outPath = outPath;
+    snprintf(rs->ckPath, sizeof rs->ckPath, "%s.ckpt", outPath);
+
+    // without a validator there's no telling whether the rest still fits
+    if (checkpointLoad(rs->ckPath, &ck) == 0 && strcmp(ck.url, url) == 0 &&
+        (ck.etag[0] != '\0' || ck.lastModified[0] != '\0') &&
+        stat(outPath, &st) == 0 && st.st_size >= ck.received) {
+        rs->ck = ck;
+        LOG(LV_INFO, "resuming at byte %lld of %lld", ck.received, ck.size);
+    } else {
+        snprintf(rs->ck.url, sizeof rs->ck.url, "%s", url);
+        rs->ck.size = -1;
+    }
+    return rs->ck.received;
+}
+
+int resumeRequestHeaders(const struct resumeState *rs, char *out, size_t size) {
+    if (rs->ck.received == 0) {
+        out[0] = '\0';
+        return 0;
+    }
+    // ETag is the strong validator, fall back on the date
+    return snprintf(out, size, "Range: bytes=%lld-\r\nIf-Range: %s\r\n", rs->ck.received,
+                    rs->ck.etag[0] != '\0' ? rs->ck.etag : rs->ck.lastModified);
+}
+
+// "bytes first-last/size" or "bytes */size"
+static int parseContentRange(const struct strView *v, long long *first, long long *size) {
+    char copy[128];
+    long long last;
+
+    if (v == NULL || v->len >= sizeof copy) {
+        return -1;
+    }
+    memcpy(copy, v->ptr, v->len);
+    copy[v->len] = '\0';
+    if (sscanf(copy, "bytes */%lld", size) == 1) {
+        *first = -1;
+        return 0;
+    }
+    return sscanf(copy, "bytes %lld-%lld/%lld", first, &last, size) == 3 ? 0 : -1;
+}
+
+int resumeAccept(struct resumeState *rs, const struct responseHead *head) {
+    const struct strView *range = responseHeader(head, "Content-Range");
+    long long first = 0, size = -1;
+
+    if (head->statusCode == 416 && rs->ck.received > 0) {
+        // asking past the end: fine if that's because we have it all
+        if (parseContentRange(range, &first, &size) == 0 && size == rs->ck.received) {
+            return 1;
+        }
+        return -1;
+    }
+
+    if (head->statusCode == 206) {
+        if (parseContentRange(range, &first, &size) == -1 || first != rs->ck.received) {
+            return -1;
+        }
+        if ((rs->fp = fopen(rs->outPath, "r+b")) == NULL ||
+            fseeko(rs->fp, rs->ck.received, SEEK_SET) == -1) {
+            return -1;
+        }
+        rs->ck.size = size;
+    } else if (head->statusCode == 200) {
+        // the whole object: a fresh start, or what we had is stale
+        if (rs->ck.received > 0) {
+            LOG(LV_INFO, "object changed, starting over");
+        }
+        if ((rs->fp = fopen(rs->outPath, "wb")) == NULL) {
+            return -1;
+        }
+        rs->ck.received = 0;
+        rs->ck.size = head->contentLength;
+    } else {
+        // an error says nothing about the object: keep what we have
+        LOG(LV_ERROR, "server answered %d, partial output kept", head->statusCode);
+        resumeSuspend(rs);
+        return 2;
+    }
+
+    // only a real body of the object is worth resuming later
+    rs->tracking = head->statusCode == 200 || head->statusCode == 206;
+    copyView(rs->ck.etag, sizeof rs->ck.etag, responseHeader(head, "ETag"));
+    copyView(rs->ck.lastModified, sizeof rs->ck.lastModified,
+             responseHeader(head, "Last-Modified"));
+    if (rs->ck.etag[0] == '\0' && rs->ck.lastModified[0] == '\0') {
+        rs->tracking = 0;
+    }
+    if (rs->tracking) {
+        checkpoint(rs);
+    }
+    return 0;
+}
+
+int resumeSink(void *ctx, const char *data, size_t len) {
+    struct resumeState *rs = ctx;
+
+    if (fwrite(data, 1, len, rs->fp) != len) {
+        return -1;
+    }
+    rs->ck.received += len;
+    rs->sinceSave += len;
+    if (rs->tracking && rs->sinceSave >= CHECKPOINT_INTERVAL) {
+        checkpoint(rs);
+    }
+    return 0;
+}
+
+void resumeSuspend(struct resumeState *rs) {
+    if (rs->fp == NULL) {
+        return;
+    }
+    if (rs->tracking) {
+        checkpoint(rs);
+        LOG(LV_INFO, "stopped at byte %lld, run again to resume", rs->ck.received);
+    }
+    fclose(rs->fp);
+    rs->fp = NULL;
+}
+
+void resumeFinish(struct resumeState *rs) {
+    if (rs->fp != NULL) {
+        fclose(rs->fp);
+        rs->fp = NULL;
+    }
+    unlink(rs->ckPath);
+}
@@ -0,0 +1,56 @@
+/*
+** client_resume.h -- resumable single-stream downloads
+*/
+
+#ifndef CLIENT_RESUME_H
+#define CLIENT_RESUME_H
+
+#include <stdio.h>
+
+#include "response_parser.h"
+
+#define CHECKPOINT_INTERVAL (8 << 20) // bytes between checkpoint saves
+
+// what the sidecar file records about a partial download
+struct checkpoint {
+    char url[2048];
+    long long size;                // of the whole object, -1 if unknown
+    long long received;            // bytes of the output known to be good
+    char etag[256];
+    char lastModified[64];
+};
+
+struct resumeState {
+    const char *outPath;
+    char ckPath[4096];             // outPath + ".ckpt"
+    struct checkpoint ck;
+    FILE *fp;
+    int tracking;                  // this response is worth checkpointing
+    long long sinceSave;
+};
+
+// load outPath's checkpoint if it is for url and the partial file is still
+// there. returns the offset the download continues from, 0 for a fresh start.
+long long resumeBegin(struct resumeState *rs, const char *outPath, const char *url);
+
+// Range and If-Range header lines asking for the rest of the object, or
+// nothing when starting fresh. returns their length.
+int resumeRequestHeaders(const struct resumeState *rs, char *out, size_t size);
+
+// the response head arrived: open the output where the body belongs.
+// returns 0 to stream the body into rs->fp through resumeSink(), 1 if the
+// file was complete already, -1 if the response doesn't continue the
+// partial file and 2 if it is an error status, which leaves the partial
+// file and its checkpoint as they were.
+int resumeAccept(struct resumeState *rs, const struct responseHead *head);
+
+// bodySink writing to the output, checkpointing as it goes. ctx is rs.
+int resumeSink(void *ctx, const char *data, size_t len);
+
+// the transfer broke off: record how far it got and close the output
+void resumeSuspend(struct resumeState *rs);
+
+// the download is complete: close the output and drop the checkpoint
+void resumeFinish(struct resumeState *rs);
+
+#endif
@@ -0,0 +1,29 @@
+/*
+** coroutine.h -- stackless coroutines in plain C (protothreads' trick)
+**
+** A coroutine is a function whose body sits between CO_BEGIN and CO_END,
+** taking a task struct with an int line member (0 to start). CO_AWAIT
+** records the line it's on, starts whatever is awaited and returns
+** CO_PENDING; calling the function again switches straight back to that
+** line and carries on after it. There's no stack to save, so a suspended
+** coroutine costs only its task struct, but locals don't survive an await:
+** anything needed afterwards lives in the task.
+**
+** A CO_AWAIT can't share a line with another, and the body mustn't have a
+** switch of its own around one. The client's async fetches
+** (client_async.h) and the server's -m coro handlers both use these.
+*/
+
+#ifndef COROUTINE_H
+#define COROUTINE_H
+
+enum { CO_PENDING, CO_DONE };
+
+#define CO_BEGIN(task) switch ((task)->line) { case 0:
+
+#define CO_AWAIT(task, start) \
+	do { (task)->line = __LINE__; start; return CO_PENDING; case __LINE__:; } while (0)
+
+#define CO_END(task) } (task)->line = -1; return CO_DONE
+
+#endif
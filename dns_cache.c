@@ -0,0 +1,432 @@
+/*
+** dns_cache.c -- cached, optionally non-blocking name resolution
+**
+** getaddrinfo() blocks for as long as the resolver takes, and every client
+** mode called it for each connection or message. Answers are now kept per
+** (host, port, socket type) for a fixed TTL: getaddrinfo() doesn't report
+** record TTLs, so the cache caps every answer at the same lifetime and
+** remembers failures for a shorter one. Concurrent lookups of the same
+** name share one query.
+**
+** Blocking lookups resolve on the caller's thread. Non-blocking ones go to
+** a small pool of resolver threads, and the answers are collected with
+** dns_poll() when dns_event_fd() turns readable, so an epoll loop can keep
+** serving other connections meanwhile.
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "dns_cache.h"
+
+#define DNS_BUCKETS 64
+
+struct dns_waiter {
+	void *tag;
+	struct dns_entry *entry;
+	struct dns_waiter *next;
+};
+
+struct dns_entry {
+	struct dns_entry *hnext;  // hash chain
+	struct dns_entry *qnext;  // resolver queue
+	unsigned hash;
+	char *host;
+	char *port;
+	int socktype;
+	struct addrinfo *addrs;
+	int error;        // EAI_* of a remembered failure
+	time_t expires;
+	int refs;         // one for being in the table, one per holder
+	int resolving;
+	struct dns_waiter *waiters;  // async lookups waiting for the answer
+};
+
+struct dns_cache {
+	pthread_mutex_t lock;
+	pthread_cond_t work;      // the resolver queue has entries
+	pthread_cond_t answered;  // some entry stopped resolving
+	struct dns_entry *buckets[DNS_BUCKETS];
+	struct dns_entry *queue_head, *queue_tail;
+	struct dns_waiter *done_head, *done_tail;
+	int efd;
+	int ttl;
+	int negative_ttl;
+	int stopping;
+	int nthreads;   // asked for
+	int started;    // running
+	pthread_t *threads;
+	struct dns_stats stats;
+};
+
+static time_t monotonic_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+// FNV-1a over the whole key
+static unsigned hash_key(const char *host, const char *port, int socktype)
+{
+	unsigned h = 2166136261u;
+	const char *p;
+
+	for (p = host; *p != '\0'; p++)
+		h = (h ^ (unsigned char)*p) * 16777619u;
+	h = (h ^ ':') * 16777619u;
+	for (p = port; *p != '\0'; p++)
+		h = (h ^ (unsigned char)*p) * 16777619u;
+	return (h ^ (unsigned)socktype) * 16777619u;
+}
+
+struct dns_cache *dns_cache_create(int threads, int ttl, int negative_ttl)
+{
+	struct dns_cache *dc = calloc(1, sizeof *dc);
+
+	if (dc == NULL)
+		return NULL;
+	if ((dc->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+		free(dc);
+		return NULL;
+	}
+	pthread_mutex_init(&dc->lock, NULL);
+	pthread_cond_init(&dc->work, NULL);
+	pthread_cond_init(&dc->answered, NULL);
+	dc->ttl = ttl;
+	dc->negative_ttl = negative_ttl;
+	dc->nthreads = threads > 0 ? threads : 1;
+	return dc;
+}
+
+// with the lock held
+static void entry_put(struct dns_entry *e)
+{
+	if (--e->refs > 0)
+		return;
+	if (e->addrs != NULL)
+		freeaddrinfo(e->addrs);
+	free(e->host);
+	free(e->port);
+	free(e);
+}
+
+// take e out of the table; holders keep it alive until they release it
+static void entry_unhash(struct dns_cache *dc, struct dns_entry *e)
+{
+	struct dns_entry **pp = &dc->buckets[e->hash % DNS_BUCKETS];
+
+	for (; *pp != NULL; pp = &(*pp)->hnext) {
+		if (*pp == e) {
+			*pp = e->hnext;
+			entry_put(e);
+			return;
+		}
+	}
+}
+
+static void resolve_entry(struct dns_cache *dc, struct dns_entry *e)
+{
+	struct addrinfo hints, *addrs = NULL;
+	struct dns_waiter *w;
+	uint64_t one = 1;
+	int rv;
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = e->socktype;
+	rv = getaddrinfo(e->host, e->port, &hints, &addrs);
+
+	pthread_mutex_lock(&dc->lock);
+	e->addrs = rv == 0 ? addrs : NULL;
+	e->error = rv;
+	e->expires = monotonic_now() + (rv == 0 ? dc->ttl : dc->negative_ttl);
+	e->resolving = 0;
+	// hand the answer to everyone who asked without blocking
+	if (e->waiters != NULL) {
+		for (w = e->waiters; w != NULL; w = w->next) {
+			w->entry = e;
+			e->refs++;
+		}
+		for (w = e->waiters; w->next != NULL; w = w->next)
+			;
+		if (dc->done_tail != NULL)
+			dc->done_tail->next = e->waiters;
+		else
+			dc->done_head = e->waiters;
+		dc->done_tail = w;
+		e->waiters = NULL;
+		// can only fail by overflowing, when it's readable anyway
+		(void)!write(dc->efd, &one, sizeof one);
+	}
+	pthread_cond_broadcast(&dc->answered);
+	entry_put(e);  // the resolver's own reference
+	pthread_mutex_unlock(&dc->lock);
+}
+
+static void *resolver_thread(void *arg)
+{
+	struct dns_cache *dc = arg;
+	struct dns_entry *e;
+
+	pthread_mutex_lock(&dc->lock);
+	while (!dc->stopping) {
+		if ((e = dc->queue_head) == NULL) {
+			pthread_cond_wait(&dc->work, &dc->lock);
+			continue;
+		}
+		if ((dc->queue_head = e->qnext) == NULL)
+			dc->queue_tail = NULL;
+		pthread_mutex_unlock(&dc->lock);
+		resolve_entry(dc, e);
+		pthread_mutex_lock(&dc->lock);
+	}
+	pthread_mutex_unlock(&dc->lock);
+	return NULL;
+}
+
+// with the lock held: the entry for key, a fresh one if there is none or it
+// has expired. *fresh says whether the caller has to get it resolved.
+static struct dns_entry *entry_get(struct dns_cache *dc, const char *host,
+	const char *port, int socktype, int *fresh)
+{
+	unsigned hash = hash_key(host, port, socktype);
+	struct dns_entry *e;
+
+	*fresh = 0;
+	for (e = dc->buckets[hash % DNS_BUCKETS]; e != NULL; e = e->hnext) {
+		if (e->hash == hash && e->socktype == socktype &&
+				strcmp(e->host, host) == 0 &&
+				strcmp(e->port, port) == 0)
+			break;
+	}
+	if (e != NULL && !e->resolving && monotonic_now() >= e->expires) {
+		dc->stats.expired++;
+		entry_unhash(dc, e);
+		e = NULL;
+	}
+	if (e != NULL) {
+		if (e->resolving)
+			dc->stats.coalesced++;
+		else if (e->error != 0)
+			dc->stats.negative_hits++;
+		else
+			dc->stats.hits++;
+		return e;
+	}
+
+	dc->stats.misses++;
+	if ((e = calloc(1, sizeof *e)) == NULL)
+		return NULL;
+	if ((e->host = strdup(host)) == NULL ||
+			(e->port = strdup(port)) == NULL) {
+		free(e->host);
+		free(e);
+		return NULL;
+	}
+	e->hash = hash;
+	e->socktype = socktype;
+	e->resolving = 1;
+	e->refs = 2;  // the table's and the resolver's
+	e->hnext = dc->buckets[hash % DNS_BUCKETS];
+	dc->buckets[hash % DNS_BUCKETS] = e;
+	*fresh = 1;
+	return e;
+}
+
+// with the lock held: a referenced entry or its error
+static int entry_answer(struct dns_entry *e, struct dns_entry **entry)
+{
+	if (e->error != 0) {
+		*entry = NULL;
+		return e->error;
+	}
+	e->refs++;
+	*entry = e;
+	return 0;
+}
+
+int dns_resolve(struct dns_cache *dc, const char *host, const char *port,
+	int socktype, struct dns_entry **entry)
+{
+	struct dns_entry *e;
+	int fresh, rv;
+
+	pthread_mutex_lock(&dc->lock);
+	if ((e = entry_get(dc, host, port, socktype, &fresh)) == NULL) {
+		pthread_mutex_unlock(&dc->lock);
+		return EAI_MEMORY;
+	}
+	// ours, taken before the lock is let go: the entry can expire and
+	// leave the table the moment the resolver has answered
+	e->refs++;
+	if (fresh) {
+		pthread_mutex_unlock(&dc->lock);
+		resolve_entry(dc, e);
+		pthread_mutex_lock(&dc->lock);
+	} else {
+		while (e->resolving)
+			pthread_cond_wait(&dc->answered, &dc->lock);
+	}
+	rv = entry_answer(e, entry);
+	entry_put(e);
+	pthread_mutex_unlock(&dc->lock);
+	return rv;
+}
+
+static int start_threads(struct dns_cache *dc)
+{
+	if (dc->threads == NULL &&
+			(dc->threads = calloc(dc->nthreads, sizeof *dc->threads)) == NULL)
+		return -1;
+	while (dc->started < dc->nthreads) {
+		if (pthread_create(&dc->threads[dc->started], NULL,
+				resolver_thread, dc) != 0)
+			break;
+		dc->started++;
+	}
+	return dc->started > 0 ? 0 : -1;
+}
+
+int dns_resolve_async(struct dns_cache *dc, const char *host,
+	const char *port, int socktype, void *tag, struct dns_entry **entry)
+{
+	struct dns_entry *e;
+	struct dns_waiter *w;
+	int fresh, rv;
+
+	pthread_mutex_lock(&dc->lock);
+	if (dc->started == 0 && start_threads(dc) == -1) {
+		pthread_mutex_unlock(&dc->lock);
+		return dns_resolve(dc, host, port, socktype, entry);
+	}
+	if ((e = entry_get(dc, host, port, socktype, &fresh)) == NULL) {
+		pthread_mutex_unlock(&dc->lock);
+		return EAI_MEMORY;
+	}
+	if (!e->resolving) {
+		rv = entry_answer(e, entry);
+		pthread_mutex_unlock(&dc->lock);
+		return rv;
+	}
+
+	if ((w = calloc(1, sizeof *w)) == NULL) {
+		pthread_mutex_unlock(&dc->lock);
+		return EAI_MEMORY;
+	}
+	w->tag = tag;
+	w->next = e->waiters;
+	e->waiters = w;
+	if (fresh) {
+		if (dc->queue_tail != NULL)
+			dc->queue_tail->qnext = e;
+		else
+			dc->queue_head = e;
+		dc->queue_tail = e;
+		pthread_cond_signal(&dc->work);
+	}
+	pthread_mutex_unlock(&dc->lock);
+	*entry = NULL;
+	return DNS_PENDING;
+}
+
+int dns_event_fd(const struct dns_cache *dc)
+{
+	return dc->efd;
+}
+
+int dns_poll(struct dns_cache *dc, void (*done)(void *ctx, void *tag,
+	struct dns_entry *entry, int err), void *ctx)
+{
+	struct dns_waiter *w, *next;
+	struct dns_entry *e;
+	uint64_t count;
+	int n = 0, err;
+
+	if (read(dc->efd, &count, sizeof count) == -1 && errno != EAGAIN)
+		return 0;
+	pthread_mutex_lock(&dc->lock);
+	w = dc->done_head;
+	dc->done_head = dc->done_tail = NULL;
+	pthread_mutex_unlock(&dc->lock);
+
+	for (; w != NULL; w = next) {
+		next = w->next;
+		e = w->entry;
+		if ((err = e->error) != 0) {
+			dns_release(dc, e);
+			e = NULL;
+		}
+		done(ctx, w->tag, e, err);
+		free(w);
+		n++;
+	}
+	return n;
+}
+
+const struct addrinfo *dns_addrs(const struct dns_entry *e)
+{
+	return e->addrs;
+}
+
+void dns_release(struct dns_cache *dc, struct dns_entry *e)
+{
+	pthread_mutex_lock(&dc->lock);
+	entry_put(e);
+	pthread_mutex_unlock(&dc->lock);
+}
+
+void dns_get_stats(struct dns_cache *dc, struct dns_stats *stats)
+{
+	pthread_mutex_lock(&dc->lock);
+	*stats = dc->stats;
+	pthread_mutex_unlock(&dc->lock);
+}
+
+void dns_cache_destroy(struct dns_cache *dc)
+{
+	struct dns_entry *e, *next;
+	struct dns_waiter *w;
+	int i;
+
+	pthread_mutex_lock(&dc->lock);
+	dc->stopping = 1;
+	pthread_cond_broadcast(&dc->work);
+	pthread_mutex_unlock(&dc->lock);
+	for (i = 0; i < dc->started; i++)
+		pthread_join(dc->threads[i], NULL);
+	free(dc->threads);
+
+	// lookups still queued were never answered and nobody can wait on
+	// them any more
+	for (e = dc->queue_head; e != NULL; e = e->qnext) {
+		while ((w = e->waiters) != NULL) {
+			e->waiters = w->next;
+			free(w);
+		}
+		e->refs--;
+	}
+	while ((w = dc->done_head) != NULL) {
+		dc->done_head = w->next;
+		entry_put(w->entry);
+		free(w);
+	}
+	for (i = 0; i < DNS_BUCKETS; i++) {
+		for (e = dc->buckets[i]; e != NULL; e = next) {
+			next = e->hnext;
+			entry_put(e);
+		}
+	}
+	close(dc->efd);
+	pthread_mutex_destroy(&dc->lock);
+	pthread_cond_destroy(&dc->work);
+	pthread_cond_destroy(&dc->answered);
+	free(dc);
+}
@@ -0,0 +1,60 @@
+/*
+** dns_cache.h -- cached, optionally non-blocking name resolution
+*/
+
+#ifndef DNS_CACHE_H
+#define DNS_CACHE_H
+
+#include <netdb.h>
+
+#define DNS_TTL 60          // seconds an answer is reused
+#define DNS_NEGATIVE_TTL 5  // seconds a failed lookup is remembered
+#define DNS_THREADS 2       // resolver threads, started on first async use
+
+#define DNS_PENDING 1  // dns_resolve_async(): the answer comes via dns_poll()
+
+struct dns_cache;
+
+// one cached answer. its addresses stay valid until dns_release(), even if
+// the entry expires or is replaced meanwhile.
+struct dns_entry;
+
+struct dns_stats {
+	unsigned long hits;
+	unsigned long negative_hits;  // hits on a remembered failure
+	unsigned long misses;         // lookups that went to the resolver
+	unsigned long expired;        // of those, entries past their TTL
+	unsigned long coalesced;      // lookups that joined one in flight
+};
+
+struct dns_cache *dns_cache_create(int threads, int ttl, int negative_ttl);
+
+// every entry handed out must have been released
+void dns_cache_destroy(struct dns_cache *dc);
+
+// look host/port up, from the cache or by resolving it on this thread.
+// returns 0 with a referenced *entry, or an EAI_* error.
+int dns_resolve(struct dns_cache *dc, const char *host, const char *port,
+	int socktype, struct dns_entry **entry);
+
+// the same without blocking: a cached answer comes back right away as
+// above, anything else returns DNS_PENDING and is handed to dns_poll()'s
+// callback along with tag once a resolver thread has it.
+int dns_resolve_async(struct dns_cache *dc, const char *host,
+	const char *port, int socktype, void *tag, struct dns_entry **entry);
+
+// readable while dns_poll() has answers to deliver, for poll/epoll loops
+int dns_event_fd(const struct dns_cache *dc);
+
+// call done(ctx, tag, entry, err) for every finished async lookup. entry
+// is referenced, or NULL with err set to the EAI_* error. returns how many
+// were delivered.
+int dns_poll(struct dns_cache *dc, void (*done)(void *ctx, void *tag,
+	struct dns_entry *entry, int err), void *ctx);
+
+const struct addrinfo *dns_addrs(const struct dns_entry *e);
+void dns_release(struct dns_cache *dc, struct dns_entry *e);
+
+void dns_get_stats(struct dns_cache *dc, struct dns_stats *stats);
+
+#endif
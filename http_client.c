@@ -6,318 +6,310 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <getopt.h>
+#include <time.h>
 #include <netdb.h>
-#include <arpa/inet.h>
 
+#include "client_async.h"
+#include "client_batch.h"
+#include "client_connect.h"
+#include "client_log.h"
+#include "client_ranged.h"
+#include "client_resume.h"
+#include "dns_cache.h"
+#include "response_parser.h"
+#include "url_parser.h"
 
-#define PORT "3490" // the port client will be connecting to 
+#define MAXTARGET 2048 // longest path and query we'll send
 
-#define MAXDATASIZE 30000 // max number of bytes we can get at once
+void writeMessageToFile(const char *message);
 
+void closeOutput(FILE *fp, struct resumeState *resume);
 
-struct uriInfo {
-    char  *protocol;
-    char  *server;
-    char  *serverPort;
-    char  *fullPathWithoutPort;
-    char  *port;
-    char  *path;
-};
+double nowMs(void);
 
-struct httpResponse {
-    char *httpStatusCd;
-    int  contentLength;
-    char* header;
-    char *body;
-};
+void logTimings(double start, double dns, double connected, double firstByte);
 
-struct uriInfo *getUriDetails(char str[], struct uriInfo *iUriInfo);
-struct httpResponse *parseResponse(char* buf, struct httpResponse *httpResponseDtl);
+// set in resume mode: a partial output is progress, not to be overwritten
+int keepPartialOutput = 0;
 
-void writeMessageToFile(const char *message);
-
-void writeBinaryFile(const char *message);
+//The single fetch is a coroutine on the same loop -b runs its fetches on
+struct singleFetch {
+    struct coTask task;
+    struct httpFetch fetch;
+    struct resumeState *resume;
+    FILE *fp;                      //the output, once the head said where the body goes
+    int notFound;
+    int complete;                  //resume mode: there was nothing left to fetch
+    int mismatch;                  //resume mode: the response doesn't continue the file
+    int refused;                   //resume mode: an error status, the partial output is kept
+};
 
-// get sockaddr, IPv4 or IPv6:
-void *get_in_addr(struct sockaddr *sa)
-{
-	if (sa->sa_family == AF_INET) {
-		return &(((struct sockaddr_in*)sa)->sin_addr);
-	}
-
-	return &(((struct sockaddr_in6*)sa)->sin6_addr);
-}
+int fetchOne(struct coTask *task);
 
 int main(int argc, char *argv[]) {
-    int sockfd, numbytes;
-    char buf[MAXDATASIZE];
-    struct addrinfo hints, *servinfo, *p;
     int rv;
-    char s[INET6_ADDRSTRLEN];
 
-    if (argc != 2) {
-        fprintf(stderr, "usage: client hostname\n");
-        exit(1);
+    static const struct option longOptions[] = {
+        { "verbose", no_argument, NULL, 'v' },
+        { "connect-delay", required_argument, NULL, 'd' },
+        { "identity", no_argument, NULL, 'I' },
+        { NULL, 0, NULL, 0 }
+    };
+    struct batchOptions opts = { NULL, "batch_output", BATCH_CONCURRENCY, 0 };
+    int opt, usage = 0, parts = 1, resumeMode = 0;
+
+    while ((opt = getopt_long(argc, argv, "b:c:d:Io:p:Rv", longOptions, NULL)) != -1) {
+        switch (opt) {
+        case 'b':
+            opts.listPath = optarg;
+            break;
+        case 'c':
+            opts.concurrency = atoi(optarg);
+            break;
+        case 'd':
+            connectDelayMs = atoi(optarg);
+            break;
+        case 'I':
+            opts.identity = 1;
+            break;
+        case 'o':
+            opts.outDir = optarg;
+            break;
+        case 'p':
+            parts = atoi(optarg);
+            break;
+        case 'R':
+            resumeMode = 1;
+            break;
+        case 'v':
+            if (logLevel < LV_TRACE) {
+                logLevel++;
+            }
+            break;
+        default:
+            usage = 1;
+            break;
+        }
+    }
+    if (!usage && opts.listPath != NULL && opts.concurrency > 0 && optind == argc) {
+        return runBatch(&opts) == 0 ? 0 : 1;
     }
 
-    memset(&hints, 0, sizeof hints);
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-
-    struct uriInfo *clientUriInfo = (struct uriInfo *) malloc(sizeof(struct uriInfo));
-    clientUriInfo = getUriDetails(argv[1], clientUriInfo);
+    if (usage || opts.listPath != NULL || optind != argc - 1 || parts < 1 ||
+        (resumeMode && parts > 1)) {
+        fprintf(stderr, "usage: client [-v|--verbose]... [-d|--connect-delay ms] [-I|--identity] "
+                        "[-p parts | -R] url\n"
+                        "       client [-v|--verbose]... [-I|--identity] -b url_list|- "
+                        "[-c concurrency] [-o outdir]\n");
+        exit(1);
+    }
 
-    if (strcmp(clientUriInfo->protocol, "http:") != 0) {
+    //The url is parsed where it is, and only the pieces the request needs
+    //are copied out
+    const char *url = argv[optind];
+    struct urlParts uri;
+    char host[NI_MAXHOST], port[8], target[MAXTARGET], hostHeader[NI_MAXHOST + 8];
+    if (urlParse(url, strlen(url), &uri) == -1 || !urlSchemeIs(url, &uri, "http") ||
+        uri.host.len == 0 || urlCopyHost(url, &uri, host, sizeof host) == -1 ||
+        urlCopyTarget(url, &uri, target, sizeof target) == -1 ||
+        urlCopyHostHeader(url, &uri, hostHeader, sizeof hostHeader) == -1) {
         writeMessageToFile("INVALIDPROTOCOL");
         fprintf(stderr, "INVALIDPROTOCOL");
         return (1);
     }
+    snprintf(port, sizeof port, "%d", uri.portNumber);
+
+    //Resume mode picks up a download an earlier run lost the connection on
+    struct resumeState resumeState, *resume = NULL;
+    char resumeHeaders[512] = "";
+    if (resumeMode) {
+        resume = &resumeState;
+        keepPartialOutput = 1;
+        resumeBegin(resume, "output", url);
+        resumeRequestHeaders(resume, resumeHeaders, sizeof resumeHeaders);
+    }
 
-    if ((rv = getaddrinfo(clientUriInfo->server, clientUriInfo->port, &hints, &servinfo)) != 0) {
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+    //One loop, and its DNS cache, serves both the ranged attempt and the
+    //single stream after it
+    struct httpLoop *loop = httpLoopCreate(1);
+    if (loop == NULL) {
+        perror("client");
         writeMessageToFile("NOCONNECTION");
         return 1;
     }
 
-    // loop through all the results and connect to the first we can
-    for (p = servinfo; p != NULL; p = p->ai_next) {
-        if ((sockfd = socket(p->ai_family, p->ai_socktype,
-                             p->ai_protocol)) == -1) {
+    //Large objects can come down as several byte ranges at once, if the
+    //server takes Range requests. Otherwise fall through to one stream
+    if (parts > 1) {
+        double start = nowMs(), dnsDone;
+        struct dns_entry *servers;
+        rv = dns_resolve(httpLoopDns(loop), host, port, SOCK_STREAM, &servers);
+        if (rv != 0) {
+            fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+            httpLoopDestroy(loop);
             writeMessageToFile("NOCONNECTION");
-            perror("client: socket");
-            continue;
+            return 1;
         }
-
-        if (connect(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
-            close(sockfd);
+        dnsDone = nowMs();
+        rv = fetchRanged(dns_addrs(servers), hostHeader, target, parts, "output");
+        dns_release(httpLoopDns(loop), servers);
+        if (rv == 0) {
+            httpLoopDestroy(loop);
+            logTimings(start, dnsDone, -1, -1);
+            return 0;
+        }
+        if (rv == -1) {
+            httpLoopDestroy(loop);
             writeMessageToFile("NOCONNECTION");
-            perror("client: connect");
-            continue;
+            return 1;
         }
-
-        break;
+        LOG(LV_INFO, "no ranges, fetching as one stream");
     }
 
-    if (p == NULL) {
-        fprintf(stderr, "client: failed to connect\n");
+    //Stream the body to the file as it arrives. Content-Length or the chunk
+    //framing says where it ends, so a keep-alive server doesn't have to close
+    //the connection first
+    struct singleFetch one;
+    memset(&one, 0, sizeof one);
+    one.resume = resume;
+    one.fetch.url = url;
+    one.fetch.headers = resumeHeaders;
+    one.fetch.ctx = &one;
+    //Bodies come compressed when the server can, but a resumed download
+    //continues the bytes of the file itself, which a range always is
+    one.fetch.decode = !opts.identity && resume == NULL;
+    coSpawn(loop, &one.task, fetchOne);
+    rv = httpLoopRun(loop);
+    httpLoopDestroy(loop);
+    if (rv == -1 || one.fetch.error != NULL) {
+        if (one.mismatch) {
+            LOG(LV_ERROR, "the response doesn't continue the partial output, starting over next time");
+            resumeFinish(resume);
+            return 1;
+        }
+        if (one.refused) {
+            return 1; //resumeAccept() said why, and suspended the download
+        }
+        fprintf(stderr, "client: %s\n", rv == -1 ? "event loop failed" : one.fetch.error);
+        if (one.fp != NULL) {
+            closeOutput(one.fp, resume);
+        }
         writeMessageToFile("NOCONNECTION");
-        return 2;
-    }
-
-    inet_ntop(p->ai_family, get_in_addr((struct sockaddr *) p->ai_addr),
-              s, sizeof s);
-    printf("client: connecting to %s\n", s);
-
-    freeaddrinfo(servinfo); // all done with this structure
-
-    char msg[100];
-    sprintf(msg,
-            "GET %s HTTP/1.1\r\nUser-Agent: Wget/1.15 (linux-gnu)\r\nAccept: */*\nHost: %s\r\nConnection: Keep-Alive\n\n",
-            clientUriInfo->path, clientUriInfo->serverPort);
-    // sprintf(msg,"GET %s ","test");
-    int len, bytes_sent;
-    len = strlen(msg);
-
-    if (bytes_sent = send(sockfd, msg, len, 0) < 0) {
-        puts("Send failed");
         return 1;
     }
 
-    FILE *fp;
-    fp = fopen("output", "wb"); //leave open for writing a binary file
-
-    if ((numbytes = recv(sockfd, buf, MAXDATASIZE - 1, 0)) == -1) {
-        perror("recv");
-        writeMessageToFile("NOCONNECTION");
-        exit(1);
-    }
-
-    printf("client: received '%s'\n", buf);
-
-    struct httpResponse *httpResponseDtl = (struct httpResponse *) malloc(sizeof(struct httpResponse));
-    httpResponseDtl = parseResponse(buf, httpResponseDtl);
-
-    if (strstr(httpResponseDtl->httpStatusCd, "404") != NULL) {
+    if (one.notFound) {
+        if (resume != NULL) {
+            resumeFinish(resume); //gone, nothing left to resume
+            keepPartialOutput = 0;
+        }
         writeMessageToFile("FILENOTFOUND");
-        return 0;
+    } else if (one.complete) {
+        LOG(LV_INFO, "already complete");
+        resumeFinish(resume);
+    } else if (resume != NULL) {
+        resumeFinish(resume);
+    } else {
+        fclose(one.fp);
     }
-
-    //Write the body only
-    if (httpResponseDtl->body != buf) {
-        int headerSize = (int) (httpResponseDtl->body - buf);
-        //buf+headerSize+4 means pointer to where buf is moved header size over plus 4
-        //The plus 4 is the CLRF
-        fwrite(buf + headerSize + 4, sizeof(char), numbytes - headerSize - 4, fp);
-        //numByes-headerSizs-4 is the size of the body really
+    if (one.fetch.wireBytes != one.fetch.bodyBytes) {
+        LOG(LV_INFO, "%lld bytes on the wire, %lld decoded", one.fetch.wireBytes,
+            one.fetch.bodyBytes);
     }
-    memset(buf, '\0', sizeof buf);
-
-    do {//Keep receiving the remainder of the data and writing it to the file (NOTE: there is no header here on subsequent writes)
-        if ((numbytes = recv(sockfd, buf, MAXDATASIZE - 1, 0)) == -1) {
-            writeMessageToFile("NOCONNECTION");
-            perror("recv");
-            exit(1);
-        }
-        printf("client: received '%s'\n", buf);
-
-        if (numbytes > 0) {
-
-            if (buf != NULL) {
-                fwrite(buf, sizeof(char), numbytes, fp);
-            }
-        }
-
-    } while (numbytes > 0);
-
-    buf[numbytes] = '\0';
-    fclose(fp);
-
-    close(sockfd);
+    logTimings(one.fetch.started, one.fetch.resolved, one.fetch.connected, one.fetch.firstByte);
 
     return 0;
 }
 
-struct httpResponse *parseResponse(char* buf, struct httpResponse *httpResponseDtl){
-    char* body = strstr(buf, "\r\n\r\n");
-    char* header = 0;
-    if(body) {
-        header = (char *)malloc((body - buf) + 1);
-        if(header) {
-            httpResponseDtl->header = header;
-            memcpy(header, buf, body - buf);
-            header[body - buf] = 0;
-        }
-    }
+int writeOutput(void *ctx, const char *data, size_t len) {
+    struct singleFetch *one = ctx;
+    return fwrite(data, 1, len, one->fp) == len ? 0 : -1;
+}
 
-    if(body != NULL){
-        httpResponseDtl->body = body;
-    }
+int writeResumed(void *ctx, const char *data, size_t len) {
+    struct singleFetch *one = ctx;
+    return resumeSink(one->resume, data, len);
+}
 
-    char* headerItem;
-    headerItem = strtok(header, "\r\n");
-    //"HTTP/1.0 200 OK"
-    int count = 0;
-    while(headerItem != NULL){
-        if( headerItem != NULL ){
-            if(count == 0){//First one always HTTP
-                httpResponseDtl->httpStatusCd = headerItem;
-            }
+//The head is in: decide where the body goes
+int openOutput(void *ctx, struct httpFetch *f, const struct responseHead *head) {
+    struct singleFetch *one = ctx;
+    int rv;
 
-            if(count > 0){
-                if(strstr(headerItem,"Content-Length") != NULL){
-                    int contentLength;
-                    char tmp[256];
-                    tmp[0]='\0';
-                    while (sscanf(headerItem,"%[^0123456789]%s",tmp,headerItem)>1||sscanf(headerItem,"%d%s",&contentLength,headerItem))
-                    {
-                        if (tmp[0]=='\0')
-                        {
-                            httpResponseDtl->contentLength = contentLength;
-                            break;
-                        }
-                        tmp[0]='\0';
-                    }
-                }
-            }
-            count++;
-            headerItem = strtok(NULL, "\r\n");
-        }
+    LOG(LV_INFO, "connected to %s", f->peer);
+    if (head->statusCode == 404) {
+        one->notFound = 1;
+        return 0; //the body is dropped
     }
+    if (one->resume == NULL) {
+        one->fp = fopen("output", "wb");
+        f->sink = writeOutput;
+        return one->fp != NULL ? 0 : -1;
+    }
+    //Either the rest of the partial file, or all of it if it changed
+    rv = resumeAccept(one->resume, head);
+    if (rv == 1) {
+        one->complete = 1;
+        return 0;
+    }
+    if (rv == -1) {
+        one->mismatch = 1;
+        return -1;
+    }
+    if (rv == 2) {
+        one->refused = 1;
+        return -1;
+    }
+    one->fp = one->resume->fp;
+    f->sink = writeResumed;
+    return 0;
+}
 
-    return httpResponseDtl;
-
+int fetchOne(struct coTask *task) {
+    struct singleFetch *one = (struct singleFetch *)task;
 
+    CO_BEGIN(task);
+    one->fetch.onHead = openOutput;
+    CO_AWAIT(task, httpGet(task, &one->fetch));
+    CO_END(task);
 }
 
-void writeMessageToFile(const char *message) {
-    FILE *fp;
-    fp = fopen("output", "w+");
-    fprintf(fp, "%s",message);
-    fclose(fp);
+double nowMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
 }
 
-struct uriInfo *getUriDetails(char str[], struct uriInfo *iUriInfo){
-    char *token;
+//Phases not reached (a ranged fetch has no single connect) are passed as -1
+void logTimings(double start, double dns, double connected, double firstByte) {
+    char connect[48] = "", first[48] = "";
 
-    /* get the first token */
-    token = strtok(str, "//");
-
-    /* walk through other tokens */
-    int count = 0;
-    while( token != NULL ) {
-        if(count == 0) {
-              iUriInfo->protocol = token;
-              token = strtok(NULL, "/");
-        }
-        else if(count == 1){
-             iUriInfo->server = token;
-             token = strtok(NULL, "\0");
-        }
-        else {
-           iUriInfo->path = token;
-            token = strtok(NULL, "\0");
-        }
-        count++;
-    }
-
-    //Parse the port from the server if its there
-    if(iUriInfo->server != NULL){
-        char *port;
-        port = strtok(iUriInfo->server, ":");
-        iUriInfo->server = port;
-        if(port != NULL){
-            port = strtok(NULL, ":");
-            if(port != NULL){
-                iUriInfo->port = port;
-            }else{
-                iUriInfo->port = "80";
-            }
-
-        }
+    if (connected >= 0) {
+        snprintf(connect, sizeof connect, ", connect %.2f ms", connected - dns);
     }
-
-    if(iUriInfo->protocol != NULL && iUriInfo->server != NULL){
-        int fullPathSize = strlen(iUriInfo->protocol)  + strlen("//") + strlen(iUriInfo->server) + strlen("/") + 1;
-        if(iUriInfo->path != NULL){
-            fullPathSize += strlen(iUriInfo->path);
-        }
-
-        char * newBuffer = (char *)malloc(fullPathSize);
-        strcpy(newBuffer,iUriInfo->protocol);
-        strcat(newBuffer,"//");
-        strcat(newBuffer,iUriInfo->server);
-        strcat(newBuffer,"/");
-        if(iUriInfo->path != NULL) {
-            strcat(newBuffer, iUriInfo->path);
-        }
-        iUriInfo->fullPathWithoutPort = newBuffer;
+    if (firstByte >= 0) {
+        snprintf(first, sizeof first, ", first byte %.2f ms", firstByte - connected);
     }
+    LOG(LV_INFO, "dns %.2f ms%s%s, total %.2f ms", dns - start, connect, first, nowMs() - start);
+}
 
-    if(iUriInfo->port != NULL && iUriInfo->server != NULL){
-        int fullPathSize = strlen(iUriInfo->protocol)  + strlen("//") + strlen(iUriInfo->server) + strlen(":") + strlen(iUriInfo->port) + 1 ;
-
-        char * newBuffer = (char *)malloc(fullPathSize);
-        strcpy(newBuffer,iUriInfo->protocol);
-        strcat(newBuffer,"//");
-        strcat(newBuffer,iUriInfo->server);
-        strcat(newBuffer,":");
-        strcat(newBuffer, iUriInfo->port);
-
-        iUriInfo->serverPort = newBuffer;
+//The body broke off. In resume mode what arrived is checkpointed for the next run
+void closeOutput(FILE *fp, struct resumeState *resume) {
+    if (resume != NULL) {
+        resumeSuspend(resume);
+    } else {
+        fclose(fp);
     }
+}
 
-    if(iUriInfo->path != NULL ){
-        int fullPathSize = strlen("/") + strlen(iUriInfo->path) + 1;
-        char * newBuffer = (char *)malloc(fullPathSize);
-        strcpy(newBuffer,"/");
-        strcat(newBuffer,iUriInfo->path);
-
-        iUriInfo->path = newBuffer;
+void writeMessageToFile(const char *message) {
+    if (keepPartialOutput) {
+        return;
     }
-
-
-
-    return iUriInfo;
-
+    FILE *fp;
+    fp = fopen("output", "w+");
+    fprintf(fp, "%s",message);
+    fclose(fp);
 }
 
@@ -0,0 +1,239 @@
+/*
+** http_scan.c -- vectorised delimiter scanning for HTTP header blocks
+**
+** Header parsing is mostly "where does this line end, and where is its
+** colon". Instead of a memchr()/strstr()/strtok() per question, which
+** touches every header byte several times, one pass compares 64 bytes at a
+** time against '\n' and ':' and keeps the answers as bitmasks; finding the
+** next line or colon is then a bit scan. The kernel is chosen at run time,
+** so one binary runs on any x86-64 (and the scalar version anywhere else).
+*/
+
+#include <string.h>
+
+#include "http_scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86 1
+#include <immintrin.h>
+#endif
+
+typedef size_t (*scan_fn)(const char *, size_t, uint64_t *, uint64_t *,
+	size_t);
+
+static size_t scan_dispatch(const char *buf, size_t len, uint64_t *lf,
+	uint64_t *co, size_t max_blocks);
+
+static scan_fn scan_impl = scan_dispatch;
+static const char *scan_name = "unselected";
+
+// one block of up to 64 bytes, a byte at a time
+static void classify_bytes(const char *buf, size_t n, uint64_t *lf,
+	uint64_t *co)
+{
+	size_t i;
+
+	*lf = *co = 0;
+	for (i = 0; i < n; i++) {
+		*lf |= (uint64_t)(buf[i] == '\n') << i;
+		*co |= (uint64_t)(buf[i] == ':') << i;
+	}
+}
+
+static size_t scan_scalar(const char *buf, size_t len, uint64_t *lf,
+	uint64_t *co, size_t max_blocks)
+{
+	size_t b, i = 0;
+
+	for (b = 0; b < max_blocks && i < len; b++, i += 64)
+		classify_bytes(buf + i, len - i < 64 ? len - i : 64,
+			&lf[b], &co[b]);
+	return i < len ? i : len;
+}
+
+#ifdef HAVE_X86
+
+// the last partial block goes through the vector path too, zero padded so
+// the loads stay inside the buffer and the padding matches nothing
+static inline const char *pad_tail(char *tail, const char *p, size_t n)
+{
+	memcpy(tail, p, n);
+	memset(tail + n, 0, 64 - n);
+	return tail;
+}
+
+__attribute__((target("sse2")))
+static size_t scan_sse2(const char *buf, size_t len, uint64_t *lf,
+	uint64_t *co, size_t max_blocks)
+{
+	const __m128i nl = _mm_set1_epi8('\n');
+	const __m128i cl = _mm_set1_epi8(':');
+	__m128i v;
+	char tail[64];
+	const char *p;
+	size_t b, i = 0;
+	int j;
+
+	for (b = 0; b < max_blocks && i < len; b++, i += 64) {
+		p = buf + i;
+		if (len - i < 64)
+			p = pad_tail(tail, p, len - i);
+		lf[b] = co[b] = 0;
+		for (j = 0; j < 4; j++) {
+			v = _mm_loadu_si128((const __m128i *)(p + 16 * j));
+			lf[b] |= (uint64_t)(unsigned)_mm_movemask_epi8(
+				_mm_cmpeq_epi8(v, nl)) << (16 * j);
+			co[b] |= (uint64_t)(unsigned)_mm_movemask_epi8(
+				_mm_cmpeq_epi8(v, cl)) << (16 * j);
+		}
+	}
+	return i < len ? i : len;
+}
+
+__attribute__((target("avx2")))
+static size_t scan_avx2(const char *buf, size_t len, uint64_t *lf,
+	uint64_t *co, size_t max_blocks)
+{
+	const __m256i nl = _mm256_set1_epi8('\n');
+	const __m256i cl = _mm256_set1_epi8(':');
+	__m256i lo, hi;
+	char tail[64];
+	const char *p;
+	size_t b, i = 0;
+
+	for (b = 0; b < max_blocks && i < len; b++, i += 64) {
+		p = buf + i;
+		if (len - i < 64)
+			p = pad_tail(tail, p, len - i);
+		lo = _mm256_loadu_si256((const __m256i *)p);
+		hi = _mm256_loadu_si256((const __m256i *)(p + 32));
+		lf[b] = (uint64_t)(unsigned)_mm256_movemask_epi8(
+				_mm256_cmpeq_epi8(lo, nl)) |
+			(uint64_t)(unsigned)_mm256_movemask_epi8(
+				_mm256_cmpeq_epi8(hi, nl)) << 32;
+		co[b] = (uint64_t)(unsigned)_mm256_movemask_epi8(
+				_mm256_cmpeq_epi8(lo, cl)) |
+			(uint64_t)(unsigned)_mm256_movemask_epi8(
+				_mm256_cmpeq_epi8(hi, cl)) << 32;
+	}
+	return i < len ? i : len;
+}
+
+#endif
+
+// threads may race to pick a kernel on first use. they all pick the same
+// one, so relaxed atomics are all that's needed to keep it a defined race
+static void use_kernel(scan_fn fn, const char *name)
+{
+	__atomic_store_n(&scan_name, name, __ATOMIC_RELAXED);
+	__atomic_store_n(&scan_impl, fn, __ATOMIC_RELAXED);
+}
+
+int http_scan_select(const char *name)
+{
+	if (strcmp(name, "scalar") == 0) {
+		use_kernel(scan_scalar, "scalar");
+		return 0;
+	}
+#ifdef HAVE_X86
+	__builtin_cpu_init();
+	if (strcmp(name, "sse2") == 0 && __builtin_cpu_supports("sse2")) {
+		use_kernel(scan_sse2, "sse2");
+		return 0;
+	}
+	if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+		use_kernel(scan_avx2, "avx2");
+		return 0;
+	}
+#endif
+	return -1;
+}
+
+// first call: pick the best kernel, then go straight to it from now on
+static size_t scan_dispatch(const char *buf, size_t len, uint64_t *lf,
+	uint64_t *co, size_t max_blocks)
+{
+	if (http_scan_select("avx2") == -1 && http_scan_select("sse2") == -1)
+		http_scan_select("scalar");
+	return __atomic_load_n(&scan_impl, __ATOMIC_RELAXED)(buf, len, lf, co,
+		max_blocks);
+}
+
+size_t http_scan_masks(const char *buf, size_t len, uint64_t *lf,
+	uint64_t *co, size_t max_blocks)
+{
+	return __atomic_load_n(&scan_impl, __ATOMIC_RELAXED)(buf, len, lf, co,
+		max_blocks);
+}
+
+const char *http_scan_kernel(void)
+{
+	uint64_t lf, co;
+
+	if (__atomic_load_n(&scan_impl, __ATOMIC_RELAXED) == scan_dispatch)
+		scan_dispatch("", 0, &lf, &co, 1);
+	return __atomic_load_n(&scan_name, __ATOMIC_RELAXED);
+}
+
+void http_lines_init(struct http_lines *it, const char *buf, size_t len)
+{
+	it->buf = buf;
+	it->len = len;
+	it->win_start = 0;
+	it->win_end = 0;
+	it->line_start = 0;
+	it->colon = -1;
+}
+
+// first set bit of masks at or after buf offset from, or -1
+static long next_bit(const struct http_lines *it, const uint64_t *masks,
+	size_t from)
+{
+	size_t rel = from - it->win_start;
+	size_t b = rel / 64, nblocks = (it->win_end - it->win_start + 63) / 64;
+	uint64_t m;
+
+	if (b >= nblocks)
+		return -1;
+	m = masks[b] & (~0ULL << (rel % 64));
+	while (m == 0) {
+		if (++b == nblocks)
+			return -1;
+		m = masks[b];
+	}
+	return it->win_start + b * 64 + __builtin_ctzll(m);
+}
+
+int http_lines_next(struct http_lines *it, size_t *start, size_t *len,
+	long *colon)
+{
+	size_t from = it->line_start;
+	long eol, c;
+
+	while (1) {
+		if (from < it->win_end) {
+			eol = next_bit(it, it->lf, from);
+			if (it->colon < 0) {
+				c = next_bit(it, it->co, from);
+				if (c >= 0 && (eol < 0 || c < eol))
+					it->colon = c - it->line_start;
+			}
+			if (eol >= 0) {
+				*start = it->line_start;
+				*len = eol - it->line_start;
+				*colon = it->colon;
+				it->line_start = eol + 1;
+				it->colon = -1;
+				return 1;
+			}
+		}
+
+		// everything classified so far is used up, do the next window
+		if (it->win_end == it->len)
+			return 0;
+		it->win_start = it->win_end;
+		it->win_end += http_scan_masks(it->buf + it->win_start,
+			it->len - it->win_start, it->lf, it->co, SCAN_BLOCKS);
+		from = it->win_start;
+	}
+}
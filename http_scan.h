@@ -0,0 +1,51 @@
+/*
+** http_scan.h -- vectorised delimiter scanning for HTTP header blocks
+*/
+
+#ifndef HTTP_SCAN_H
+#define HTTP_SCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SCAN_BLOCKS 16  // 64 byte blocks classified per refill
+
+// walks the lines of a buffer. the buffer is classified 64 bytes at a time
+// into a '\n' bitmask and a ':' bitmask in one pass, and lines and colons
+// are then found with bit scans, so each byte is looked at once no matter
+// how many lines or colons it holds.
+struct http_lines {
+	const char *buf;
+	size_t len;
+	size_t win_start;   // buf offset of the first classified block
+	size_t win_end;     // and of the end of the last one
+	size_t line_start;  // start of the line being assembled
+	long colon;         // its first ':', -1 if none found yet
+	uint64_t lf[SCAN_BLOCKS];
+	uint64_t co[SCAN_BLOCKS];
+};
+
+void http_lines_init(struct http_lines *it, const char *buf, size_t len);
+
+// the next complete line: *start is its offset in buf and *len its length
+// without the '\n' (a CR before it is left in, callers strip it). *colon is
+// the offset of its first ':' from *start, or -1. returns 0 when no complete
+// line is left; it->line_start is then where the unfinished one begins.
+int http_lines_next(struct http_lines *it, size_t *start, size_t *len,
+	long *colon);
+
+// the raw kernel: classify up to max_blocks 64 byte blocks of buf[0..len),
+// setting bit i of lf[b]/co[b] if byte 64 * b + i is '\n'/':'. bits past
+// len are clear. returns the number of bytes covered.
+size_t http_scan_masks(const char *buf, size_t len, uint64_t *lf,
+	uint64_t *co, size_t max_blocks);
+
+// force a kernel: "avx2", "sse2" or "scalar". returns -1 if this cpu (or
+// build) doesn't have it. otherwise the widest supported one is picked on
+// first use.
+int http_scan_select(const char *name);
+
+// name of the kernel in use
+const char *http_scan_kernel(void);
+
+#endif
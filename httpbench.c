@@ -0,0 +1,740 @@
+/*
+** httpbench.c -- an HTTP/1.1 load generator, for measuring server.c
+**
+** -c keep-alive connections are spread over -t threads, each with its own
+** epoll loop. Responses are framed with the client's response parser, so
+** Content-Length and chunked bodies both work and no connection has to be
+** closed to find where a body ends.
+**
+** Without -R every connection sends its next request as soon as the last
+** response is in, and latency is what each request took. With -R the
+** requests go out on a fixed schedule, rate/threads per second per thread,
+** handed to whichever connection is free. A request that has to wait for
+** one (because the server is behind) is timed from when it should have
+** been sent, not from when it was: this corrects for coordinated omission,
+** where a stalled server holds the load generator back and so keeps the
+** very requests that would have seen the stall from being measured.
+**
+** Latencies go into an HDR-style histogram with 3 significant digits from
+** 1 ns to hours, one per thread, merged at the end.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+
+#include "response_parser.h"
+#include "url_parser.h"
+
+#define BENCH_MAX_THREADS 256
+#define BENCH_HEAD_MAX 8192	// response header block, per connection
+#define BENCH_SCRATCH 65536	// bodies are read into this and dropped
+#define BENCH_REQUEST_MAX 8192
+#define BENCH_EVENTS 256
+
+// histogram: values below HIST_SUB are exact, above it each power of two
+// is cut into HIST_HALF steps, so any value is within 1/1024 of its bucket
+#define HIST_SUB_BITS 11
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_HALF (HIST_SUB / 2)
+#define HIST_BUCKETS 34		// up to 2^44 ns, about 4.9 hours
+#define HIST_COUNTS ((HIST_BUCKETS + 1) * HIST_HALF)
+#define HIST_MAX ((uint64_t)1 << (HIST_BUCKETS + HIST_SUB_BITS - 1))
+
+struct histogram {
+	uint64_t counts[HIST_COUNTS];
+	uint64_t total;
+	uint64_t min;
+	uint64_t max;
+	double sum;
+	double sum_sq;
+};
+
+enum conn_state {
+	BC_CONNECTING,
+	BC_IDLE,		// connected, no request on it
+	BC_SENDING,
+	BC_HEAD,
+	BC_BODY
+};
+
+struct bench_thread;
+
+struct bench_conn {
+	int fd;
+	enum conn_state state;
+	struct bench_thread *t;
+	uint64_t intended;	// when this request was due, or sent, in ns
+	size_t sent;
+	size_t received;
+	struct responseParser parser;
+	struct bodyReader body;
+	struct bench_conn *next_idle;
+	char head[BENCH_HEAD_MAX];
+};
+
+struct bench_thread {
+	pthread_t tid;
+	int index;
+	int epfd;
+	struct bench_conn *conns;
+	int nconns;
+	struct bench_conn *idle;	// connections waiting for a request
+	uint64_t next_due;		// -R: when the next request should go out
+	uint64_t interval;
+	struct histogram hist;
+	uint64_t requests;
+	uint64_t bytes;
+	uint64_t connect_errors;
+	uint64_t read_errors;
+	uint64_t status_errors;		// anything but 2xx or 3xx
+	uint64_t reconnects;		// the server closed a connection
+	char scratch[BENCH_SCRATCH];
+};
+
+struct bench_options {
+	int threads;		// -t
+	int connections;	// -c
+	double seconds;		// -d
+	double rate;		// -R: requests per second, 0 for flat out
+	int spectrum;		// -L: print the whole percentile distribution
+	struct addrinfo *addr;
+	char request[BENCH_REQUEST_MAX];
+	size_t request_len;
+};
+
+static struct bench_options opts = { 2, 10, 10, 0, 0, NULL, "", 0 };
+static uint64_t start_ns, end_ns;
+static volatile sig_atomic_t stopping;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stopping = 1;
+}
+
+static int hist_index(uint64_t v)
+{
+	int shift;
+
+	if (v >= HIST_MAX)
+		v = HIST_MAX - 1;
+	if (v < HIST_SUB)
+		return v;
+	shift = 63 - __builtin_clzll(v) - (HIST_SUB_BITS - 1);
+	return (shift + 1) * HIST_HALF + (v >> shift) - HIST_HALF;
+}
+
+// the highest value that lands in bucket i
+static uint64_t hist_value(int i)
+{
+	int shift;
+
+	if (i < HIST_SUB)
+		return i;
+	shift = i / HIST_HALF - 1;
+	return (((uint64_t)(i % HIST_HALF + HIST_HALF) + 1) << shift) - 1;
+}
+
+static void hist_record(struct histogram *h, uint64_t v)
+{
+	h->counts[hist_index(v)]++;
+	if (h->total == 0 || v < h->min)
+		h->min = v;
+	if (v > h->max)
+		h->max = v;
+	h->total++;
+	h->sum += v;
+	h->sum_sq += (double)v * v;
+}
+
+static void hist_merge(struct histogram *into, const struct histogram *h)
+{
+	int i;
+
+	if (h->total == 0)
+		return;
+	for (i = 0; i < HIST_COUNTS; i++)
+		into->counts[i] += h->counts[i];
+	if (into->total == 0 || h->min < into->min)
+		into->min = h->min;
+	if (h->max > into->max)
+		into->max = h->max;
+	into->total += h->total;
+	into->sum += h->sum;
+	into->sum_sq += h->sum_sq;
+}
+
+static uint64_t hist_percentile(const struct histogram *h, double p)
+{
+	uint64_t want, seen = 0, v;
+	int i;
+
+	if (h->total == 0)
+		return 0;
+	want = (uint64_t)ceil(p / 100 * h->total);
+	if (want < 1)
+		want = 1;
+	for (i = 0; i < HIST_COUNTS; i++) {
+		seen += h->counts[i];
+		if (seen >= want) {
+			v = hist_value(i);
+			return v < h->max ? v : h->max;
+		}
+	}
+	return h->max;
+}
+
+static const char *format_ns(double ns, char *buf, size_t size)
+{
+	if (ns < 1e3)
+		snprintf(buf, size, "%.0fns", ns);
+	else if (ns < 1e6)
+		snprintf(buf, size, "%.2fus", ns / 1e3);
+	else if (ns < 1e9)
+		snprintf(buf, size, "%.2fms", ns / 1e6);
+	else
+		snprintf(buf, size, "%.2fs", ns / 1e9);
+	return buf;
+}
+
+static void watch(struct bench_thread *t, struct bench_conn *c, int op, unsigned events)
+{
+	struct epoll_event ev;
+
+	ev.events = events;
+	ev.data.ptr = c;
+	epoll_ctl(t->epfd, op, c->fd, &ev);
+}
+
+static void open_conn(struct bench_thread *t, struct bench_conn *c)
+{
+	int one = 1;
+
+	c->state = BC_CONNECTING;
+	c->fd = socket(opts.addr->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (c->fd == -1) {
+		t->connect_errors++;
+		return;
+	}
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+	if (connect(c->fd, opts.addr->ai_addr, opts.addr->ai_addrlen) == -1 &&
+		errno != EINPROGRESS) {
+		t->connect_errors++;
+		close(c->fd);
+		c->fd = -1;
+		return;
+	}
+	watch(t, c, EPOLL_CTL_ADD, EPOLLOUT);
+}
+
+static void close_conn(struct bench_thread *t, struct bench_conn *c)
+{
+	struct bench_conn **p;
+
+	if (c->state == BC_IDLE) {
+		for (p = &t->idle; *p != NULL; p = &(*p)->next_idle) {
+			if (*p == c) {
+				*p = c->next_idle;
+				break;
+			}
+		}
+	}
+	close(c->fd);	// takes it out of the epoll set too
+	c->fd = -1;
+}
+
+static void send_request(struct bench_thread *t, struct bench_conn *c, uint64_t intended)
+{
+	ssize_t n;
+
+	c->intended = intended;
+	c->sent = 0;
+	c->received = 0;
+	responseParserInit(&c->parser);
+	n = send(c->fd, opts.request, opts.request_len, MSG_NOSIGNAL);
+	if (n == -1 && errno != EAGAIN) {
+		t->read_errors++;
+		close_conn(t, c);
+		open_conn(t, c);
+		return;
+	}
+	c->sent = n > 0 ? n : 0;
+	if (c->sent < opts.request_len) {
+		c->state = BC_SENDING;
+		watch(t, c, EPOLL_CTL_MOD, EPOLLIN | EPOLLOUT);
+	} else {
+		c->state = BC_HEAD;
+	}
+}
+
+// the connection can take a request: at once when flat out, else it waits
+// its turn on the idle list for the schedule
+static void conn_ready(struct bench_thread *t, struct bench_conn *c)
+{
+	if (opts.rate == 0) {
+		send_request(t, c, now_ns());
+		return;
+	}
+	c->state = BC_IDLE;
+	c->next_idle = t->idle;
+	t->idle = c;
+}
+
+static void conn_failed(struct bench_thread *t, struct bench_conn *c, uint64_t *counter)
+{
+	(*counter)++;
+	close_conn(t, c);
+	open_conn(t, c);
+}
+
+static int discard(void *ctx, const char *data, size_t len)
+{
+	(void)ctx;
+	(void)data;
+	(void)len;
+	return 0;
+}
+
+static void response_done(struct bench_thread *t, struct bench_conn *c, int reusable)
+{
+	int status = c->parser.head.statusCode;
+	uint64_t now = now_ns();
+
+	// a response still coming in when time is up doesn't count
+	if (now < end_ns) {
+		t->requests++;
+		hist_record(&t->hist, now - c->intended);
+		if (status < 200 || status > 399)
+			t->status_errors++;
+	}
+	if (!reusable) {
+		t->reconnects++;
+		close_conn(t, c);
+		open_conn(t, c);
+		return;
+	}
+	conn_ready(t, c);
+}
+
+static void feed_body(struct bench_thread *t, struct bench_conn *c, const char *data, size_t len)
+{
+	size_t used;
+	int rv;
+
+	rv = bodyReaderFeed(&c->body, data, len, &used, discard, NULL);
+	if (rv == -1 || (rv == 1 && used != len)) {
+		// malformed, or more than was asked for
+		conn_failed(t, c, &t->read_errors);
+	} else if (rv == 1) {
+		response_done(t, c, bodyReaderReusable(&c->body, &c->parser.head));
+	}
+}
+
+static void on_readable(struct bench_thread *t, struct bench_conn *c)
+{
+	size_t head_len;
+	ssize_t n;
+	int parsed;
+
+	if (c->state == BC_HEAD)
+		n = recv(c->fd, c->head + c->received, sizeof c->head - c->received, 0);
+	else
+		n = recv(c->fd, t->scratch, sizeof t->scratch, 0);
+	if (n == -1) {
+		if (errno != EAGAIN && errno != EINTR)
+			conn_failed(t, c, &t->read_errors);
+		return;
+	}
+	if (n == 0) {
+		if (c->state == BC_BODY && bodyReaderEof(&c->body)) {
+			response_done(t, c, 0);
+		} else if (c->state == BC_IDLE) {
+			// a keep-alive timeout, not an error
+			t->reconnects++;
+			close_conn(t, c);
+			open_conn(t, c);
+		} else {
+			conn_failed(t, c, &t->read_errors);
+		}
+		return;
+	}
+	t->bytes += n;
+
+	switch (c->state) {
+	case BC_BODY:
+		feed_body(t, c, t->scratch, n);
+		return;
+	case BC_HEAD:
+		break;
+	default:
+		// nothing was asked for
+		conn_failed(t, c, &t->read_errors);
+		return;
+	}
+
+	c->received += n;
+	parsed = responseParserFeed(&c->parser, c->head, c->received);
+	if (parsed == -1 || (parsed == 0 && c->received == sizeof c->head)) {
+		conn_failed(t, c, &t->read_errors);
+		return;
+	}
+	if (parsed == 0)
+		return;
+	c->state = BC_BODY;
+	bodyReaderInit(&c->body, &c->parser.head, 0);
+	head_len = c->parser.head.headerLength;
+	feed_body(t, c, c->head + head_len, c->received - head_len);
+}
+
+static void on_writable(struct bench_thread *t, struct bench_conn *c)
+{
+	socklen_t len = sizeof(int);
+	ssize_t n;
+	int err = 0;
+
+	if (c->state == BC_CONNECTING) {
+		getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+		if (err != 0) {
+			t->connect_errors++;
+			close_conn(t, c);
+			// don't spin on a server that isn't there
+			if (t->connect_errors % 1000 == 0)
+				usleep(10000);
+			open_conn(t, c);
+			return;
+		}
+		watch(t, c, EPOLL_CTL_MOD, EPOLLIN);
+		conn_ready(t, c);
+		return;
+	}
+	if (c->state != BC_SENDING)
+		return;
+	n = send(c->fd, opts.request + c->sent, opts.request_len - c->sent, MSG_NOSIGNAL);
+	if (n == -1) {
+		if (errno != EAGAIN)
+			conn_failed(t, c, &t->read_errors);
+		return;
+	}
+	c->sent += n;
+	if (c->sent == opts.request_len) {
+		c->state = BC_HEAD;
+		watch(t, c, EPOLL_CTL_MOD, EPOLLIN);
+	}
+}
+
+// -R: hand every request that has come due to a free connection. the ones
+// with none free stay due, and are timed from when they should have gone
+static void dispatch(struct bench_thread *t, uint64_t now)
+{
+	struct bench_conn *c;
+
+	while (t->next_due <= now && t->idle != NULL) {
+		c = t->idle;
+		t->idle = c->next_idle;
+		send_request(t, c, t->next_due);
+		t->next_due += t->interval;
+	}
+}
+
+// epoll_wait() only sleeps whole milliseconds, which at -R rates would send
+// requests in clumps and time the clumping as server latency. epoll_pwait2()
+// takes nanoseconds, on kernels from 5.11
+static int wait_events(int epfd, struct epoll_event *events, uint64_t wait)
+{
+	static int no_pwait2;
+	struct timespec ts;
+	int n;
+
+	if (!no_pwait2) {
+		ts.tv_sec = wait / 1000000000;
+		ts.tv_nsec = wait % 1000000000;
+		n = epoll_pwait2(epfd, events, BENCH_EVENTS, &ts, NULL);
+		if (n != -1 || errno != ENOSYS)
+			return n;
+		no_pwait2 = 1;
+	}
+	return epoll_wait(epfd, events, BENCH_EVENTS, (wait + 999999) / 1000000);
+}
+
+static void *bench_thread_main(void *arg)
+{
+	struct bench_thread *t = arg;
+	struct epoll_event events[BENCH_EVENTS];
+	struct bench_conn *c;
+	uint64_t now, wait;
+	int i, n;
+
+	for (i = 0; i < t->nconns; i++) {
+		t->conns[i].t = t;
+		open_conn(t, &t->conns[i]);
+	}
+	if (opts.rate > 0) {
+		t->interval = 1e9 * opts.threads / opts.rate;
+		// stagger the threads' schedules so they don't all fire at once
+		t->next_due = start_ns + t->interval * t->index / opts.threads;
+	}
+
+	while (!stopping && (now = now_ns()) < end_ns) {
+		if (opts.rate > 0)
+			dispatch(t, now);
+		// sleep until the next request is due, if a connection is free
+		// to take it, or until time is up
+		wait = end_ns - now;
+		if (opts.rate > 0 && t->idle != NULL && t->next_due - now < wait)
+			wait = t->next_due > now ? t->next_due - now : 0;
+		n = wait_events(t->epfd, events, wait);
+		for (i = 0; i < n; i++) {
+			c = events[i].data.ptr;
+			if (c->fd == -1)
+				continue;
+			if (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP) &&
+				(c->state == BC_CONNECTING || c->state == BC_SENDING))
+				on_writable(t, c);
+			else if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+				on_readable(t, c);
+		}
+	}
+
+	for (i = 0; i < t->nconns; i++)
+		if (t->conns[i].fd != -1)
+			close(t->conns[i].fd);
+	return NULL;
+}
+
+static void print_latency(const struct histogram *h)
+{
+	static const double shown[] = { 50, 75, 90, 99, 99.9, 99.99, 99.999, 100 };
+	double mean, stdev, p, lo, hi;
+	char a[32], b[32], c[32];
+	uint64_t v, count;
+	size_t i;
+	int k, tick, j;
+
+	if (h->total == 0) {
+		printf("  no responses\n");
+		return;
+	}
+	mean = h->sum / h->total;
+	stdev = sqrt(fmax(0, h->sum_sq / h->total - mean * mean));
+	printf("  mean %s  stdev %s  max %s\n", format_ns(mean, a, sizeof a),
+		format_ns(stdev, b, sizeof b), format_ns(h->max, c, sizeof c));
+	printf("  latency distribution\n");
+	for (i = 0; i < sizeof shown / sizeof shown[0]; i++)
+		printf("  %8.3f%%  %s\n", shown[i],
+			format_ns(hist_percentile(h, shown[i]), a, sizeof a));
+
+	if (!opts.spectrum)
+		return;
+	// HdrHistogram's percentile spectrum: every halving of the distance
+	// to 100% gets 5 lines, so the tail is shown as finely as the body,
+	// down to where there are too few samples to tell percentiles apart
+	printf("\n  %12s %14s %12s %14s\n", "value", "percentile", "count", "1/(1-p)");
+	for (k = 0; ldexp(1, k) <= h->total && k < 40; k++) {
+		lo = 100 - 100 / ldexp(1, k);
+		hi = 100 - 100 / ldexp(1, k + 1);
+		for (tick = 0; tick < 5; tick++) {
+			p = lo + (hi - lo) * tick / 5;
+			v = hist_percentile(h, p);
+			for (count = 0, j = 0; j <= hist_index(v); j++)
+				count += h->counts[j];
+			printf("  %12s %14.6f %12llu %14.2f\n", format_ns(v, a, sizeof a),
+				p / 100, (unsigned long long)count, 100 / (100 - p));
+		}
+	}
+	printf("  %12s %14.6f %12llu %14s\n", format_ns(h->max, a, sizeof a), 1.0,
+		(unsigned long long)h->total, "inf");
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: httpbench [-t threads] [-c connections] [-d seconds] "
+		"[-R requests_per_sec] [-H 'Name: value']... [-L] url\n");
+	exit(1);
+}
+
+// thousands of connections need more than the default 1024 descriptors
+static void raise_fd_limit(int needed)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == -1 || rl.rlim_cur >= (rlim_t)needed)
+		return;
+	rl.rlim_cur = rl.rlim_max < (rlim_t)needed ? rl.rlim_max : (rlim_t)needed;
+	setrlimit(RLIMIT_NOFILE, &rl);
+	if (rl.rlim_cur < (rlim_t)needed)
+		fprintf(stderr, "httpbench: only %llu file descriptors allowed, "
+			"some connections will fail\n", (unsigned long long)rl.rlim_cur);
+}
+
+int main(int argc, char *argv[])
+{
+	static struct bench_thread threads[BENCH_MAX_THREADS];
+	struct histogram *total;
+	struct addrinfo hints, *res;
+	struct urlParts uri;
+	const char *url;
+	char host[NI_MAXHOST], port[8], target[2048], host_header[NI_MAXHOST + 8];
+	char headers[4096] = "";
+	size_t headers_len = 0;
+	uint64_t requests = 0, bytes = 0, connect_errors = 0, read_errors = 0;
+	uint64_t status_errors = 0, reconnects = 0;
+	double elapsed;
+	int opt, rv, i;
+	struct sigaction sa;
+
+	while ((opt = getopt(argc, argv, "t:c:d:R:H:L")) != -1) {
+		switch (opt) {
+		case 't':
+			opts.threads = atoi(optarg);
+			break;
+		case 'c':
+			opts.connections = atoi(optarg);
+			break;
+		case 'd':
+			opts.seconds = atof(optarg);
+			break;
+		case 'R':
+			opts.rate = atof(optarg);
+			break;
+		case 'H':
+			rv = snprintf(headers + headers_len, sizeof headers - headers_len,
+				"%s\r\n", optarg);
+			if (rv < 0 || (size_t)rv >= sizeof headers - headers_len)
+				usage();
+			headers_len += rv;
+			break;
+		case 'L':
+			opts.spectrum = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 1 || opts.threads < 1 || opts.threads > BENCH_MAX_THREADS ||
+		opts.connections < opts.threads || opts.seconds <= 0 || opts.rate < 0)
+		usage();
+
+	url = argv[optind];
+	if (urlParse(url, strlen(url), &uri) == -1 || !urlSchemeIs(url, &uri, "http") ||
+		uri.host.len == 0 || urlCopyHost(url, &uri, host, sizeof host) == -1 ||
+		urlCopyTarget(url, &uri, target, sizeof target) == -1 ||
+		urlCopyHostHeader(url, &uri, host_header, sizeof host_header) == -1) {
+		fprintf(stderr, "httpbench: %s isn't an http:// URL\n", url);
+		return 1;
+	}
+	snprintf(port, sizeof port, "%d", uri.portNumber);
+	rv = snprintf(opts.request, sizeof opts.request,
+		"GET %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: httpbench\r\n%s\r\n",
+		target, host_header, headers);
+	if (rv < 0 || (size_t)rv >= sizeof opts.request) {
+		fprintf(stderr, "httpbench: request too long\n");
+		return 1;
+	}
+	opts.request_len = rv;
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((rv = getaddrinfo(host, port, &hints, &res)) != 0) {
+		fprintf(stderr, "httpbench: %s: %s\n", host, gai_strerror(rv));
+		return 1;
+	}
+	opts.addr = res;
+	raise_fd_limit(opts.connections + opts.threads + 16);
+
+	memset(&sa, 0, sizeof sa);
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	printf("%.0fs test @ %s\n  %d threads, %d connections, ", opts.seconds, url,
+		opts.threads, opts.connections);
+	if (opts.rate > 0)
+		printf("%.0f requests/s\n", opts.rate);
+	else
+		printf("as fast as possible\n");
+
+	start_ns = now_ns();
+	end_ns = start_ns + (uint64_t)(opts.seconds * 1e9);
+	for (i = 0; i < opts.threads; i++) {
+		struct bench_thread *t = &threads[i];
+
+		t->index = i;
+		t->nconns = opts.connections / opts.threads +
+			(i < opts.connections % opts.threads);
+		t->conns = calloc(t->nconns, sizeof *t->conns);
+		if (t->conns == NULL || (t->epfd = epoll_create1(0)) == -1) {
+			perror("httpbench");
+			return 1;
+		}
+		if ((rv = pthread_create(&t->tid, NULL, bench_thread_main, t)) != 0) {
+			fprintf(stderr, "httpbench: pthread_create: %s\n", strerror(rv));
+			return 1;
+		}
+	}
+
+	if ((total = calloc(1, sizeof *total)) == NULL) {
+		perror("httpbench");
+		return 1;
+	}
+	for (i = 0; i < opts.threads; i++) {
+		struct bench_thread *t = &threads[i];
+
+		pthread_join(t->tid, NULL);
+		hist_merge(total, &t->hist);
+		requests += t->requests;
+		bytes += t->bytes;
+		connect_errors += t->connect_errors;
+		read_errors += t->read_errors;
+		status_errors += t->status_errors;
+		reconnects += t->reconnects;
+		close(t->epfd);
+		free(t->conns);
+	}
+	elapsed = (now_ns() - start_ns) / 1e9;
+	if (elapsed > opts.seconds)
+		elapsed = opts.seconds;
+
+	printf("  latency%s\n", opts.rate > 0 ? ", from when each request was due" : "");
+	print_latency(total);
+	printf("  %llu requests in %.2fs, %.2f MB read\n", (unsigned long long)requests,
+		elapsed, bytes / 1e6);
+	if (connect_errors || read_errors || status_errors)
+		printf("  errors: connect %llu, read %llu, non-2xx/3xx %llu\n",
+			(unsigned long long)connect_errors, (unsigned long long)read_errors,
+			(unsigned long long)status_errors);
+	if (reconnects)
+		printf("  connections closed by the server: %llu\n",
+			(unsigned long long)reconnects);
+	printf("requests/sec: %.2f\n", requests / elapsed);
+	printf("transfer/sec: %.2f MB\n", bytes / elapsed / 1e6);
+
+	free(total);
+	freeaddrinfo(res);
+	return 0;
+}
@@ -1,58 +1,691 @@
 /*
 ** listener.c -- a datagram sockets "server" demo
+**
+** Runs as a UDP ingest loop: each recvmmsg() call fills up to a batch of
+** datagrams at once, into a pool of buffers big enough for the largest
+** datagram UDP carries. Every interval it prints packets and bytes per
+** second, the datagrams the kernel dropped because the socket's receive
+** queue was full (counted with SO_RXQ_OVFL) and how full the batches came
+** back, which says whether the batch size is paying off.
+**
+** With -w N there are N receive threads, each with its own SO_REUSEPORT
+** socket so the kernel spreads flows across them by hash, and each paired
+** with a consumer thread. Datagrams are never copied: the receiver
+** recvmmsg()s into free buffers from its pool and passes their indexes
+** over a lock-free SPSC ring, and the consumer hands each index back over
+** a second ring once done with the payload. Counters are kept per thread,
+** so the report shows how evenly the hash spread the load, and a receiver
+** that runs out of free buffers (its consumer can't keep up) counts a
+** stall.
+**
+** With -T it instead takes one file from a talker started with -T over
+** rudp (see rudp.h), writes it out in order and says how it went.
 */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 
+#include "spsc_ring.h"
+#include "rudp.h"
+
 #define MYPORT "4950"	// the port users will be connecting to
 
-#define MAXBUFLEN 100
+#define MAXBUFLEN 65536	// a whole datagram, whatever its size
+#define BATCH 64	// datagrams per recvmmsg() unless -b says otherwise
+#define POOL_BATCHES 4	// buffers per receive thread, in batches, unless -n
+#define INTERVAL 1	// seconds between reports
+#define FILL_BUCKETS 12	// batch fill histogram: 1, 2-3, 4-7, ... 2048+
+#define IDLE_SPINS 256	// empty polls before a consumer naps
+#define RUDP_RCVBUF (8 << 20)	// room for a full rudp window and then some
 
+struct rx_stats {
+	unsigned long long packets;
+	unsigned long long bytes;
+	unsigned long long calls;
+	unsigned long long truncated;
+	unsigned long long stalls;	// no free buffer to receive into
+	unsigned long long consumed;	// by the consumer thread
+	uint32_t drops;		// the kernel's running count for the socket
+	unsigned long long fill[FILL_BUCKETS];
+};
 
-int main(int argc,char *argv[])
-{
+// one buffer of the pool: the payload, where it came from, its drop counter
+struct rx_slot {
+	char *buf;
+	uint32_t len;
+	struct iovec iov;
+	struct sockaddr_storage from;
+	char control[CMSG_SPACE(sizeof(uint32_t))];
+};
+
+struct rx_worker {
+	int id;
 	int sockfd;
-	struct addrinfo hints, *servinfo, *p;
+	int batch;
+	int pipelined;		// has a consumer thread, else consumes inline
+	int verbose;
+	uint32_t nslots;
+	struct rx_slot *slots;
+	char *pool;
+	struct mmsghdr *msgs;
+	uint32_t *avail;	// free slots the receiver holds on to
+	uint32_t navail;
+	uint32_t *batch_slots;	// which slot each msgs[] entry points at
+	struct spsc_ring full;	// received slots, receiver -> consumer
+	struct spsc_ring free;	// consumed slots, consumer -> receiver
+	pthread_t rx_thread;
+	pthread_t consumer_thread;
+	int rx_done;	// the receiver has pushed its last slot
+	unsigned long long checksum;	// keeps the consumer reading payloads
+	struct rx_stats st;
+};
+
+// set from the signal handler, read by every thread: atomically, since
+// volatile only covers the handler
+static volatile sig_atomic_t stopping;
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	__atomic_store_n(&stopping, 1, __ATOMIC_RELAXED);
+}
+
+static int stop_requested(void)
+{
+	return __atomic_load_n(&stopping, __ATOMIC_RELAXED);
+}
+
+// get sockaddr, IPv4 or IPv6:
+static void *get_in_addr(struct sockaddr *sa)
+{
+	if (sa->sa_family == AF_INET) {
+		return &(((struct sockaddr_in*)sa)->sin_addr);
+	}
+
+	return &(((struct sockaddr_in6*)sa)->sin6_addr);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-	int recv_bytes;
-	struct sockaddr_storage their_addr;
-	char buf[MAXBUFLEN];
-	socklen_t addr_len;
+static void add(unsigned long long *counter, unsigned long long n)
+{
+	__atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static unsigned long long load(const unsigned long long *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static int fill_bucket(int n)
+{
+	int b = 0;
+
+	while (n > 1 && b < FILL_BUCKETS - 1) {
+		n >>= 1;
+		b++;
+	}
+	return b;
+}
+
+static int open_socket(int rcvbuf, int interval, int reuseport)
+{
+	struct addrinfo hints, *servinfo, *p;
+	struct timeval tv = { interval, 0 };
+	int sockfd = -1, on = 1, rv;
 
 	memset(&hints, 0, sizeof hints);
 	hints.ai_family = AF_UNSPEC; // set to AF_INET to force IPv4
 	hints.ai_socktype = SOCK_DGRAM;
 	hints.ai_flags = AI_PASSIVE; // use my IP
-	
-
-	getaddrinfo(NULL, MYPORT, &hints, &servinfo);
 
-	
-	p = servinfo;
-	sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-	bind(sockfd, p->ai_addr, p->ai_addrlen);
+	if ((rv = getaddrinfo(NULL, MYPORT, &hints, &servinfo)) != 0) {
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+		return -1;
+	}
 
+	for (p = servinfo; p != NULL; p = p->ai_next) {
+		if ((sockfd = socket(p->ai_family, p->ai_socktype,
+				p->ai_protocol)) == -1) {
+			perror("listener: socket");
+			continue;
+		}
+		// every receive thread binds the port, the kernel hashes
+		// each flow to one of them
+		if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT,
+				&on, sizeof on) == -1) {
+			perror("setsockopt: SO_REUSEPORT");
+			close(sockfd);
+			continue;
+		}
+		if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
+			close(sockfd);
+			perror("listener: bind");
+			continue;
+		}
+		break;
+	}
 	freeaddrinfo(servinfo);
+	if (p == NULL) {
+		fprintf(stderr, "listener: failed to bind socket\n");
+		return -1;
+	}
+
+	// the kernel counts what it had to drop and tells us with each packet
+	if (setsockopt(sockfd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof on) == -1)
+		perror("setsockopt: SO_RXQ_OVFL");
+	if (rcvbuf > 0 && setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf,
+			sizeof rcvbuf) == -1)
+		perror("setsockopt: SO_RCVBUF");
+	// wake up to report (or stop) even when nothing arrives
+	setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+	return sockfd;
+}
 
-	printf("listener: waiting to recvfrom...\n");
+static int worker_init(struct rx_worker *w, int batch, uint32_t nslots,
+	int bufsize)
+{
+	uint32_t i;
 
-	addr_len = sizeof their_addr;
-	recv_bytes = recvfrom(sockfd, buf, MAXBUFLEN-1 , 0, (struct sockaddr *)&their_addr, &addr_len);
+	w->batch = batch;
+	w->nslots = nslots;
+	w->slots = calloc(nslots, sizeof *w->slots);
+	w->avail = calloc(nslots, sizeof *w->avail);
+	w->msgs = calloc(batch, sizeof *w->msgs);
+	w->batch_slots = calloc(batch, sizeof *w->batch_slots);
+	// the pool is one allocation, handed out a buffer at a time
+	w->pool = malloc((size_t)nslots * bufsize);
+	if (w->slots == NULL || w->avail == NULL || w->msgs == NULL ||
+			w->batch_slots == NULL || w->pool == NULL)
+		return -1;
+	for (i = 0; i < nslots; i++) {
+		w->slots[i].buf = w->pool + (size_t)i * bufsize;
+		w->slots[i].iov.iov_base = w->slots[i].buf;
+		w->slots[i].iov.iov_len = bufsize;
+		w->avail[i] = i;
+	}
+	w->navail = nslots;
+	if (w->pipelined && (spsc_init(&w->full, nslots) == -1 ||
+			spsc_init(&w->free, nslots) == -1))
+		return -1;
+	return 0;
+}
+
+static void worker_destroy(struct rx_worker *w)
+{
+	if (w->pipelined) {
+		spsc_destroy(&w->full);
+		spsc_destroy(&w->free);
+	}
+	free(w->pool);
+	free(w->batch_slots);
+	free(w->msgs);
+	free(w->avail);
+	free(w->slots);
+	close(w->sockfd);
+}
 
-	printf("listener: packet is %d bytes long\n", recv_bytes);
-	buf[recv_bytes] = '\0';
-	printf("listener: packet contains \"%s\"\n", buf);
+static void print_packet(struct rx_slot *slot)
+{
+	char s[INET6_ADDRSTRLEN];
+
+	printf("listener: got packet from %s\n",
+		inet_ntop(slot->from.ss_family,
+			get_in_addr((struct sockaddr *)&slot->from), s, sizeof s));
+	printf("listener: packet is %u bytes long\n", slot->len);
+	printf("listener: packet contains \"%.*s\"\n",
+		slot->len > 100 ? 100 : (int)slot->len, slot->buf);
+}
+
+// what a consumer does with a datagram: here, look at it
+static void consume(struct rx_worker *w, struct rx_slot *slot)
+{
+	uint64_t head = 0;
+
+	memcpy(&head, slot->buf, slot->len < sizeof head ? slot->len : sizeof head);
+	w->checksum += head ^ slot->len;
+	if (w->verbose)
+		print_packet(slot);
+}
+
+static void *consumer_main(void *arg)
+{
+	struct rx_worker *w = arg;
+	struct timespec nap = { 0, 50000 };
+	unsigned long long done = 0;
+	int idle = 0;
+	uint32_t i;
+
+	// drain until the receiver has quit and everything it pushed is
+	// consumed. rx_done is read first: once set, its pushes are visible
+	while (!__atomic_load_n(&w->rx_done, __ATOMIC_ACQUIRE) ||
+			spsc_depth(&w->full) > 0) {
+		if (!spsc_pop(&w->full, &i)) {
+			if (done > 0) {
+				add(&w->st.consumed, done);
+				done = 0;
+			}
+			if (++idle >= IDLE_SPINS)
+				nanosleep(&nap, NULL);
+			continue;
+		}
+		idle = 0;
+		consume(w, &w->slots[i]);
+		spsc_push(&w->free, i); // never full: it holds every slot
+		if (++done == (unsigned long long)w->batch) {
+			add(&w->st.consumed, done);
+			done = 0;
+		}
+	}
+	add(&w->st.consumed, done);
+	return NULL;
+}
+
+// one recvmmsg() into as many free slots as there are, up to a batch
+static int receive_batch(struct rx_worker *w)
+{
+	struct cmsghdr *cm;
+	unsigned long long bytes = 0, truncated = 0;
+	uint32_t idx;
+	int n, i, want;
 
+	if (w->pipelined) {
+		// take back what the consumer is done with
+		while (w->navail < w->nslots && spsc_pop(&w->free, &idx))
+			w->avail[w->navail++] = idx;
+		if (w->navail == 0) {
+			add(&w->st.stalls, 1);
+			sched_yield();
+			return 0;
+		}
+	}
+	want = w->navail < (uint32_t)w->batch ? (int)w->navail : w->batch;
+	for (i = 0; i < want; i++) {
+		struct rx_slot *slot = &w->slots[w->avail[w->navail - 1 - i]];
+		struct msghdr *h = &w->msgs[i].msg_hdr;
+
+		w->batch_slots[i] = w->avail[w->navail - 1 - i];
+		h->msg_iov = &slot->iov;
+		h->msg_iovlen = 1;
+		h->msg_name = &slot->from;
+		h->msg_namelen = sizeof slot->from;
+		h->msg_control = slot->control;
+		h->msg_controllen = sizeof slot->control;
+	}
+
+	// block for the first datagram, take whatever else is queued
+	n = recvmmsg(w->sockfd, w->msgs, want, MSG_WAITFORONE, NULL);
+	if (n == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return 0;
+		perror("recvmmsg");
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		struct msghdr *h = &w->msgs[i].msg_hdr;
+		struct rx_slot *slot = &w->slots[w->batch_slots[i]];
+
+		slot->len = w->msgs[i].msg_len;
+		bytes += slot->len;
+		if (h->msg_flags & MSG_TRUNC)
+			truncated++;
+		for (cm = CMSG_FIRSTHDR(h); cm != NULL; cm = CMSG_NXTHDR(h, cm)) {
+			if (cm->cmsg_level == SOL_SOCKET &&
+					cm->cmsg_type == SO_RXQ_OVFL)
+				__atomic_store_n(&w->st.drops,
+					*(uint32_t *)CMSG_DATA(cm), __ATOMIC_RELAXED);
+		}
+		if (w->pipelined) {
+			spsc_push(&w->full, w->batch_slots[i]);
+		} else {
+			consume(w, slot);
+		}
+	}
+	if (w->pipelined)
+		w->navail -= n; // the slots used came off the top
+	else
+		add(&w->st.consumed, n);
+
+	add(&w->st.calls, 1);
+	add(&w->st.packets, n);
+	add(&w->st.bytes, bytes);
+	add(&w->st.fill[fill_bucket(n)], 1);
+	if (truncated)
+		add(&w->st.truncated, truncated);
+	return n;
+}
+
+static void *rx_main(void *arg)
+{
+	struct rx_worker *w = arg;
+
+	while (!stop_requested() && receive_batch(w) != -1)
+		;
+	__atomic_store_n(&w->rx_done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void pin(pthread_t thread, int cpu)
+{
+	cpu_set_t set;
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	int rv;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu % (ncpu > 0 ? ncpu : 1), &set);
+	if ((rv = pthread_setaffinity_np(thread, sizeof set, &set)) != 0)
+		fprintf(stderr, "listener: pinning to cpu %d: %s\n", cpu,
+			strerror(rv));
+}
+
+static void snapshot(const struct rx_worker *w, struct rx_stats *s)
+{
+	int i;
+
+	s->packets = load(&w->st.packets);
+	s->bytes = load(&w->st.bytes);
+	s->calls = load(&w->st.calls);
+	s->truncated = load(&w->st.truncated);
+	s->stalls = load(&w->st.stalls);
+	s->consumed = load(&w->st.consumed);
+	s->drops = __atomic_load_n(&w->st.drops, __ATOMIC_RELAXED);
+	for (i = 0; i < FILL_BUCKETS; i++)
+		s->fill[i] = load(&w->st.fill[i]);
+}
+
+static void sum_stats(struct rx_stats *total, const struct rx_stats *s)
+{
+	int i;
+
+	total->packets += s->packets;
+	total->bytes += s->bytes;
+	total->calls += s->calls;
+	total->truncated += s->truncated;
+	total->stalls += s->stalls;
+	total->consumed += s->consumed;
+	total->drops += s->drops;
+	for (i = 0; i < FILL_BUCKETS; i++)
+		total->fill[i] += s->fill[i];
+}
+
+static void report(const char *what, const struct rx_stats *now_st,
+	const struct rx_stats *then, double elapsed, int histogram)
+{
+	unsigned long long packets = now_st->packets - then->packets;
+	unsigned long long calls = now_st->calls - then->calls;
+	char fill[256], stalls[64] = "";
+	int i, len = 0;
+
+	for (i = 0; histogram && i < FILL_BUCKETS; i++) {
+		unsigned long long n = now_st->fill[i] - then->fill[i];
+		int lo = 1 << i;
+
+		if (n == 0)
+			continue;
+		if (lo == 1)
+			len += snprintf(fill + len, sizeof fill - len, " 1:%llu", n);
+		else
+			len += snprintf(fill + len, sizeof fill - len, " %d-%d:%llu",
+				lo, 2 * lo - 1, n);
+	}
+	fill[len] = '\0';
+	if (now_st->stalls != then->stalls)
+		snprintf(stalls, sizeof stalls, ", %llu stalls",
+			now_st->stalls - then->stalls);
+	printf("listener: %s %.0f pkt/s, %.2f MB/s, %u dropped, "
+		"%.1f pkt/call%s%s%s\n", what, packets / elapsed,
+		(now_st->bytes - then->bytes) / elapsed / 1e6,
+		now_st->drops - then->drops,
+		calls ? (double)packets / calls : 0.0, stalls,
+		histogram ? ", fill" : "", histogram ? (len ? fill : " -") : "");
+}
+
+// per-thread lines when there are several, then the sum
+static void report_all(struct rx_worker *workers, int n, struct rx_stats *last,
+	const char *what, double elapsed)
+{
+	struct rx_stats s, total, total_last;
+	char name[32];
+	int i;
+
+	memset(&total, 0, sizeof total);
+	memset(&total_last, 0, sizeof total_last);
+	for (i = 0; i < n; i++) {
+		snapshot(&workers[i], &s);
+		if (n > 1) {
+			snprintf(name, sizeof name, "%s [%d]", what, i);
+			report(name, &s, &last[i], elapsed, 0);
+		}
+		sum_stats(&total, &s);
+		sum_stats(&total_last, &last[i]);
+		last[i] = s;
+	}
+	report(what, &total, &total_last, elapsed, 1);
+	fflush(stdout);
+}
+
+static int write_out(void *ctx, const char *data, size_t len)
+{
+	return fwrite(data, 1, len, ctx) == len ? 0 : -1;
+}
+
+static int receive_reliable(const char *path, int rcvbuf, int interval,
+	const struct rudp_config *link)
+{
+	struct rudp_stats st = { 0 };
+	FILE *out;
+	int sockfd, rv;
+
+	if ((sockfd = open_socket(rcvbuf > 0 ? rcvbuf : RUDP_RCVBUF, interval,
+			0)) == -1)
+		return 2;
+	if ((out = strcmp(path, "-") == 0 ? stdout : fopen(path, "w")) == NULL) {
+		perror("listener: fopen");
+		close(sockfd);
+		return 1;
+	}
+	fprintf(stderr, "listener: waiting for a reliable transfer...\n");
+
+	rv = rudp_recv(sockfd, write_out, out, link, &st);
 	close(sockfd);
+	if (fclose(out) == EOF && out != stdout) {
+		perror("listener: fclose");
+		rv = -1;
+	}
+	if (rv == -1) {
+		fprintf(stderr, "listener: transfer failed after %llu bytes\n",
+			st.bytes);
+		return 1;
+	}
+	fprintf(stderr, "listener: got %llu bytes in %.3f s: %.2f MB/s, "
+		"%llu packets, %llu duplicates, %llu acks dropped by shim\n",
+		st.bytes, st.elapsed,
+		st.elapsed > 0 ? st.bytes / st.elapsed / 1e6 : 0,
+		st.packets, st.duplicates, st.shim_dropped);
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: listener [-w threads [-a]] [-b batch] "
+		"[-n pool] [-s bufsize] [-r rcvbuf] [-i interval_secs] [-v]\n"
+		"       listener -T file|- [-L loss%%] [-D delay_ms] [-r rcvbuf]\n");
+	exit(1);
+}
+
+int main(int argc,char *argv[])
+{
+	int opt, i, nworkers = 0, pin_cpus = 0, batch = BATCH;
+	int bufsize = MAXBUFLEN, nslots = 0;
+	int rcvbuf = 0, interval = INTERVAL, verbose = 0;
+	struct rx_worker *workers;
+	struct rx_stats *last, total;
+	struct sigaction sa;
+	double start, last_time, t;
+	const char *reliable = NULL;
+	struct rudp_config link = { 0, 0, 2 };
+
+	while ((opt = getopt(argc, argv, "w:ab:n:s:r:i:vT:L:D:")) != -1) {
+		switch (opt) {
+		case 'w':
+			if ((nworkers = atoi(optarg)) < 1)
+				usage();
+			break;
+		case 'a':
+			pin_cpus = 1;
+			break;
+		case 'b':
+			if ((batch = atoi(optarg)) < 1)
+				usage();
+			break;
+		case 'n':
+			if ((nslots = atoi(optarg)) < 1)
+				usage();
+			break;
+		case 's':
+			if ((bufsize = atoi(optarg)) < 1)
+				usage();
+			break;
+		case 'r':
+			rcvbuf = atoi(optarg);
+			break;
+		case 'i':
+			if ((interval = atoi(optarg)) < 1)
+				usage();
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'T':
+			reliable = optarg;
+			break;
+		case 'L':
+			link.loss = atof(optarg) / 100;
+			break;
+		case 'D':
+			link.delay = atof(optarg) / 1e3;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (reliable != NULL)
+		return receive_reliable(reliable, rcvbuf, interval, &link);
+
+	if (nworkers == 0) {
+		// the single-threaded loop consumes each batch before the next
+		nslots = batch;
+	} else if (nslots == 0) {
+		nslots = batch * POOL_BATCHES;
+	} else if (nslots < batch) {
+		batch = nslots;
+	}
+
+	workers = calloc(nworkers ? nworkers : 1, sizeof *workers);
+	last = calloc(nworkers ? nworkers : 1, sizeof *last);
+	if (workers == NULL || last == NULL) {
+		perror("listener: malloc");
+		return 1;
+	}
+	for (i = 0; i < (nworkers ? nworkers : 1); i++) {
+		workers[i].id = i;
+		workers[i].pipelined = nworkers > 0;
+		workers[i].verbose = verbose;
+		if ((workers[i].sockfd = open_socket(rcvbuf, interval,
+				nworkers > 0)) == -1)
+			return 2;
+		if (worker_init(&workers[i], batch, nslots, bufsize) == -1) {
+			perror("listener: malloc");
+			return 1;
+		}
+	}
+
+	sa.sa_handler = on_signal;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = 0; // let recvmmsg() return on ^C
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	printf("listener: waiting to recvmmsg (batch %d, %d byte buffers",
+		batch, bufsize);
+	if (nworkers > 0)
+		printf(", %d threads with %d buffers each", nworkers, nslots);
+	printf(")...\n");
+	fflush(stdout);
+
+	start = last_time = now();
+	if (nworkers == 0) {
+		while (!stop_requested() && receive_batch(&workers[0]) != -1) {
+			if ((t = now()) - last_time >= interval) {
+				report_all(workers, 1, last, "last", t - last_time);
+				last_time = t;
+			}
+		}
+	} else {
+		for (i = 0; i < nworkers; i++) {
+			if (pthread_create(&workers[i].rx_thread, NULL, rx_main,
+					&workers[i]) != 0 ||
+					pthread_create(&workers[i].consumer_thread,
+					NULL, consumer_main, &workers[i]) != 0) {
+				perror("listener: pthread_create");
+				return 1;
+			}
+			// receiver and consumer on cpus of their own
+			if (pin_cpus) {
+				pin(workers[i].rx_thread, i);
+				pin(workers[i].consumer_thread, nworkers + i);
+			}
+		}
+		while (!stop_requested()) {
+			sleep(interval);
+			if ((t = now()) - last_time >= interval) {
+				report_all(workers, nworkers, last, "last",
+					t - last_time);
+				last_time = t;
+			}
+		}
+		for (i = 0; i < nworkers; i++) {
+			pthread_join(workers[i].rx_thread, NULL);
+			pthread_join(workers[i].consumer_thread, NULL);
+		}
+	}
+
+	memset(last, 0, (nworkers ? nworkers : 1) * sizeof *last);
+	report_all(workers, nworkers ? nworkers : 1, last, "total",
+		now() - start);
+	memset(&total, 0, sizeof total);
+	for (i = 0; i < (nworkers ? nworkers : 1); i++) {
+		sum_stats(&total, &workers[i].st);
+		worker_destroy(&workers[i]);
+	}
+	if (total.truncated > 0)
+		printf("listener: %llu datagrams were larger than %d bytes "
+			"and got cut\n", total.truncated, bufsize);
+
+	free(last);
+	free(workers);
 
 	return 0;
 }
@@ -0,0 +1,169 @@
+/*
+** mempool.c -- arena and slab allocators
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mempool.h"
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;
+	// keeps data ARENA_ALIGN aligned
+	char data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+struct slab_page {
+	struct slab_page *next;
+	char objects[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+// the owner is the only writer, so a plain add stored atomically is enough
+// for a reader on another thread to see whole values
+static void count(unsigned long *counter, long delta)
+{
+	__atomic_store_n(counter, *counter + delta, __ATOMIC_RELAXED);
+}
+
+static size_t round_up(size_t n)
+{
+	return (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+void arena_init(struct arena *a, size_t chunk_size, struct pool_stats *st)
+{
+	memset(a, 0, sizeof *a);
+	a->chunk_size = chunk_size ? chunk_size : ARENA_CHUNK;
+	a->st = st ? st : &a->own_st;
+}
+
+void *arena_alloc(struct arena *a, size_t n)
+{
+	struct arena_chunk *c;
+	size_t size;
+	void *p;
+
+	n = round_up(n ? n : 1);
+	// move on through chunks kept from before the last reset, then grow
+	while (a->cur == NULL || a->used + n > a->cur->size) {
+		c = a->cur ? a->cur->next : a->head;
+		if (c == NULL || n > c->size) {
+			size = n > a->chunk_size ? n : a->chunk_size;
+			if ((c = malloc(sizeof *c + size)) == NULL)
+				return NULL;
+			c->size = size;
+			if (a->cur != NULL) {
+				c->next = a->cur->next;
+				a->cur->next = c;
+			} else {
+				c->next = a->head;
+				a->head = c;
+			}
+			count(&a->st->sys_allocs, 1);
+			count(&a->st->sys_bytes, sizeof *c + size);
+		}
+		a->cur = c;
+		a->used = 0;
+	}
+	p = a->cur->data + a->used;
+	a->used += n;
+	a->handed += n;
+	count(&a->st->allocs, 1);
+	count(&a->st->in_use, n);
+	return p;
+}
+
+char *arena_strdup(struct arena *a, const char *s)
+{
+	size_t len = strlen(s) + 1;
+	char *p = arena_alloc(a, len);
+
+	return p != NULL ? memcpy(p, s, len) : NULL;
+}
+
+void arena_reset(struct arena *a)
+{
+	a->cur = NULL;
+	a->used = 0;
+	count(&a->st->frees, 1);
+	count(&a->st->in_use, -(long)a->handed);
+	a->handed = 0;
+}
+
+void arena_destroy(struct arena *a)
+{
+	struct arena_chunk *c;
+
+	while ((c = a->head) != NULL) {
+		a->head = c->next;
+		count(&a->st->sys_bytes, -(long)(sizeof *c + c->size));
+		free(c);
+	}
+	a->cur = NULL;
+	a->used = 0;
+	count(&a->st->in_use, -(long)a->handed);
+	a->handed = 0;
+}
+
+void slab_init(struct slab *s, size_t size, unsigned per_page,
+	struct pool_stats *st)
+{
+	memset(s, 0, sizeof *s);
+	// the free list is threaded through the objects themselves
+	s->size = round_up(size < sizeof(void *) ? sizeof(void *) : size);
+	s->per_page = per_page ? per_page : 1;
+	s->st = st ? st : &s->own_st;
+}
+
+void *slab_alloc(struct slab *s)
+{
+	struct slab_page *pg;
+	char *obj;
+	unsigned i;
+	void *p;
+
+	if (s->free_list == NULL) {
+		if ((pg = malloc(sizeof *pg + s->size * s->per_page)) == NULL)
+			return NULL;
+		pg->next = s->pages;
+		s->pages = pg;
+		// chain them in address order, so they're handed out that way
+		for (i = s->per_page; i-- > 0; ) {
+			obj = pg->objects + i * s->size;
+			*(void **)obj = s->free_list;
+			s->free_list = obj;
+		}
+		count(&s->st->sys_allocs, 1);
+		count(&s->st->sys_bytes, sizeof *pg + s->size * s->per_page);
+	}
+	p = s->free_list;
+	s->free_list = *(void **)p;
+	s->out++;
+	count(&s->st->allocs, 1);
+	count(&s->st->in_use, 1);
+	return p;
+}
+
+void slab_free(struct slab *s, void *p)
+{
+	*(void **)p = s->free_list;
+	s->free_list = p;
+	s->out--;
+	count(&s->st->frees, 1);
+	count(&s->st->in_use, -1);
+}
+
+void slab_destroy(struct slab *s)
+{
+	struct slab_page *pg;
+
+	while ((pg = s->pages) != NULL) {
+		s->pages = pg->next;
+		count(&s->st->sys_bytes, -(long)(sizeof *pg + s->size * s->per_page));
+		free(pg);
+	}
+	s->free_list = NULL;
+	count(&s->st->in_use, -(long)s->out);
+	s->out = 0;
+}
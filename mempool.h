@@ -0,0 +1,81 @@
+/*
+** mempool.h -- arena and slab allocators for per-request and per-connection
+** state
+**
+** An arena hands out memory by bumping a pointer through chunks it keeps,
+** and gives all of it back at once: arena_reset() is O(1) and keeps the
+** chunks, so a request that needs no more than the last one did touches
+** malloc() not at all. A slab keeps fixed-size objects (connections, I/O
+** buffers) on a free list, carving new ones out of a page of many only
+** when the list is empty, and never returns pages until it is destroyed.
+**
+** Neither is thread-safe: each belongs to one thread. Their counters are
+** written with relaxed atomic stores, so another thread can read them
+** (with __atomic_load_n) for a report while the owner works.
+*/
+
+#ifndef MEMPOOL_H
+#define MEMPOOL_H
+
+#include <stddef.h>
+
+#define ARENA_CHUNK 4096    // default arena chunk size
+#define ARENA_ALIGN 16
+
+struct pool_stats {
+	unsigned long allocs;      // blocks or objects handed out
+	unsigned long frees;       // objects given back; resets, for an arena
+	unsigned long in_use;      // objects out; bytes handed out, for an arena
+	unsigned long sys_allocs;  // malloc() calls behind them, ever
+	unsigned long sys_bytes;   // bytes they hold now
+};
+
+struct arena_chunk;
+
+struct arena {
+	struct arena_chunk *head;  // every chunk, kept across resets
+	struct arena_chunk *cur;   // the one being carved up
+	size_t used;               // bytes of cur handed out
+	size_t handed;             // bytes handed out since the last reset
+	size_t chunk_size;
+	struct pool_stats *st;     // own_st unless given one to fill in
+	struct pool_stats own_st;
+};
+
+struct slab_page;
+
+struct slab {
+	size_t size;               // object size, rounded up for alignment
+	unsigned per_page;
+	void *free_list;
+	struct slab_page *pages;
+	unsigned long out;         // objects handed out and not yet freed
+	struct pool_stats *st;
+	struct pool_stats own_st;
+};
+
+// chunk_size 0 means ARENA_CHUNK. counters go to st, which several
+// arenas or slabs may share, or to the arena's own if st is NULL.
+void arena_init(struct arena *a, size_t chunk_size, struct pool_stats *st);
+
+// n bytes aligned to ARENA_ALIGN, NULL if out of memory. big requests get a
+// chunk of their own.
+void *arena_alloc(struct arena *a, size_t n);
+char *arena_strdup(struct arena *a, const char *s);
+
+// give back everything allocated since init, keeping the chunks
+void arena_reset(struct arena *a);
+void arena_destroy(struct arena *a);
+
+// objects of size bytes, per_page of them per malloc()
+void slab_init(struct slab *s, size_t size, unsigned per_page,
+	struct pool_stats *st);
+
+// an uninitialized object, NULL if out of memory
+void *slab_alloc(struct slab *s);
+void slab_free(struct slab *s, void *p);
+
+// free every page, objects still out included
+void slab_destroy(struct slab *s);
+
+#endif
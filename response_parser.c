@@ -0,0 +1,362 @@
+/*
+** response_parser.c -- incremental, allocation-free HTTP response parser
+**
+** Replaces the old malloc + strtok + sscanf parseResponse(). Nothing is
+** copied: the status reason and every header are views into the caller's
+** receive buffer, and a header block split over several recv() calls is
+** picked up where the last call stopped.
+**
+** The body reader that follows it streams the payload out as it arrives,
+** de-chunking on the way, and knows exactly where the body ends, so the
+** connection can be reused without waiting for the server to close it.
+*/
+
+#include <string.h>
+#include <strings.h>
+
+#include "response_parser.h"
+#include "http_scan.h"
+
+void responseParserInit(struct responseParser *parser) {
+    memset(parser, 0, sizeof *parser);
+    parser->state = PARSE_STATUS_LINE;
+    parser->head.contentLength = -1;
+}
+
+static int viewEqualsNoCase(struct strView v, const char *s) {
+    size_t len = strlen(s);
+    return v.len == len && strncasecmp(v.ptr, s, len) == 0;
+}
+
+static struct strView trim(const char *ptr, size_t len) {
+    struct strView v;
+    while (len > 0 && (*ptr == ' ' || *ptr == '\t')) {
+        ptr++;
+        len--;
+    }
+    while (len > 0 && (ptr[len - 1] == ' ' || ptr[len - 1] == '\t')) {
+        len--;
+    }
+    v.ptr = ptr;
+    v.len = len;
+    return v;
+}
+
+// is token one of the comma separated items in v? (case-insensitive)
+static int hasToken(struct strView v, const char *token) {
+    const char *p = v.ptr, *end = v.ptr + v.len, *comma;
+    while (p < end) {
+        comma = memchr(p, ',', end - p);
+        if (comma == NULL) {
+            comma = end;
+        }
+        if (viewEqualsNoCase(trim(p, comma - p), token)) {
+            return 1;
+        }
+        p = comma + 1;
+    }
+    return 0;
+}
+
+// "HTTP/1.1 200 OK"
+static int parseStatusLine(struct responseHead *head, const char *line, size_t len) {
+    int code = 0, i;
+
+    if (len < 12 || memcmp(line, "HTTP/1.", 7) != 0 || line[8] != ' ') {
+        return -1;
+    }
+    if (line[7] < '0' || line[7] > '9') {
+        return -1;
+    }
+    head->versionMinor = line[7] - '0';
+
+    for (i = 9; i < 12; i++) {
+        if (line[i] < '0' || line[i] > '9') {
+            return -1;
+        }
+        code = code * 10 + line[i] - '0';
+    }
+    head->statusCode = code;
+
+    if (len > 12 && line[12] != ' ') {
+        return -1;
+    }
+    head->reason = trim(line + 12, len - 12);
+    return 0;
+}
+
+static int parseContentLength(struct responseHead *head, struct strView v) {
+    long long n = 0;
+    size_t i;
+
+    if (v.len == 0) {
+        return -1;
+    }
+    for (i = 0; i < v.len; i++) {
+        if (v.ptr[i] < '0' || v.ptr[i] > '9' || n > (0x7fffffffffffffffLL - 9) / 10) {
+            return -1;
+        }
+        n = n * 10 + v.ptr[i] - '0';
+    }
+    // repeated Content-Length headers have to agree
+    if (head->contentLength != -1 && head->contentLength != n) {
+        return -1;
+    }
+    head->contentLength = n;
+    return 0;
+}
+
+// colonAt is where the line scan found the first ':', -1 if there wasn't one
+static int parseHeaderLine(struct responseHead *head, const char *line, size_t len, long colonAt) {
+    const char *colon = line + colonAt;
+    struct strView name, value;
+
+    if (colonAt <= 0) {
+        return -1;
+    }
+    name.ptr = line;
+    name.len = colon - line;
+    value = trim(colon + 1, len - name.len - 1);
+
+    if (head->headerCount < MAXHEADERS) {
+        head->headers[head->headerCount].name = name;
+        head->headers[head->headerCount].value = value;
+        head->headerCount++;
+    }
+
+    if (viewEqualsNoCase(name, "Content-Length")) {
+        return parseContentLength(head, value);
+    }
+    if (viewEqualsNoCase(name, "Transfer-Encoding")) {
+        const char *last;
+        head->transferEncoding = value;
+        // chunked has to be the final coding
+        last = value.ptr + value.len;
+        while (last > value.ptr && last[-1] != ',') {
+            last--;
+        }
+        head->chunked = viewEqualsNoCase(trim(last, value.ptr + value.len - last), "chunked");
+    } else if (viewEqualsNoCase(name, "Connection")) {
+        head->connection = value;
+        head->connectionClose |= hasToken(value, "close");
+    }
+    return 0;
+}
+
+int responseParserFeed(struct responseParser *parser, const char *buf, size_t len) {
+    struct responseHead *head = &parser->head;
+    struct http_lines lines;
+    const char *line;
+    size_t base = parser->pos, lineStart, lineLen;
+    long colonAt;
+
+    // one pass over the new bytes finds every line end and colon
+    http_lines_init(&lines, buf + base, len - base);
+    while (parser->state != PARSE_DONE) {
+        if (!http_lines_next(&lines, &lineStart, &lineLen, &colonAt)) {
+            return 0; // the rest of this line is still in flight
+        }
+        line = buf + base + lineStart;
+        parser->pos = base + lineStart + lineLen + 1;
+
+        // CRLF is the terminator, but take a bare LF too
+        if (lineLen > 0 && line[lineLen - 1] == '\r') {
+            lineLen--;
+        }
+
+        if (parser->state == PARSE_STATUS_LINE) {
+            if (parseStatusLine(head, line, lineLen) == -1) {
+                return -1;
+            }
+            parser->state = PARSE_HEADERS;
+        } else if (lineLen == 0) {
+            head->headerLength = parser->pos;
+            parser->state = PARSE_DONE;
+        } else if (parseHeaderLine(head, line, lineLen, colonAt) == -1) {
+            return -1;
+        }
+    }
+
+    // HTTP/1.1 stays open unless told otherwise, 1.0 only when asked
+    if (head->versionMinor >= 1) {
+        head->keepAlive = !head->connectionClose;
+    } else {
+        head->keepAlive = hasToken(head->connection, "keep-alive") && !head->connectionClose;
+    }
+    return 1;
+}
+
+const struct strView *responseHeader(const struct responseHead *head, const char *name) {
+    int i;
+    for (i = 0; i < head->headerCount; i++) {
+        if (viewEqualsNoCase(head->headers[i].name, name)) {
+            return &head->headers[i].value;
+        }
+    }
+    return NULL;
+}
+
+void bodyReaderInit(struct bodyReader *reader, const struct responseHead *head, int headRequest) {
+    memset(reader, 0, sizeof *reader);
+
+    // 1xx, 204 and 304 never have a body, nor does the answer to a HEAD
+    if (headRequest || head->statusCode / 100 == 1 || head->statusCode == 204 ||
+        head->statusCode == 304) {
+        reader->state = BODY_DONE;
+    } else if (head->chunked) {
+        // chunked wins over any Content-Length that came with it
+        reader->state = BODY_CHUNK_SIZE;
+    } else if (head->contentLength >= 0) {
+        reader->state = head->contentLength > 0 ? BODY_LENGTH : BODY_DONE;
+        reader->remaining = head->contentLength;
+    } else {
+        reader->state = BODY_UNTIL_CLOSE;
+    }
+}
+
+static int hexDigit(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// pass up to reader->remaining bytes of payload on to sink
+static int takeData(struct bodyReader *reader, const char *p, size_t avail, size_t *taken,
+                    bodySink sink, void *ctx) {
+    size_t n = avail;
+
+    if (reader->state != BODY_UNTIL_CLOSE && (long long)n > reader->remaining) {
+        n = reader->remaining;
+    }
+    if (n > 0 && sink(ctx, p, n) == -1) {
+        return -1;
+    }
+    reader->received += n;
+    if (reader->state != BODY_UNTIL_CLOSE) {
+        reader->remaining -= n;
+    }
+    *taken = n;
+    return 0;
+}
+
+int bodyReaderFeed(struct bodyReader *reader, const char *buf, size_t len, size_t *used,
+                   bodySink sink, void *ctx) {
+    size_t i = 0, taken;
+    int d;
+    char c;
+
+    while (i < len && reader->state != BODY_DONE) {
+        switch (reader->state) {
+        case BODY_LENGTH:
+        case BODY_CHUNK_DATA:
+        case BODY_UNTIL_CLOSE:
+            // the bulk of the body goes to sink straight out of buf
+            if (takeData(reader, buf + i, len - i, &taken, sink, ctx) == -1) {
+                *used = i;
+                return -1;
+            }
+            i += taken;
+            if (reader->state != BODY_UNTIL_CLOSE && reader->remaining == 0) {
+                reader->state = reader->state == BODY_LENGTH ? BODY_DONE : BODY_CHUNK_DATA_CR;
+            }
+            continue;
+        default:
+            break;
+        }
+
+        // the chunk framing around it, a byte at a time
+        c = buf[i++];
+        switch (reader->state) {
+        case BODY_CHUNK_SIZE:
+            if ((d = hexDigit(c)) != -1) {
+                if (reader->remaining > (0x7fffffffffffffffLL >> 4)) {
+                    goto malformed;
+                }
+                reader->remaining = reader->remaining * 16 + d;
+                reader->digits++;
+                break;
+            }
+            if (reader->digits == 0) {
+                goto malformed;
+            }
+            if (c == ';' || c == ' ' || c == '\t') {
+                reader->state = BODY_CHUNK_EXT;
+            } else if (c == '\r') {
+                reader->state = BODY_CHUNK_SIZE_LF;
+            } else if (c == '\n') {
+                goto chunk_start;
+            } else {
+                goto malformed;
+            }
+            break;
+        case BODY_CHUNK_EXT:
+            if (c == '\r') {
+                reader->state = BODY_CHUNK_SIZE_LF;
+            } else if (c == '\n') {
+                goto chunk_start;
+            }
+            break;
+        case BODY_CHUNK_SIZE_LF:
+            if (c != '\n') {
+                goto malformed;
+            }
+        chunk_start:
+            // a zero size chunk is the last, trailers may follow it
+            reader->state = reader->remaining > 0 ? BODY_CHUNK_DATA : BODY_TRAILER;
+            reader->digits = 0;
+            break;
+        case BODY_CHUNK_DATA_CR:
+            if (c == '\r') {
+                reader->state = BODY_CHUNK_DATA_LF;
+            } else if (c == '\n') {
+                reader->state = BODY_CHUNK_SIZE;
+            } else {
+                goto malformed;
+            }
+            break;
+        case BODY_CHUNK_DATA_LF:
+            if (c != '\n') {
+                goto malformed;
+            }
+            reader->state = BODY_CHUNK_SIZE;
+            break;
+        case BODY_TRAILER:
+            // trailers are skipped, an empty line ends the message
+            if (c == '\n') {
+                reader->state = BODY_DONE;
+            } else if (c != '\r') {
+                reader->state = BODY_TRAILER_LINE;
+            }
+            break;
+        case BODY_TRAILER_LINE:
+            if (c == '\n') {
+                reader->state = BODY_TRAILER;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    *used = i;
+    return reader->state == BODY_DONE;
+
+malformed:
+    *used = i;
+    return -1;
+}
+
+int bodyReaderEof(const struct bodyReader *reader) {
+    return reader->state == BODY_DONE || reader->state == BODY_UNTIL_CLOSE;
+}
+
+int bodyReaderReusable(const struct bodyReader *reader, const struct responseHead *head) {
+    return reader->state == BODY_DONE && head->keepAlive;
+}
@@ -0,0 +1,103 @@
+/*
+** response_parser.h -- incremental, allocation-free HTTP response parser
+*/
+
+#ifndef RESPONSE_PARSER_H
+#define RESPONSE_PARSER_H
+
+#include <stddef.h>
+
+#define MAXHEADERS 64 // headers kept per response, extras are skipped
+
+// a view into the receive buffer, not NUL terminated
+struct strView {
+    const char *ptr;
+    size_t len;
+};
+
+struct httpHeader {
+    struct strView name;
+    struct strView value;
+};
+
+struct responseHead {
+    int versionMinor;
+    int statusCode;
+    struct strView reason;
+    long long contentLength;       // -1 when there is no Content-Length
+    int chunked;                   // Transfer-Encoding ends in chunked
+    int connectionClose;           // Connection: close
+    int keepAlive;                 // the connection may be reused
+    struct strView transferEncoding;
+    struct strView connection;
+    struct httpHeader headers[MAXHEADERS];
+    int headerCount;
+    size_t headerLength;           // bytes up to and including the blank line
+};
+
+enum parserState {
+    PARSE_STATUS_LINE,
+    PARSE_HEADERS,
+    PARSE_DONE
+};
+
+struct responseParser {
+    enum parserState state;
+    size_t pos;                    // first byte not yet consumed
+    struct responseHead head;
+};
+
+void responseParserInit(struct responseParser *parser);
+
+// buf holds everything received for this response so far, len bytes. call
+// again with the same (grown) buffer as more arrives, only the new bytes
+// are scanned. returns 1 once the header block is complete (body starts at
+// head.headerLength), 0 if more is needed, -1 if it is malformed.
+int responseParserFeed(struct responseParser *parser, const char *buf, size_t len);
+
+// case-insensitive header lookup, NULL if absent
+const struct strView *responseHeader(const struct responseHead *head, const char *name);
+
+enum bodyState {
+    BODY_LENGTH,                   // Content-Length bytes
+    BODY_UNTIL_CLOSE,              // no framing, the body ends at FIN
+    BODY_CHUNK_SIZE,               // in a chunk-size line
+    BODY_CHUNK_EXT,                // in its ;extensions
+    BODY_CHUNK_SIZE_LF,
+    BODY_CHUNK_DATA,
+    BODY_CHUNK_DATA_CR,            // the CRLF after chunk data
+    BODY_CHUNK_DATA_LF,
+    BODY_TRAILER,                  // at the start of a trailer line
+    BODY_TRAILER_LINE,             // inside one
+    BODY_DONE
+};
+
+// writes decoded body bytes somewhere, returns -1 to abort
+typedef int (*bodySink)(void *ctx, const char *data, size_t len);
+
+// decodes a response body as it streams in, Content-Length or chunked
+struct bodyReader {
+    enum bodyState state;
+    long long remaining;           // of the body or the current chunk
+    int digits;                    // in the current chunk-size
+    long long received;            // decoded body bytes so far
+};
+
+// set up for the body that follows head. headRequest is set when the
+// response answers a HEAD, which never has a body whatever it says.
+void bodyReaderInit(struct bodyReader *reader, const struct responseHead *head, int headRequest);
+
+// decode len bytes of body, handing the payload to sink. *used is how many
+// bytes belong to this body; anything after it is the next pipelined
+// response. returns 1 when the body is complete, 0 if more is needed and
+// -1 if it is malformed or sink failed.
+int bodyReaderFeed(struct bodyReader *reader, const char *buf, size_t len, size_t *used,
+                   bodySink sink, void *ctx);
+
+// the peer closed the connection: 1 if that legitimately ends the body
+int bodyReaderEof(const struct bodyReader *reader);
+
+// the body is complete and framed, so the connection can carry another request
+int bodyReaderReusable(const struct bodyReader *reader, const struct responseHead *head);
+
+#endif
@@ -0,0 +1,740 @@
+/*
+** rudp.c -- reliable, ordered bulk transfer over a UDP socket
+**
+** The data is cut into RUDP_MSS byte segments numbered from 0. The
+** receiver acknowledges every data packet with the next segment it needs
+** in order (cumulative), the number of the segment that just arrived, a
+** bitmap of the 32 after the cumulative one that it holds, and the
+** sender's timestamp echoed back for an RTT sample.
+**
+** The sender keeps up to RUDP_WINDOW segments outstanding, limited by a
+** congestion window: slow start, then one segment per round trip, halved
+** once per loss episode and collapsed to one segment on a timeout. A
+** segment is declared lost once three segments transmitted after it have
+** arrived (counting transmissions, not segment numbers, so a retransmission
+** that is lost again is caught the same way), or once a later one has
+** arrived and it is still missing a quarter RTT past its own round trip.
+** Two tail loss probes, at two RTTs without an ack, resend the newest
+** segment so a loss at the end of a flight shows up in the SACK bits
+** rather than waiting for the retransmission timer, which follows RFC
+** 6298.
+**
+** The loss/delay shim sits in this end's send path, so a transfer over
+** loopback can be put through 1-10% loss and a given round trip time.
+*/
+
+#define _GNU_SOURCE  // ppoll()
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "rudp.h"
+
+#define RUDP_DATA 1
+#define RUDP_ACK 2
+#define RUDP_FIN 3
+#define RUDP_FINACK 4
+
+#define DUPTHRESH 3      // later transmissions delivered before one counts as lost
+#define FIN_TRIES 20
+#define INITIAL_CWND 10  // segments
+#define IDLE_TIMEOUT 10.0 // seconds without a word from the peer before giving up
+#define MIN_PTO 0.002    // seconds, floor on the tail loss probe timer
+#define MAX_PROBES 2     // tail loss probes before waiting out the RTO
+
+struct rudp_header {
+	uint16_t type;
+	uint16_t len;    // payload bytes
+	uint32_t seq;    // data: segment number; ack: the next one needed
+	uint32_t got;    // ack: the segment that triggered it
+	uint32_t sack;   // ack: bit i set if segment seq + 1 + i is held
+	uint32_t ts;     // data: when it was sent, in us; ack: that, echoed
+};
+
+#define RUDP_PACKET (sizeof(struct rudp_header) + RUDP_MSS)
+
+// a packet the shim is holding back
+struct delayed {
+	double due;
+	size_t len;
+	char data[RUDP_PACKET];
+};
+
+struct endpoint {
+	int fd;
+	const struct rudp_config *cfg;
+	struct rudp_stats *st;
+	uint64_t rng;
+	struct delayed *q;   // FIFO ring; the delay is constant, so is the order
+	size_t qcap;
+	size_t qhead;
+	size_t qlen;
+};
+
+enum seg_state {
+	SEG_INFLIGHT,
+	SEG_DELIVERED,    // sacked ahead of the cumulative ack
+	SEG_LOST          // waiting for retransmission
+};
+
+struct tx_seg {
+	uint8_t state;
+	uint64_t tx_id;   // of its latest transmission
+	double sent;
+};
+
+// transmissions in the order they happened
+struct tx_entry {
+	uint32_t seq;
+	uint64_t tx_id;
+};
+
+struct sender {
+	struct endpoint ep;
+	const char *data;
+	size_t len;
+	uint32_t nseg;
+	uint32_t base;        // first segment not cumulatively acked
+	uint32_t next;        // first never sent
+	struct tx_seg seg[RUDP_WINDOW];
+	struct tx_entry *txq;
+	size_t txcap, txhead, txlen;
+	uint64_t tx_count;
+	uint64_t rack_tx;     // latest transmission known to have arrived
+	uint32_t pipe;        // segments believed in the network
+	uint32_t lost;        // segments waiting for retransmission
+	uint32_t lost_hint;   // none lost below this
+	double cwnd;
+	double ssthresh;
+	uint32_t recover;     // in a loss episode until base reaches this
+	double srtt, rttvar, rto;
+	double rto_armed;     // when the oldest transmission started its timer
+	double last_ack;      // when an ack last delivered something
+	int probes;           // tail loss probes sent since then
+	double heard;         // when the last ack came in
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t now_us(void)
+{
+	return (uint32_t)(uint64_t)(now() * 1e6);
+}
+
+// xorshift64*: the shim's loss pattern repeats for a given seed
+static double next_random(struct endpoint *ep)
+{
+	ep->rng ^= ep->rng >> 12;
+	ep->rng ^= ep->rng << 25;
+	ep->rng ^= ep->rng >> 27;
+	return (ep->rng * 2685821657736338717ULL >> 11) / 9007199254740992.0;
+}
+
+static void endpoint_init(struct endpoint *ep, int fd,
+	const struct rudp_config *cfg, struct rudp_stats *st)
+{
+	memset(ep, 0, sizeof *ep);
+	ep->fd = fd;
+	ep->cfg = cfg;
+	ep->st = st;
+	ep->rng = 0x9e3779b97f4a7c15ULL ^ cfg->seed;
+	memset(st, 0, sizeof *st);
+}
+
+static void raw_send(struct endpoint *ep, const void *p, size_t len)
+{
+	// a refused or full socket is just another lost packet
+	while (send(ep->fd, p, len, 0) == -1 && errno == EINTR)
+		;
+}
+
+// hand everything that's due to the socket; returns when the next is due
+static double shim_flush(struct endpoint *ep, double t)
+{
+	struct delayed *d;
+
+	while (ep->qlen > 0) {
+		d = &ep->q[ep->qhead];
+		if (d->due > t)
+			return d->due;
+		raw_send(ep, d->data, d->len);
+		ep->qhead = (ep->qhead + 1) % ep->qcap;
+		ep->qlen--;
+	}
+	return 0;
+}
+
+static void shim_send(struct endpoint *ep, const void *p, size_t len)
+{
+	struct delayed *q;
+	size_t i;
+
+	if (ep->cfg->loss > 0 && next_random(ep) < ep->cfg->loss) {
+		ep->st->shim_dropped++;
+		return;
+	}
+	if (ep->cfg->delay <= 0) {
+		raw_send(ep, p, len);
+		return;
+	}
+	if (ep->qlen == ep->qcap) {
+		size_t cap = ep->qcap ? ep->qcap * 2 : 1024;
+
+		if ((q = malloc(cap * sizeof *q)) == NULL) {
+			raw_send(ep, p, len);
+			return;
+		}
+		for (i = 0; i < ep->qlen; i++)
+			q[i] = ep->q[(ep->qhead + i) % ep->qcap];
+		free(ep->q);
+		ep->q = q;
+		ep->qcap = cap;
+		ep->qhead = 0;
+	}
+	q = &ep->q[(ep->qhead + ep->qlen++) % ep->qcap];
+	q->due = now() + ep->cfg->delay;
+	q->len = len;
+	memcpy(q->data, p, len);
+}
+
+static void send_control(struct endpoint *ep, uint16_t type, uint32_t seq,
+	uint32_t got, uint32_t sack, uint32_t ts)
+{
+	struct rudp_header h;
+
+	h.type = htons(type);
+	h.len = 0;
+	h.seq = htonl(seq);
+	h.got = htonl(got);
+	h.sack = htonl(sack);
+	h.ts = htonl(ts);
+	shim_send(ep, &h, sizeof h);
+}
+
+// wait for a packet or until the deadline (0: none), whichever is first
+static void wait_until(struct endpoint *ep, double deadline)
+{
+	struct pollfd pfd = { ep->fd, POLLIN, 0 };
+	double t = now(), shim = ep->qlen ? ep->q[ep->qhead].due : 0;
+	struct timespec ts, *tsp = NULL;
+
+	if (shim > 0 && (deadline == 0 || shim < deadline))
+		deadline = shim;
+	if (deadline > 0) {
+		double wait = deadline > t ? deadline - t : 0;
+
+		ts.tv_sec = (time_t)wait;
+		ts.tv_nsec = (long)((wait - ts.tv_sec) * 1e9);
+		tsp = &ts;
+	}
+	ppoll(&pfd, 1, tsp, NULL);
+}
+
+static struct tx_seg *seg_of(struct sender *s, uint32_t seq)
+{
+	return &s->seg[seq & (RUDP_WINDOW - 1)];
+}
+
+// returns -1 if out of memory
+static int transmit(struct sender *s, uint32_t seq)
+{
+	char packet[RUDP_PACKET];
+	struct rudp_header *h = (struct rudp_header *)packet;
+	struct tx_seg *g = seg_of(s, seq);
+	size_t off = (size_t)seq * RUDP_MSS;
+	size_t len = s->len - off < RUDP_MSS ? s->len - off : RUDP_MSS;
+	double t = now();
+
+	if (s->txlen == s->txcap) {
+		size_t cap = s->txcap ? s->txcap * 2 : 4 * RUDP_WINDOW, i;
+		struct tx_entry *q = malloc(cap * sizeof *q);
+
+		if (q == NULL)
+			return -1;
+		for (i = 0; i < s->txlen; i++)
+			q[i] = s->txq[(s->txhead + i) % s->txcap];
+		free(s->txq);
+		s->txq = q;
+		s->txcap = cap;
+		s->txhead = 0;
+	}
+
+	h->type = htons(RUDP_DATA);
+	h->len = htons(len);
+	h->seq = htonl(seq);
+	h->got = 0;
+	h->sack = 0;
+	h->ts = htonl((uint32_t)(uint64_t)(t * 1e6));
+	memcpy(packet + sizeof *h, s->data + off, len);
+	shim_send(&s->ep, packet, sizeof *h + len);
+
+	if (seq == s->next) {
+		s->next++;
+		s->ep.st->bytes += len;
+	} else {
+		s->ep.st->retransmits++;
+	}
+	s->ep.st->packets++;
+	if (s->txlen == 0)
+		s->rto_armed = t;
+	g->state = SEG_INFLIGHT;
+	g->tx_id = ++s->tx_count;
+	g->sent = t;
+	s->txq[(s->txhead + s->txlen++) % s->txcap] =
+		(struct tx_entry){ seq, g->tx_id };
+	s->pipe++;
+	return 0;
+}
+
+static void deliver(struct sender *s, struct tx_seg *g)
+{
+	if (g->state == SEG_INFLIGHT)
+		s->pipe--;
+	else if (g->state == SEG_LOST)
+		s->lost--; // it got there after all
+	if (g->tx_id > s->rack_tx)
+		s->rack_tx = g->tx_id;
+	g->state = SEG_DELIVERED;
+}
+
+static void mark_lost(struct sender *s, uint32_t seq)
+{
+	struct tx_seg *g = seg_of(s, seq);
+
+	g->state = SEG_LOST;
+	s->pipe--;
+	s->lost++;
+	if (seq < s->lost_hint)
+		s->lost_hint = seq;
+}
+
+// drop stale entries off the front of the transmission queue, declaring
+// lost any still outstanding that DUPTHRESH later transmissions overtook,
+// or that a later one overtook more than a quarter RTT ago. returns how
+// many were declared lost.
+static int detect_losses(struct sender *s)
+{
+	struct tx_entry *e;
+	struct tx_seg *g;
+	double stale = now() - s->srtt * 5 / 4;
+	int found = 0;
+
+	while (s->txlen > 0) {
+		e = &s->txq[s->txhead];
+		g = seg_of(s, e->seq);
+		if (e->seq >= s->base && g->state == SEG_INFLIGHT &&
+				g->tx_id == e->tx_id) {
+			if (e->tx_id + DUPTHRESH > s->rack_tx &&
+					(e->tx_id >= s->rack_tx || g->sent > stale))
+				break;
+			mark_lost(s, e->seq);
+			s->ep.st->losses++;
+			found++;
+		}
+		s->txhead = (s->txhead + 1) % s->txcap;
+		s->txlen--;
+		// the timer runs from the oldest transmission still out
+		if (s->txlen > 0)
+			s->rto_armed = seg_of(s, s->txq[s->txhead].seq)->sent;
+	}
+	return found;
+}
+
+// the front of the queue was overtaken but not by enough yet: when the
+// time rule will call it lost if no ack comes first, or 0
+static double reorder_deadline(struct sender *s)
+{
+	struct tx_entry *e;
+
+	if (s->txlen == 0)
+		return 0;
+	e = &s->txq[s->txhead];
+	if (e->tx_id >= s->rack_tx)
+		return 0;
+	return seg_of(s, e->seq)->sent + s->srtt * 5 / 4;
+}
+
+// one reduction per loss episode
+static void enter_recovery(struct sender *s)
+{
+	if (s->base < s->recover)
+		return;
+	s->ssthresh = s->cwnd / 2 > 2 ? s->cwnd / 2 : 2;
+	s->cwnd = s->ssthresh;
+	s->recover = s->next;
+}
+
+static void rtt_sample(struct sender *s, double rtt)
+{
+	if (s->srtt == 0) {
+		s->srtt = rtt;
+		s->rttvar = rtt / 2;
+	} else {
+		s->rttvar = 0.75 * s->rttvar + 0.25 * (rtt > s->srtt ?
+			rtt - s->srtt : s->srtt - rtt);
+		s->srtt = 0.875 * s->srtt + 0.125 * rtt;
+	}
+	s->rto = s->srtt + 4 * s->rttvar;
+	if (s->rto < RUDP_MIN_RTO)
+		s->rto = RUDP_MIN_RTO;
+	if (s->rto > RUDP_MAX_RTO)
+		s->rto = RUDP_MAX_RTO;
+}
+
+static void on_ack(struct sender *s, const struct rudp_header *h)
+{
+	uint32_t cum = ntohl(h->seq), got = ntohl(h->got);
+	uint32_t sack = ntohl(h->sack), seq, acked = 0;
+	struct tx_seg *g;
+	int i;
+
+	if (cum > s->next || cum < s->base)
+		return; // stale or bogus
+	rtt_sample(s, (uint32_t)(now_us() - ntohl(h->ts)) / 1e6);
+
+	for (; s->base < cum; s->base++) {
+		g = seg_of(s, s->base);
+		if (g->state != SEG_DELIVERED)
+			acked++;
+		deliver(s, g);
+	}
+	if (got >= s->base && got < s->next &&
+			seg_of(s, got)->state != SEG_DELIVERED) {
+		deliver(s, seg_of(s, got));
+		acked++;
+	}
+	for (i = 0; sack != 0 && i < 32; i++, sack >>= 1) {
+		seq = cum + 1 + i;
+		if ((sack & 1) && seq < s->next &&
+				seg_of(s, seq)->state != SEG_DELIVERED) {
+			deliver(s, seg_of(s, seq));
+			acked++;
+		}
+	}
+	if (s->lost_hint < s->base)
+		s->lost_hint = s->base;
+
+	if (detect_losses(s) > 0) {
+		enter_recovery(s);
+	} else if (acked > 0 && s->base >= s->recover) {
+		if (s->cwnd < s->ssthresh)
+			s->cwnd += acked;
+		else
+			s->cwnd += (double)acked / s->cwnd;
+		if (s->cwnd > RUDP_WINDOW)
+			s->cwnd = RUDP_WINDOW;
+	}
+	if (s->cwnd > s->ep.st->max_cwnd)
+		s->ep.st->max_cwnd = s->cwnd;
+	if (acked > 0) {
+		s->last_ack = now();
+		s->probes = 0;
+		if (s->txlen > 0)
+			s->rto_armed = seg_of(s, s->txq[s->txhead].seq)->sent;
+	}
+}
+
+// nothing acked for two RTTs with the window used up: resend the newest
+// segment so its ack, with the SACK bits, exposes any loss in the tail
+// before the RTO has to. a second probe covers the first (or its ack)
+// going missing too. returns the probe timer's deadline, or 0.
+static double tail_probe(struct sender *s, double t, int *rv)
+{
+	double pto = 2 * s->srtt > MIN_PTO ? 2 * s->srtt : MIN_PTO;
+	uint32_t seq;
+
+	if (s->probes == MAX_PROBES || s->txlen == 0 || s->srtt == 0)
+		return 0;
+	if (t - s->last_ack < pto * (s->probes + 1))
+		return s->last_ack + pto * (s->probes + 1);
+	seq = s->txq[(s->txhead + s->txlen - 1) % s->txcap].seq;
+	if (seq < s->base || seg_of(s, seq)->state != SEG_INFLIGHT)
+		return 0;
+	s->pipe--; // transmit() counts it in again
+	if (transmit(s, seq) == -1)
+		*rv = -1; // out of memory
+	s->probes++;
+	return 0;
+}
+
+// nothing acknowledged for a whole RTO: everything out is presumed lost
+static void on_timeout(struct sender *s)
+{
+	struct tx_entry *e;
+	struct tx_seg *g;
+
+	while (s->txlen > 0) {
+		e = &s->txq[s->txhead];
+		g = seg_of(s, e->seq);
+		if (e->seq >= s->base && g->state == SEG_INFLIGHT &&
+				g->tx_id == e->tx_id)
+			mark_lost(s, e->seq);
+		s->txhead = (s->txhead + 1) % s->txcap;
+		s->txlen--;
+	}
+	s->ep.st->timeouts++;
+	s->ssthresh = s->cwnd / 2 > 2 ? s->cwnd / 2 : 2;
+	s->cwnd = 1;
+	s->recover = s->next;
+	s->rto = s->rto * 2 < RUDP_MAX_RTO ? s->rto * 2 : RUDP_MAX_RTO;
+}
+
+// the lowest segment waiting for retransmission
+static uint32_t next_lost(struct sender *s)
+{
+	uint32_t seq;
+
+	for (seq = s->lost_hint; seq < s->next; seq++) {
+		if (seg_of(s, seq)->state == SEG_LOST) {
+			s->lost_hint = seq + 1;
+			return seq;
+		}
+	}
+	s->lost = 0; // can't happen, but don't spin on it
+	return s->next;
+}
+
+static void drain_acks(struct sender *s, int *finished)
+{
+	char buf[RUDP_PACKET];
+	struct rudp_header h;
+	ssize_t n;
+
+	while ((n = recv(s->ep.fd, buf, sizeof buf, MSG_DONTWAIT)) > 0 ||
+			(n == -1 && (errno == EINTR || errno == ECONNREFUSED))) {
+		if (n < (ssize_t)sizeof h)
+			continue;
+		memcpy(&h, buf, sizeof h);
+		s->heard = now();
+		if (ntohs(h.type) == RUDP_ACK)
+			on_ack(s, &h);
+		else if (ntohs(h.type) == RUDP_FINACK)
+			*finished = 1;
+	}
+}
+
+int rudp_send(int fd, const char *data, size_t len,
+	const struct rudp_config *cfg, struct rudp_stats *stats)
+{
+	struct sender *s = calloc(1, sizeof *s);
+	double start = now(), t, deadline, probe, fin_sent = 0;
+	int finished = 0, fin_tries = 0, rv = 0;
+	uint32_t seq;
+
+	if (s == NULL)
+		return -1;
+	endpoint_init(&s->ep, fd, cfg, stats);
+	s->data = data;
+	s->len = len;
+	s->nseg = (len + RUDP_MSS - 1) / RUDP_MSS;
+	s->cwnd = INITIAL_CWND;
+	s->ssthresh = RUDP_WINDOW;
+	s->rto = 0.2; // until the first RTT sample
+	s->heard = s->last_ack = start;
+
+	while (!finished) {
+		t = now();
+		shim_flush(&s->ep, t);
+		if (s->txlen > 0 && t - s->rto_armed >= s->rto)
+			on_timeout(s);
+		else if (detect_losses(s) > 0) // the reorder window ran out
+			enter_recovery(s);
+
+		// retransmissions first, then new segments, as cwnd allows
+		while (s->pipe < (uint32_t)s->cwnd) {
+			if (s->lost > 0 && (seq = next_lost(s)) < s->next) {
+				s->lost--;
+			} else if (s->next < s->nseg &&
+					s->next < s->base + RUDP_WINDOW) {
+				seq = s->next;
+			} else {
+				break;
+			}
+			if (transmit(s, seq) == -1) {
+				rv = -1;
+				finished = 1;
+				break;
+			}
+		}
+
+		deadline = s->txlen > 0 ? s->rto_armed + s->rto : 0;
+		if ((probe = tail_probe(s, t, &rv)) > 0 && probe < deadline)
+			deadline = probe;
+		if ((probe = reorder_deadline(s)) > 0 && probe < deadline)
+			deadline = probe;
+		if (rv == -1)
+			break;
+		if (s->base == s->nseg) {
+			// all there: say so until the receiver confirms
+			if (t - fin_sent >= s->rto) {
+				if (++fin_tries > FIN_TRIES) {
+					rv = -1;
+					break;
+				}
+				send_control(&s->ep, RUDP_FIN, s->nseg, 0, 0, now_us());
+				fin_sent = t;
+			}
+			deadline = fin_sent + s->rto;
+		} else if (t - s->heard > IDLE_TIMEOUT) {
+			rv = -1; // nobody is listening
+			break;
+		}
+		if (deadline == 0)
+			deadline = s->heard + IDLE_TIMEOUT;
+		wait_until(&s->ep, deadline);
+		drain_acks(s, &finished);
+	}
+
+	stats->srtt = s->srtt;
+	stats->elapsed = now() - start;
+	free(s->txq);
+	free(s->ep.q);
+	free(s);
+	return rv;
+}
+
+struct receiver {
+	struct endpoint ep;
+	uint32_t expected;           // next segment to deliver
+	uint8_t present[RUDP_WINDOW];
+	uint16_t seglen[RUDP_WINDOW];
+	char *buf;                   // RUDP_WINDOW segments
+};
+
+static uint32_t sack_bits(const struct receiver *r)
+{
+	uint32_t bits = 0;
+	int i;
+
+	for (i = 0; i < 32; i++)
+		if (r->present[(r->expected + 1 + i) & (RUDP_WINDOW - 1)])
+			bits |= 1u << i;
+	return bits;
+}
+
+// store a data segment and deliver whatever is now in order. returns -1 if
+// the sink refused it.
+static int on_data(struct receiver *r, const struct rudp_header *h,
+	const char *payload, rudp_sink sink, void *ctx)
+{
+	uint32_t seq = ntohl(h->seq), slot;
+	uint16_t len = ntohs(h->len);
+
+	r->ep.st->packets++;
+	if (len > RUDP_MSS)
+		return 0;
+	if (seq < r->expected || (seq < r->expected + RUDP_WINDOW &&
+			r->present[seq & (RUDP_WINDOW - 1)])) {
+		r->ep.st->duplicates++;
+	} else if (seq < r->expected + RUDP_WINDOW) {
+		slot = seq & (RUDP_WINDOW - 1);
+		memcpy(r->buf + (size_t)slot * RUDP_MSS, payload, len);
+		r->seglen[slot] = len;
+		r->present[slot] = 1;
+		while (r->present[slot = r->expected & (RUDP_WINDOW - 1)]) {
+			if (sink(ctx, r->buf + (size_t)slot * RUDP_MSS,
+					r->seglen[slot]) != 0)
+				return -1;
+			r->ep.st->bytes += r->seglen[slot];
+			r->present[slot] = 0;
+			r->expected++;
+		}
+	}
+	send_control(&r->ep, RUDP_ACK, r->expected, seq, sack_bits(r),
+		ntohl(h->ts));
+	return 0;
+}
+
+int rudp_recv(int fd, rudp_sink sink, void *ctx,
+	const struct rudp_config *cfg, struct rudp_stats *stats)
+{
+	struct receiver *r = calloc(1, sizeof *r);
+	char packet[RUDP_PACKET];
+	struct sockaddr_storage from;
+	socklen_t fromlen = sizeof from;
+	struct rudp_header h;
+	double start = 0, done_at = 0, heard;
+	ssize_t n;
+	int rv = 0;
+
+	if (r == NULL || (r->buf = malloc((size_t)RUDP_WINDOW * RUDP_MSS)) == NULL) {
+		free(r);
+		return -1;
+	}
+	endpoint_init(&r->ep, fd, cfg, stats);
+
+	// the first packet picks the sender, the rest of the world is ignored
+	do {
+		n = recvfrom(fd, packet, sizeof packet, 0,
+			(struct sockaddr *)&from, &fromlen);
+	} while (n == -1 && (errno == EINTR || errno == EAGAIN));
+	if (n == -1 || connect(fd, (struct sockaddr *)&from, fromlen) == -1) {
+		rv = -1;
+		goto out;
+	}
+	start = heard = now();
+
+	for (;;) {
+		if (n >= (ssize_t)sizeof h) {
+			memcpy(&h, packet, sizeof h);
+			if (ntohs(h.type) == RUDP_DATA &&
+					n >= (ssize_t)(sizeof h + ntohs(h.len))) {
+				if (on_data(r, &h, packet + sizeof h, sink, ctx) == -1) {
+					rv = -1;
+					break;
+				}
+			} else if (ntohs(h.type) == RUDP_FIN &&
+					ntohl(h.seq) == r->expected) {
+				// answer every copy, the sender may miss ours
+				send_control(&r->ep, RUDP_FINACK, r->expected, 0, 0,
+					ntohl(h.ts));
+				if (done_at == 0)
+					done_at = now();
+			}
+		}
+
+		shim_flush(&r->ep, now());
+		if (done_at > 0 && now() - done_at >= RUDP_LINGER &&
+				r->ep.qlen == 0)
+			break;
+		while ((n = recv(fd, packet, sizeof packet, MSG_DONTWAIT)) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK &&
+					errno != ECONNREFUSED) {
+				rv = -1;
+				goto out;
+			}
+			wait_until(&r->ep, done_at > 0 ? done_at + RUDP_LINGER :
+				heard + IDLE_TIMEOUT);
+			shim_flush(&r->ep, now());
+			if (done_at > 0 && now() - done_at >= RUDP_LINGER)
+				goto out;
+			if (done_at == 0 && now() - heard > IDLE_TIMEOUT) {
+				rv = -1; // the sender went away
+				goto out;
+			}
+		}
+		heard = now();
+	}
+
+out:
+	stats->elapsed = (done_at > 0 ? done_at : now()) - start;
+	free(r->ep.q);
+	free(r->buf);
+	free(r);
+	return rv;
+}
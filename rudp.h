@@ -0,0 +1,51 @@
+/*
+** rudp.h -- reliable, ordered bulk transfer over a UDP socket
+*/
+
+#ifndef RUDP_H
+#define RUDP_H
+
+#include <stddef.h>
+
+#define RUDP_MSS 1400       // payload bytes per segment
+#define RUDP_WINDOW 4096    // segments in flight / buffered out of order, a power of two
+#define RUDP_MIN_RTO 0.02   // seconds
+#define RUDP_MAX_RTO 2.0
+#define RUDP_LINGER 1.0     // seconds the receiver keeps answering a repeated FIN
+
+// a local stand-in for a bad link: every packet this end sends is dropped
+// with probability loss, or else held back for delay seconds first
+struct rudp_config {
+	double loss;
+	double delay;
+	unsigned seed;
+};
+
+struct rudp_stats {
+	unsigned long long bytes;        // payload sent once / delivered in order
+	unsigned long long packets;      // data packets sent or received
+	unsigned long long retransmits;
+	unsigned long long losses;       // segments declared lost by later ones arriving
+	unsigned long long timeouts;
+	unsigned long long duplicates;   // segments the receiver had already
+	unsigned long long shim_dropped; // packets the loss shim threw away
+	double srtt;                     // seconds, sender side
+	double max_cwnd;                 // segments
+	double elapsed;
+};
+
+// in-order delivery of received bytes; nonzero aborts the transfer
+typedef int (*rudp_sink)(void *ctx, const char *data, size_t len);
+
+// send data[0..len) over the connected datagram socket fd and wait until
+// the receiver has it all. returns 0, or -1 if the peer stopped answering.
+int rudp_send(int fd, const char *data, size_t len,
+	const struct rudp_config *cfg, struct rudp_stats *stats);
+
+// wait on the bound datagram socket fd for one sender, hand what it sends
+// to sink in order and return once it's complete (0) or failed (-1). the
+// socket ends up connected to the sender.
+int rudp_recv(int fd, rudp_sink sink, void *ctx,
+	const struct rudp_config *cfg, struct rudp_stats *stats);
+
+#endif
@@ -1,5 +1,5 @@
 /*
-** server.c -- a stream socket server demo
+** server.c -- a stream socket server demo, now serving static files
 */
 
 #include <stdio.h>
@@ -9,15 +9,14 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <sys/wait.h>
 #include <signal.h>
 
-#define PORT "3490"  // the port users will be connecting to
-
-#define BACKLOG 10	 // how many pending connections queue will hold
+#include "server.h"
 
 void sigchld_handler(int s)
 {
@@ -34,15 +33,13 @@ void *get_in_addr(struct sockaddr *sa)
 	return &(((struct sockaddr_in6*)sa)->sin6_addr);
 }
 
-int main(void)
+// bind and listen on port, optionally with SO_REUSEPORT so several
+// sockets can share it. returns the listening socket or -1.
+int open_listener(const char *port, int backlog, int reuseport)
 {
-	int sockfd, new_fd;  // listen on sock_fd, new connection on new_fd
+	int sockfd;
 	struct addrinfo hints, *servinfo, *p;
-	struct sockaddr_storage their_addr; // connector's address information
-	socklen_t sin_size;
-	struct sigaction sa;
 	int yes=1;
-	char s[INET6_ADDRSTRLEN];
 	int rv;
 
 	memset(&hints, 0, sizeof hints);
@@ -50,9 +47,9 @@ int main(void)
 	hints.ai_socktype = SOCK_STREAM;
 	hints.ai_flags = AI_PASSIVE; // use my IP
 
-	if ((rv = getaddrinfo(NULL, PORT, &hints, &servinfo)) != 0) {
+	if ((rv = getaddrinfo(NULL, port, &hints, &servinfo)) != 0) {
 		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
-		return 1;
+		return -1;
 	}
 
 	// loop through all the results and bind to the first we can
@@ -69,6 +66,12 @@ int main(void)
 			exit(1);
 		}
 
+		if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT,
+				&yes, sizeof(int)) == -1) {
+			perror("setsockopt: SO_REUSEPORT");
+			exit(1);
+		}
+
 		if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
 			close(sockfd);
 			perror("server: bind");
@@ -78,16 +81,189 @@ int main(void)
 		break;
 	}
 
+	freeaddrinfo(servinfo); // all done with this structure
+
 	if (p == NULL)  {
 		fprintf(stderr, "server: failed to bind\n");
-		return 2;
+		return -1;
 	}
 
-	freeaddrinfo(servinfo); // all done with this structure
-
-	if (listen(sockfd, BACKLOG) == -1) {
+	if (listen(sockfd, backlog) == -1) {
 		perror("listen");
-		exit(1);
+		close(sockfd);
+		return -1;
+	}
+
+	return sockfd;
+}
+
+// answer requests on one connection until it closes or sits idle, used by
+// the forked children
+static void serve_connection(int sockfd, const struct server_config *cfg)
+{
+	struct http_conn *c;
+	struct worker_stats stats;
+	struct timeval tv;
+
+	if ((c = malloc(sizeof *c)) == NULL) {
+		perror("malloc");
+		return;
+	}
+
+	// the socket is blocking, so an idle timeout surfaces as EAGAIN
+	tv.tv_sec = cfg->idle_timeout;
+	tv.tv_usec = 0;
+	if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv) == -1)
+		perror("setsockopt: SO_RCVTIMEO");
+
+	memset(&stats, 0, sizeof stats);
+	http_conn_init(c, sockfd, NULL);
+	http_conn_run(c, cfg, &stats);
+	http_conn_release(c);
+	free(c);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: server [-m fork|epoll|uring|coro] [-w workers [-a]] "
+		"[-b backlog] [-d docroot] [-c] [-k idle_secs] [-r max_requests] "
+		"[-C cache_mb] [-z compress_dir] [-q]\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int sockfd, new_fd;  // listen on sock_fd, new connection on new_fd
+	struct sockaddr_storage their_addr; // connector's address information
+	socklen_t sin_size;
+	struct sigaction sa;
+	char s[INET6_ADDRSTRLEN];
+	int opt, docroot_given = 0;
+	struct server_config cfg;
+
+	memset(&cfg, 0, sizeof cfg);
+	cfg.mode = MODE_FORK;
+	cfg.backlog = BACKLOG;
+	cfg.docroot = DOCROOT;
+	cfg.idle_timeout = KEEPALIVE_TIMEOUT;
+	cfg.max_requests = MAX_REQUESTS;
+
+	while ((opt = getopt(argc, argv, "m:w:ab:d:ck:r:C:z:q")) != -1) {
+		switch (opt) {
+		case 'm':
+			if (strcmp(optarg, "fork") == 0)
+				cfg.mode = MODE_FORK;
+			else if (strcmp(optarg, "epoll") == 0)
+				cfg.mode = MODE_EPOLL;
+			else if (strcmp(optarg, "uring") == 0)
+				cfg.mode = MODE_URING;
+			else if (strcmp(optarg, "coro") == 0)
+				cfg.mode = MODE_CORO;
+			else
+				usage();
+			break;
+		case 'w':
+			if ((cfg.workers = atoi(optarg)) < 1)
+				usage();
+			break;
+		case 'a':
+			cfg.pin_cpus = 1;
+			break;
+		case 'b':
+			if ((cfg.backlog = atoi(optarg)) < 1)
+				usage();
+			break;
+		case 'd':
+			cfg.docroot = optarg;
+			docroot_given = 1;
+			break;
+		case 'c':
+			cfg.copy_body = 1;
+			break;
+		case 'k':
+			if ((cfg.idle_timeout = atoi(optarg)) < 0)
+				usage();
+			break;
+		case 'r':
+			if ((cfg.max_requests = atoi(optarg)) < 1)
+				usage();
+			break;
+		case 'C':
+			if (atoi(optarg) < 0)
+				usage();
+			cfg.cache_size = (size_t)atoi(optarg) << 20;
+			break;
+		case 'z':
+			cfg.compress_dir = optarg;
+			break;
+		case 'q':
+			cfg.quiet = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	// without -d, don't go on to answer every request with a 404
+	if (access(cfg.docroot, R_OK | X_OK) == -1) {
+		fprintf(stderr, "server: %s: %s%s\n", cfg.docroot,
+			strerror(errno), docroot_given ? "" :
+			", pick a docroot with -d");
+		return 1;
+	}
+
+	// copies are made on the request path, where failing would only mean
+	// sending files uncompressed; better to find out now
+	if (cfg.compress_dir != NULL &&
+			access(cfg.compress_dir, W_OK | X_OK) == -1) {
+		fprintf(stderr, "server: -z %s: %s\n", cfg.compress_dir,
+			strerror(errno));
+		return 1;
+	}
+
+	// sendfile() to a client that has gone away raises SIGPIPE, and there
+	// is no flag to stop it as MSG_NOSIGNAL does for send(). EPIPE will do
+	signal(SIGPIPE, SIG_IGN);
+
+	// the coroutine scheduler always runs on worker threads, one by default
+	if (cfg.mode == MODE_CORO) {
+		if (cfg.cache_size > 0) {
+			fprintf(stderr, "server: -C doesn't work with -m coro, the "
+				"cache is per thread and connections move between "
+				"threads\n");
+			return 1;
+		}
+		if (cfg.workers == 0)
+			cfg.workers = 1;
+	}
+
+	if (cfg.workers > 0) {
+		if (cfg.mode == MODE_FORK) {
+			fprintf(stderr, "server: -w needs -m epoll, uring or coro\n");
+			return 1;
+		}
+		return run_workers(&cfg);
+	}
+
+	if ((sockfd = open_listener(PORT, cfg.backlog, 0)) == -1)
+		return 2;
+
+	if (cfg.mode != MODE_FORK) {
+		struct worker_stats stats;
+		struct file_cache *cache = cfg.cache_size ?
+			cache_create(cfg.cache_size) : NULL;
+
+		memset(&stats, 0, sizeof stats);
+		if (cfg.mode == MODE_URING) {
+			printf("server: waiting for connections (io_uring)...\n");
+			fflush(stdout);
+			if (run_uring_loop(sockfd, &cfg, &stats, cache) != -1)
+				return 1;
+			fprintf(stderr, "server: io_uring unavailable (%s), "
+				"falling back to epoll\n", strerror(errno));
+		}
+		printf("server: waiting for connections (epoll)...\n");
+		return run_epoll_loop(sockfd, &cfg, &stats, cache);
 	}
 
 	sa.sa_handler = sigchld_handler; // reap all dead processes
@@ -108,15 +284,16 @@ int main(void)
 			continue;
 		}
 
-		inet_ntop(their_addr.ss_family,
-			get_in_addr((struct sockaddr *)&their_addr),
-			s, sizeof s);
-		printf("server: got connection from %s\n", s);
+		if (!cfg.quiet) {
+			inet_ntop(their_addr.ss_family,
+				get_in_addr((struct sockaddr *)&their_addr),
+				s, sizeof s);
+			printf("server: got connection from %s\n", s);
+		}
 
 		if (!fork()) { // this is the child process
 			close(sockfd); // child doesn't need the listener
-			if (send(new_fd, "Hello, world!", 13, 0) == -1)
-				perror("send");
+			serve_connection(new_fd, &cfg);
 			close(new_fd);
 			exit(0);
 		}
@@ -0,0 +1,361 @@
+/*
+** server.h -- shared definitions for the stream socket server
+*/
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "coroutine.h"
+#include "mempool.h"
+
+#define PORT "3490"  // the port users will be connecting to
+
+// how many pending connections queue will hold. connections recycled after
+// max_requests come back in bursts, and a short queue drops their SYNs
+#define BACKLOG SOMAXCONN
+
+// default directory files are served from, relative to where the server is
+// started. anything else, the current directory included, takes -d
+#define DOCROOT "server_folder"
+
+#define SERVER_NAME "httpexperiments"
+
+#define REQ_MAX 8192  // largest request header block we accept
+
+#define KEEPALIVE_TIMEOUT 5  // seconds an idle connection is kept open
+
+#define MAX_REQUESTS 100  // requests served on one connection before closing
+
+#define PIPELINE_MAX 8  // responses queued per connection
+
+#define CACHE_MAX_ENTRY (1 << 20)  // larger files always go out via sendfile
+
+#define CONN_SLAB 64  // connection objects per slab page
+
+#define CO_QUEUE 4096  // ready tasks each coroutine worker can queue
+
+#define COMPRESS_MIN 1024  // smaller files aren't worth compressing
+#define COMPRESS_MAX (4 << 20)  // nor larger ones, on the request path
+
+// content codings, as a bit mask for what a client accepts
+enum {
+	ENC_IDENTITY = 0,
+	ENC_GZIP = 1,
+	ENC_ZSTD = 2
+};
+
+enum server_mode {
+	MODE_FORK,   // one child process per connection
+	MODE_EPOLL,  // single process, edge-triggered epoll loop
+	MODE_URING,  // single process, io_uring completion loop
+	MODE_CORO    // a coroutine per connection, work-stealing threads
+};
+
+struct server_config {
+	enum server_mode mode;
+	int backlog;   // listen() queue length
+	int workers;   // SO_REUSEPORT epoll workers, 0 for a single listener
+	int pin_cpus;  // pin worker i to cpu i
+	int quiet;     // don't log every connection
+	const char *docroot;
+	int copy_body; // read/write file bodies instead of sendfile()
+	int idle_timeout;  // seconds, 0 turns keep-alive off
+	int max_requests;  // per connection
+	size_t cache_size; // bytes of hot files each epoll worker keeps, 0 = off
+	const char *compress_dir;  // compressed copies are kept here, NULL = off
+};
+
+// a parsed request. all pointers point into the receive buffer.
+struct http_request {
+	const char *method;
+	size_t method_len;
+	const char *target;
+	size_t target_len;
+	int version_major;
+	int version_minor;
+	int keep_alive;  // from the version and the Connection header
+	off_t range_first;  // "Range: bytes=first-last", -1 for an open end.
+	off_t range_last;   // both -1 when there's no usable Range header
+	const char *if_range;  // If-Range validator, NULL if none
+	size_t if_range_len;
+	unsigned accept_encoding;  // ENC_ bits from Accept-Encoding
+	off_t content_length;  // -1 without a Content-Length header
+	int chunked;  // sent a Transfer-Encoding, so a body of unknown length
+};
+
+// a file's validators, as sent in ETag and Last-Modified
+struct http_validators {
+	char etag[64];
+	char last_modified[32];
+};
+
+// a file being served: the one asked for and, when it goes out compressed,
+// the copy whose bytes are sent instead
+struct http_file {
+	const char *path;
+	const char *mime;
+	struct stat st;  // of path, for the validators
+	int encoding;    // ENC_IDENTITY, or how the body is coded
+	int fd;          // the body: path itself or the compressed copy
+	off_t size;      // of the body
+};
+
+// a cached file: its mapped body and ready-made header blocks, indexed by
+// keep-alive (0 = "Connection: close", 1 = "Connection: keep-alive").
+// there is one entry per path and accepted set of codings.
+struct cache_entry {
+	struct cache_entry *hnext;        // hash chain
+	struct cache_entry *prev, *next;  // LRU list
+	unsigned hash;
+	unsigned accept;  // the ENC_ bits it was looked up with
+	int refs;  // responses still sending from this entry
+	int dead;  // no longer in the cache, freed with the last ref
+	char *body;
+	size_t size;
+	const char *mime;
+	ino_t ino;  // of the file asked for, even when the body is a copy
+	off_t file_size;
+	struct timespec mtime;
+	time_t checked_at;
+	struct http_validators validators;
+	char head[2][384];
+	size_t head_len[2];
+	char path[];
+};
+
+struct cache_stats {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+	unsigned long invalidations;  // entries dropped because the file changed
+	unsigned long bytes;          // file data held right now
+};
+
+struct file_cache;
+
+// what goes back on the wire: the header block, then body_len bytes from
+// memory (a cache hit) or file_len bytes of file_fd starting at file_off
+struct http_response {
+	int status;
+	int keep_alive;
+	const char *head;  // head_buf, or a cache entry's ready-made block
+	size_t head_len;
+	size_t head_off;   // how much of head has gone out already
+	char head_buf[512];
+	const char *body;  // moves forward as it is sent
+	size_t body_len;
+	struct cache_entry *entry;  // held while body points into it
+	struct file_cache *cache;
+	int file_fd;
+	off_t file_off;
+	size_t file_len;
+};
+
+// one client connection: buffered request bytes and the responses queued
+// for it, answered strictly in order
+struct http_conn {
+	int fd;
+	struct file_cache *cache;  // NULL when caching is off
+	int closing;   // no more requests will be read
+	unsigned requests;  // requests seen on this connection
+	char in[REQ_MAX];
+	size_t in_len;
+	struct http_response res[PIPELINE_MAX];
+	int res_done;  // res[res_done..res_count) are still being sent
+	int res_count;
+};
+
+// per-worker counters. each worker only writes its own, aligned so two
+// workers never share a cache line.
+struct worker_stats {
+	unsigned long accepted;
+	unsigned long served;  // responses sent in full
+	unsigned long stolen;  // -m coro: tasks taken from another worker
+	struct pool_stats conns;    // connection objects
+	struct pool_stats buffers;  // io_uring file body buffers
+} __attribute__((aligned(64)));
+
+// get sockaddr, IPv4 or IPv6:
+void *get_in_addr(struct sockaddr *sa);
+
+// parse the request line and headers. returns the length of the header
+// block, 0 if more data is needed, -1 if malformed (an unreadable or
+// conflicting Content-Length, or one alongside Transfer-Encoding). a body
+// is never read: a request that has one gets an answer and the connection
+// closes, so the body can't be taken for the next request.
+int http_parse_request(const char *buf, size_t len, struct http_request *req);
+
+const char *http_reason(int status);
+
+// ETag and Last-Modified for a file, from its inode, size and mtime. the
+// ETag of a compressed body says how it's coded, as it's different bytes
+void http_validators(const struct stat *st, int encoding,
+	struct http_validators *v);
+
+// the 200 header block for f into buf, returns its length
+int http_file_head(char *buf, size_t size, const struct http_file *f,
+	const struct http_validators *v, int keep_alive);
+
+// worth compressing: text and the like, not images or archives
+int compress_eligible(const char *mime);
+
+// point f at a compressed copy of itself in one of the codings in accept:
+// a foo.zst or foo.gz next to it that is at least as new, else one made
+// once in cfg->compress_dir. returns 0 with f->fd, size and encoding
+// replaced (the original fd closed), or -1 to send it as it is
+int compress_variant(const struct server_config *cfg, unsigned accept,
+	struct http_file *f);
+
+// fill in res for req, from the cache if possible or else by opening the
+// file it asks for. the response keeps the connection open if
+// req->keep_alive is set.
+void http_build_response(const struct server_config *cfg,
+	struct file_cache *cache, const struct http_request *req,
+	struct http_response *res);
+// an error always closes the connection: what follows the request on it
+// may not be where the next one starts
+void http_error_response(int status, struct http_response *res);
+
+// send some of the file body. returns bytes sent or -1 with errno set, like
+// send(2). file_off and file_len move forward by what went out.
+ssize_t http_send_body(int sockfd, struct http_response *res, int copy);
+
+// release the file held by res
+void http_response_done(struct http_response *res);
+
+void http_conn_init(struct http_conn *c, int fd, struct file_cache *cache);
+
+// drive a connection as far as it goes: send queued responses, parse
+// pipelined requests, read more. returns 1 when the connection is finished,
+// 0 when the socket would block (or, for a blocking socket, timed out).
+int http_conn_run(struct http_conn *c, const struct server_config *cfg,
+	struct worker_stats *stats);
+
+// one step of sending what is queued: header blocks and cached bodies of
+// consecutive responses go out in one sendmsg(), and only file bodies need
+// a call of their own. returns bytes sent, or -1 with errno set. responses
+// that went out in full are retired.
+ssize_t http_conn_send(struct http_conn *c, const struct server_config *cfg,
+	struct worker_stats *stats);
+
+// close any files still held by queued responses
+void http_conn_release(struct http_conn *c);
+
+// the pieces of http_conn_run() for loops that do their own I/O.
+// http_conn_parse() turns every complete request in c->in into a queued
+// response and returns how many it queued. http_conn_gather() points iov
+// (room for 2 * PIPELINE_MAX) at the header blocks and in-memory bodies
+// waiting to go out, stopping at the first file body, and returns how many
+// it filled; *file_next says a file body comes next (first, if it returned
+// 0). http_conn_sent() accounts for n bytes sent in that order, the front
+// file body included, and retires the responses that are complete.
+int http_conn_parse(struct http_conn *c, const struct server_config *cfg);
+int http_conn_gather(struct http_conn *c, struct iovec *iov, int *file_next);
+void http_conn_sent(struct http_conn *c, size_t n, struct worker_stats *stats);
+
+// bind and listen on port, returns the socket or -1
+int open_listener(const char *port, int backlog, int reuseport);
+
+// run the epoll event loop on an already listening socket, never returns
+// unless something fatal happens
+int run_epoll_loop(int sockfd, const struct server_config *cfg,
+	struct worker_stats *stats, struct file_cache *cache);
+
+// the same on io_uring: multishot accept, recv into a provided buffer
+// ring, sends linked to the close that follows them. returns -1 at once,
+// having touched nothing, if the kernel can't do that, so the caller can
+// fall back to run_epoll_loop().
+int run_uring_loop(int sockfd, const struct server_config *cfg,
+	struct worker_stats *stats, struct file_cache *cache);
+
+// hot file cache holding at most cap bytes of file data
+struct file_cache *cache_create(size_t cap);
+const struct cache_stats *cache_stats(const struct file_cache *fc);
+
+// look path up for a client accepting the codings in accept, revalidating
+// it if it's due. returns a referenced entry or NULL on a miss.
+struct cache_entry *cache_get(struct file_cache *fc, const char *path,
+	unsigned accept);
+
+// map f's body and add it under accept, evicting least recently used
+// entries to stay under the cap. returns a referenced entry, or NULL if the
+// file can't be cached (too big, empty, mmap failed).
+struct cache_entry *cache_put(struct file_cache *fc, unsigned accept,
+	const struct http_file *f);
+
+// drop a reference taken by cache_get() or cache_put()
+void cache_release(struct file_cache *fc, struct cache_entry *e);
+
+// -m coro. every connection is a task: a struct starting with a struct
+// co_task, run by a handler written as a stackless coroutine (coroutine.h)
+// that suspends wherever its socket would block, e.g.
+//
+//	while ((n = recv(t->fd, ...)) == -1 && errno == EAGAIN)
+//		CO_WAIT(t, EPOLLIN);
+//
+// and returns CO_DONE when it's finished; the scheduler then closes the
+// socket. ready tasks sit on per-worker deques and an idle worker steals
+// from the others, so a task may resume on a different thread each time.
+// nothing that belongs to one thread (a file cache, say) may be held
+// across a CO_WAIT.
+struct co_sched;
+struct co_worker;
+
+struct co_task {
+	int line;        // where the handler left off, for CO_BEGIN
+	int fd;
+	unsigned wait;   // events it's suspended on
+	unsigned revents;  // events that woke it
+	struct co_worker *worker;  // running it right now
+
+	// the scheduler's
+	int armed;       // in the epoll set, if only disarmed
+	struct co_worker *home;     // whose slab it came from
+	struct co_worker *idle_on;  // whose idle list it's on, if any
+	struct co_task *idle_prev, *idle_next;
+	struct co_task *remote_next;  // freed by another worker
+	time_t idle_since;
+};
+
+typedef int (*co_handler)(struct co_task *t);
+
+#define CO_WAIT(t, events) CO_AWAIT(t, co_wait(t, events))
+
+// suspend t until its socket has one of events (EPOLLIN, EPOLLOUT). only
+// for CO_WAIT: the task is armed once the handler has returned. a task
+// waiting on EPOLLIN longer than cfg->idle_timeout is woken with its read
+// side shut down, so its next recv() reads end of file.
+void co_wait(struct co_task *t, unsigned events);
+
+// the worker running t, for its counters, and the server's config
+struct worker_stats *co_stats(struct co_task *t);
+const struct server_config *co_config(struct co_task *t);
+
+// a scheduler for workers threads, accepting on sockfd and running
+// handler on a task_size struct for each connection. NULL on failure.
+struct co_sched *co_sched_create(int sockfd, const struct server_config *cfg,
+	int workers, co_handler handler, size_t task_size);
+
+// run worker id of s on this thread, never returns unless something fatal
+// happens
+int co_worker_run(struct co_sched *s, int id, struct worker_stats *stats);
+
+// the HTTP handler -m coro serves with, on a struct co_http_conn
+struct co_http_conn {
+	struct co_task task;
+	struct http_conn http;
+};
+
+int co_http_handler(struct co_task *t);
+
+// start cfg->workers epoll loops, each on its own SO_REUSEPORT listener,
+// and print their counters on SIGINT/SIGTERM
+int run_workers(const struct server_config *cfg);
+
+#endif
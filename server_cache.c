@@ -0,0 +1,224 @@
+/*
+** server_cache.c -- bounded LRU cache of hot files and their headers
+**
+** An entry holds the mmap'd file body plus the complete, pre-serialized
+** response header block, so a hit is answered with a single sendmsg() and
+** no open/fstat. Entries are revalidated against the file's inode, size and
+** mtime at most once every CACHE_REVALIDATE seconds. Each epoll worker has
+** its own cache, so nothing here is locked.
+**
+** A file can be in here several times over, keyed by the codings the
+** client accepted, with the compressed copy as the body where one was
+** chosen. Those entries are revalidated against the file itself: a .gz
+** next to it is taken to change when it does.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "server.h"
+
+#define CACHE_BUCKETS 1024  // hash buckets, a power of two
+
+#define CACHE_REVALIDATE 1  // seconds between stat() checks of an entry
+
+struct file_cache {
+	size_t cap;     // bytes of file data we may hold
+	size_t max_entry;
+	size_t used;
+	struct cache_entry *buckets[CACHE_BUCKETS];
+	struct cache_entry *lru_head, *lru_tail;  // most recently used first
+	struct cache_stats stats;
+};
+
+static unsigned hash_path(const char *s)
+{
+	unsigned h = 2166136261u;  // FNV-1a
+
+	while (*s)
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	return h;
+}
+
+static time_t monotonic_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec;
+}
+
+static void count(unsigned long *counter)
+{
+	// the owning worker is the only writer, the stats printer only reads
+	__atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+struct file_cache *cache_create(size_t cap)
+{
+	struct file_cache *fc;
+
+	if ((fc = calloc(1, sizeof *fc)) == NULL)
+		return NULL;
+	fc->cap = cap;
+	fc->max_entry = cap / 8 < CACHE_MAX_ENTRY ? cap / 8 : CACHE_MAX_ENTRY;
+	return fc;
+}
+
+const struct cache_stats *cache_stats(const struct file_cache *fc)
+{
+	return &fc->stats;
+}
+
+static void lru_unlink(struct file_cache *fc, struct cache_entry *e)
+{
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		fc->lru_head = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		fc->lru_tail = e->prev;
+	e->prev = e->next = NULL;
+}
+
+static void lru_push_front(struct file_cache *fc, struct cache_entry *e)
+{
+	e->prev = NULL;
+	e->next = fc->lru_head;
+	if (fc->lru_head)
+		fc->lru_head->prev = e;
+	else
+		fc->lru_tail = e;
+	fc->lru_head = e;
+}
+
+static void entry_free(struct cache_entry *e)
+{
+	if (e->body != NULL)
+		munmap(e->body, e->size);
+	free(e);
+}
+
+// take e out of the cache. responses still sending from it keep it alive
+// until their cache_release().
+static void entry_remove(struct file_cache *fc, struct cache_entry *e)
+{
+	struct cache_entry **pp = &fc->buckets[e->hash & (CACHE_BUCKETS - 1)];
+
+	while (*pp != e)
+		pp = &(*pp)->hnext;
+	*pp = e->hnext;
+	lru_unlink(fc, e);
+	fc->used -= e->size;
+	__atomic_store_n(&fc->stats.bytes, fc->used, __ATOMIC_RELAXED);
+	e->dead = 1;
+	if (e->refs == 0)
+		entry_free(e);
+}
+
+struct cache_entry *cache_get(struct file_cache *fc, const char *path,
+	unsigned accept)
+{
+	unsigned h = hash_path(path);
+	struct cache_entry *e;
+	struct stat st;
+	time_t now;
+
+	for (e = fc->buckets[h & (CACHE_BUCKETS - 1)]; e; e = e->hnext)
+		if (e->hash == h && e->accept == accept &&
+				strcmp(e->path, path) == 0)
+			break;
+	if (e == NULL) {
+		count(&fc->stats.misses);
+		return NULL;
+	}
+
+	now = monotonic_now();
+	if (now - e->checked_at >= CACHE_REVALIDATE) {
+		if (stat(path, &st) == -1 || st.st_ino != e->ino ||
+				st.st_size != e->file_size ||
+				st.st_mtim.tv_sec != e->mtime.tv_sec ||
+				st.st_mtim.tv_nsec != e->mtime.tv_nsec) {
+			count(&fc->stats.invalidations);
+			count(&fc->stats.misses);
+			entry_remove(fc, e);
+			return NULL;
+		}
+		e->checked_at = now;
+	}
+
+	count(&fc->stats.hits);
+	if (fc->lru_head != e) {
+		lru_unlink(fc, e);
+		lru_push_front(fc, e);
+	}
+	e->refs++;
+	return e;
+}
+
+struct cache_entry *cache_put(struct file_cache *fc, unsigned accept,
+	const struct http_file *f)
+{
+	struct cache_entry *e;
+	size_t path_len = strlen(f->path);
+	void *body;
+
+	if (f->size == 0 || (size_t)f->size > fc->max_entry)
+		return NULL;
+
+	body = mmap(NULL, f->size, PROT_READ, MAP_PRIVATE | MAP_POPULATE,
+		f->fd, 0);
+	if (body == MAP_FAILED)
+		return NULL;
+
+	if ((e = calloc(1, sizeof *e + path_len + 1)) == NULL) {
+		munmap(body, f->size);
+		return NULL;
+	}
+	memcpy(e->path, f->path, path_len + 1);
+	e->hash = hash_path(f->path);
+	e->accept = accept;
+	e->body = body;
+	e->size = f->size;
+	e->mime = f->mime;
+	e->ino = f->st.st_ino;
+	e->file_size = f->st.st_size;
+	e->mtime = f->st.st_mtim;
+	e->checked_at = monotonic_now();
+	http_validators(&f->st, f->encoding, &e->validators);
+
+	// both Connection: variants, so a hit never formats anything
+	e->head_len[1] = http_file_head(e->head[1], sizeof e->head[1], f,
+		&e->validators, 1);
+	e->head_len[0] = http_file_head(e->head[0], sizeof e->head[0], f,
+		&e->validators, 0);
+
+	while (fc->used + e->size > fc->cap && fc->lru_tail != NULL) {
+		count(&fc->stats.evictions);
+		entry_remove(fc, fc->lru_tail);
+	}
+
+	e->hnext = fc->buckets[e->hash & (CACHE_BUCKETS - 1)];
+	fc->buckets[e->hash & (CACHE_BUCKETS - 1)] = e;
+	lru_push_front(fc, e);
+	fc->used += e->size;
+	__atomic_store_n(&fc->stats.bytes, fc->used, __ATOMIC_RELAXED);
+
+	e->refs++;
+	return e;
+}
+
+void cache_release(struct file_cache *fc, struct cache_entry *e)
+{
+	(void)fc;
+	if (--e->refs == 0 && e->dead)
+		entry_free(e);
+}
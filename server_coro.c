@@ -0,0 +1,471 @@
+/*
+** server_coro.c -- a coroutine per connection, on work-stealing threads
+**
+** Every connection is a task whose handler is written as straight-line
+** code and suspends (CO_WAIT) wherever its socket would block. Suspended
+** tasks wait in one epoll set shared by all the workers, each registered
+** EPOLLONESHOT, so a readiness event wakes exactly one task on exactly one
+** thread, whichever was polling. That thread pushes it on its own deque
+** (ws_deque.h) and runs what it pushed last first. A worker with nothing
+** to run steals the oldest task of another before it goes back to
+** sleep in epoll_wait(), and a worker that picks up a pile of work at once
+** wakes a sleeping one to come and take some. The listener is one more
+** oneshot entry: whoever gets it accepts a batch and puts it back.
+**
+** A task is armed in the epoll set only after its handler has returned,
+** so it can never run on two threads at once. Task memory comes from the
+** accepting worker's slab; a task that finishes elsewhere is handed back
+** on a lock-free list and the owner frees it into the slab itself.
+**
+** The idle timeout can't shut a task's socket down from under the thread
+** running it. Instead each worker keeps the tasks it parked on EPOLLIN in
+** an idle list, in the order they went idle. Once a second it shuts down
+** the read side of those that have waited too long. That wakes them
+** through epoll like any other event, and their next recv() reads end of
+** file.
+*/
+
+#define _GNU_SOURCE  // accept4()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "server.h"
+#include "ws_deque.h"
+
+#define MAXEVENTS 64      // events taken per epoll_wait() call
+#define ACCEPT_BATCH 64   // connections accepted before the listener is rearmed
+#define POLL_EVERY 32     // tasks a busy worker runs between looks at the sockets
+
+struct co_worker {
+	struct ws_deque ready;
+	struct co_sched *s;
+	int id;
+	unsigned rng;  // picks the first victim to steal from
+	struct worker_stats *stats;
+	struct slab tasks;
+	struct co_task *remote_free;  // tasks of ours other workers finished
+	pthread_mutex_t idle_lock;
+	struct co_task *idle_head, *idle_tail;
+	time_t now, swept;
+} __attribute__((aligned(64)));
+
+struct co_sched {
+	int epfd;
+	int sockfd;
+	int wakefd;  // written to wake one sleeping worker
+	int sleepers;  // workers blocked in epoll_wait()
+	const struct server_config *cfg;
+	co_handler handler;
+	size_t task_size;
+	int nworkers;
+	struct co_worker *workers;
+};
+
+static time_t monotonic_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec;
+}
+
+void co_wait(struct co_task *t, unsigned events)
+{
+	t->wait = events;
+}
+
+struct worker_stats *co_stats(struct co_task *t)
+{
+	return t->worker->stats;
+}
+
+const struct server_config *co_config(struct co_task *t)
+{
+	return t->worker->s->cfg;
+}
+
+// take back the tasks other workers finished with
+static void reclaim(struct co_worker *w)
+{
+	struct co_task *t, *next;
+
+	if (__atomic_load_n(&w->remote_free, __ATOMIC_RELAXED) == NULL)
+		return;
+	t = __atomic_exchange_n(&w->remote_free, NULL, __ATOMIC_ACQUIRE);
+	for (; t != NULL; t = next) {
+		next = t->remote_next;
+		slab_free(&w->tasks, t);
+	}
+}
+
+static struct co_task *task_alloc(struct co_worker *w)
+{
+	struct co_task *t;
+
+	reclaim(w);
+	if ((t = slab_alloc(&w->tasks)) == NULL)
+		return NULL;
+	memset(t, 0, sizeof *t);
+	t->home = w;
+	return t;
+}
+
+static void task_free(struct co_worker *w, struct co_task *t)
+{
+	struct co_worker *home = t->home;
+
+	if (home == w) {
+		slab_free(&w->tasks, t);
+		return;
+	}
+	// only the owner touches its slab. a push-only stack that the owner
+	// empties all at once can't suffer ABA
+	t->remote_next = __atomic_load_n(&home->remote_free, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&home->remote_free, &t->remote_next,
+			t, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+}
+
+// the idle list is ordered by when tasks joined it, so only the head
+// ever needs checking. the lock is the owner's against whichever worker
+// resumes one of its tasks
+static void idle_join(struct co_worker *w, struct co_task *t)
+{
+	pthread_mutex_lock(&w->idle_lock);
+	t->idle_since = w->now;
+	t->idle_next = NULL;
+	t->idle_prev = w->idle_tail;
+	if (w->idle_tail)
+		w->idle_tail->idle_next = t;
+	else
+		w->idle_head = t;
+	w->idle_tail = t;
+	__atomic_store_n(&t->idle_on, w, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&w->idle_lock);
+}
+
+// with w->idle_lock held
+static void idle_unlink(struct co_worker *w, struct co_task *t)
+{
+	if (t->idle_prev)
+		t->idle_prev->idle_next = t->idle_next;
+	else
+		w->idle_head = t->idle_next;
+	if (t->idle_next)
+		t->idle_next->idle_prev = t->idle_prev;
+	else
+		w->idle_tail = t->idle_prev;
+	t->idle_prev = t->idle_next = NULL;
+	__atomic_store_n(&t->idle_on, NULL, __ATOMIC_RELEASE);
+}
+
+// t is about to run. its list's owner may be timing it out this very
+// moment, so only the owner's lock says whether it's still on the list
+static void idle_leave(struct co_task *t)
+{
+	struct co_worker *w = __atomic_load_n(&t->idle_on, __ATOMIC_ACQUIRE);
+
+	if (w == NULL)
+		return;
+	pthread_mutex_lock(&w->idle_lock);
+	if (t->idle_on == w)
+		idle_unlink(w, t);
+	pthread_mutex_unlock(&w->idle_lock);
+}
+
+static void expire_idle(struct co_worker *w)
+{
+	struct co_task *t;
+
+	pthread_mutex_lock(&w->idle_lock);
+	while ((t = w->idle_head) != NULL &&
+			w->now - t->idle_since >= w->s->cfg->idle_timeout) {
+		// it's parked, or waiting on this lock to resume, so the socket
+		// is still its own. it wakes reading end of file
+		shutdown(t->fd, SHUT_RD);
+		idle_unlink(w, t);
+	}
+	pthread_mutex_unlock(&w->idle_lock);
+}
+
+static void wake_one(struct co_sched *s)
+{
+	uint64_t one = 1;
+
+	if (__atomic_load_n(&s->sleepers, __ATOMIC_RELAXED) > 0 &&
+			write(s->wakefd, &one, sizeof one) == -1 && errno != EAGAIN)
+		perror("write: eventfd");
+}
+
+static void run_task(struct co_worker *w, struct co_task *t);
+
+static void schedule(struct co_worker *w, struct co_task *t)
+{
+	// a full deque means plenty to do already: this one runs now
+	if (!ws_push(&w->ready, t))
+		run_task(w, t);
+}
+
+// put t in the epoll set for what it waits on. from here on another
+// worker may be running it, so t isn't ours to touch any more
+static void arm(struct co_worker *w, struct co_task *t)
+{
+	struct epoll_event ev;
+	int op = t->armed ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+	int epfd = w->s->epfd, fd = t->fd;
+
+	ev.events = t->wait | EPOLLONESHOT;
+	ev.data.ptr = t;
+	// epoll_ctl() and epoll_wait() already order everything before this
+	// against whoever gets the event; the release (and the acquire in
+	// poll_events()) says so where a race detector can see it
+	__atomic_store_n(&t->armed, 1, __ATOMIC_RELEASE);
+	if (epoll_ctl(epfd, op, fd, &ev) == 0)
+		return;
+	// it would wait forever. cut the socket off so the handler's next
+	// send or recv fails and it finishes
+	perror("epoll_ctl");
+	shutdown(fd, SHUT_RDWR);
+	schedule(w, t);
+}
+
+static void run_task(struct co_worker *w, struct co_task *t)
+{
+	idle_leave(t);
+	t->worker = w;
+	if (w->s->handler(t) == CO_DONE) {
+		close(t->fd); // also drops it from the epoll set
+		task_free(w, t);
+		return;
+	}
+	if ((t->wait & EPOLLIN) && w->s->cfg->idle_timeout > 0)
+		idle_join(w, t);
+	arm(w, t);
+}
+
+static struct co_task *steal(struct co_worker *w)
+{
+	struct co_sched *s = w->s;
+	struct co_worker *victim;
+	struct co_task *t;
+	int start, i;
+
+	w->rng = w->rng * 1103515245 + 12345;
+	start = (w->rng >> 16) % s->nworkers;
+	for (i = 0; i < s->nworkers; i++) {
+		victim = &s->workers[(start + i) % s->nworkers];
+		if (victim == w || (t = ws_steal(&victim->ready)) == NULL)
+			continue;
+		__atomic_fetch_add(&w->stats->stolen, 1, __ATOMIC_RELAXED);
+		// still more there than one thief can take on
+		if (ws_depth(&victim->ready) > 1)
+			wake_one(s);
+		return t;
+	}
+	return NULL;
+}
+
+// accept a batch onto this worker's deque, then let the listener go to
+// whichever worker polls first
+static void accept_batch(struct co_worker *w)
+{
+	struct co_sched *s = w->s;
+	struct sockaddr_storage their_addr;
+	socklen_t sin_size;
+	struct epoll_event ev;
+	struct co_task *t;
+	char str[INET6_ADDRSTRLEN];
+	int new_fd, i;
+
+	for (i = 0; i < ACCEPT_BATCH; i++) {
+		sin_size = sizeof their_addr;
+		new_fd = accept4(s->sockfd, (struct sockaddr *)&their_addr,
+			&sin_size, SOCK_NONBLOCK);
+		if (new_fd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("accept");
+			break;
+		}
+		__atomic_fetch_add(&w->stats->accepted, 1, __ATOMIC_RELAXED);
+
+		if (!s->cfg->quiet) {
+			inet_ntop(their_addr.ss_family,
+				get_in_addr((struct sockaddr *)&their_addr),
+				str, sizeof str);
+			printf("server: got connection from %s\n", str);
+		}
+
+		if ((t = task_alloc(w)) == NULL) {
+			perror("malloc");
+			close(new_fd);
+			continue;
+		}
+		// the request has usually arrived by the time we accept, so the
+		// handler starts at once rather than waiting on EPOLLIN first
+		t->fd = new_fd;
+		schedule(w, t);
+	}
+
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.ptr = NULL; // NULL marks the listening socket
+	if (epoll_ctl(s->epfd, EPOLL_CTL_MOD, s->sockfd, &ev) == -1)
+		perror("epoll_ctl: listener");
+}
+
+// queue whatever is ready. timeout as for epoll_wait(); a worker that
+// blocks counts as a sleeper that wake_one() can rouse
+static int poll_events(struct co_worker *w, int timeout)
+{
+	struct co_sched *s = w->s;
+	struct epoll_event events[MAXEVENTS];
+	struct co_task *t;
+	uint64_t count;
+	int n, i;
+
+	if (timeout != 0)
+		__atomic_fetch_add(&s->sleepers, 1, __ATOMIC_RELAXED);
+	n = epoll_wait(s->epfd, events, MAXEVENTS, timeout);
+	if (timeout != 0)
+		__atomic_fetch_sub(&s->sleepers, 1, __ATOMIC_RELAXED);
+	if (n == -1) {
+		if (errno == EINTR)
+			return 0;
+		perror("epoll_wait");
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (events[i].data.ptr == NULL) {
+			accept_batch(w);
+		} else if (events[i].data.ptr == &s->wakefd) {
+			if (read(s->wakefd, &count, sizeof count) == -1 &&
+					errno != EAGAIN)
+				perror("read: eventfd");
+		} else {
+			t = events[i].data.ptr;
+			(void)__atomic_load_n(&t->armed, __ATOMIC_ACQUIRE);
+			t->revents = events[i].events;
+			schedule(w, t);
+		}
+	}
+
+	// more ready here than this worker can start on: get help
+	if (ws_depth(&w->ready) > 1)
+		wake_one(s);
+	return 0;
+}
+
+struct co_sched *co_sched_create(int sockfd, const struct server_config *cfg,
+	int workers, co_handler handler, size_t task_size)
+{
+	struct co_sched *s;
+	struct epoll_event ev;
+	int flags, i;
+
+	// each worker's deque ends on cache lines of their own
+	if ((s = calloc(1, sizeof *s)) == NULL || (s->workers = aligned_alloc(
+			64, workers * sizeof *s->workers)) == NULL) {
+		perror("malloc");
+		return NULL;
+	}
+	memset(s->workers, 0, workers * sizeof *s->workers);
+	s->sockfd = sockfd;
+	s->cfg = cfg;
+	s->handler = handler;
+	s->task_size = task_size;
+	s->nworkers = workers;
+
+	if ((flags = fcntl(sockfd, F_GETFL, 0)) == -1 ||
+			fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) == -1) {
+		perror("fcntl");
+		return NULL;
+	}
+	if ((s->epfd = epoll_create1(0)) == -1) {
+		perror("epoll_create1");
+		return NULL;
+	}
+	if ((s->wakefd = eventfd(0, EFD_NONBLOCK)) == -1) {
+		perror("eventfd");
+		return NULL;
+	}
+
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, sockfd, &ev) == -1) {
+		perror("epoll_ctl");
+		return NULL;
+	}
+	// edge-triggered, so each write wakes one sleeper rather than all
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = &s->wakefd;
+	if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->wakefd, &ev) == -1) {
+		perror("epoll_ctl");
+		return NULL;
+	}
+
+	for (i = 0; i < workers; i++) {
+		s->workers[i].s = s;
+		s->workers[i].id = i;
+		s->workers[i].rng = i * 2654435761u + 1;
+		pthread_mutex_init(&s->workers[i].idle_lock, NULL);
+		if (ws_init(&s->workers[i].ready, CO_QUEUE) == -1) {
+			perror("malloc");
+			return NULL;
+		}
+	}
+	return s;
+}
+
+int co_worker_run(struct co_sched *s, int id, struct worker_stats *stats)
+{
+	struct co_worker *w = &s->workers[id];
+	const struct server_config *cfg = s->cfg;
+	struct co_task *t;
+	unsigned ran = 0;
+
+	w->stats = stats;
+	slab_init(&w->tasks, s->task_size, CONN_SLAB, &stats->conns);
+	w->now = w->swept = monotonic_now();
+
+	while (1) {
+		w->now = monotonic_now();
+		if (cfg->idle_timeout > 0 && w->now != w->swept) {
+			expire_idle(w);
+			w->swept = w->now;
+		}
+
+		if ((t = ws_pop(&w->ready)) == NULL && (t = steal(w)) == NULL) {
+			// nothing anywhere: sleep until a socket is ready, waking
+			// once a second to time out idle connections
+			reclaim(w);
+			if (poll_events(w, cfg->idle_timeout > 0 ? 1000 : -1) == -1)
+				break;
+			continue;
+		}
+		run_task(w, t);
+
+		// a busy worker still looks at the sockets now and then, so
+		// none of them waits on its deque running dry
+		if (++ran % POLL_EVERY == 0 && poll_events(w, 0) == -1)
+			break;
+	}
+
+	slab_destroy(&w->tasks);
+	return 1;
+}
@@ -0,0 +1,229 @@
+/*
+** server_epoll.c -- single process, edge-triggered epoll server loop
+**
+** Every connection is a small state machine driven by readiness events
+** instead of a forked child. All sockets are non-blocking, so each handler
+** runs until it would block (EAGAIN) and then waits for the next edge.
+*/
+
+#define _GNU_SOURCE  // accept4()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "server.h"
+
+#define MAXEVENTS 256  // events handled per epoll_wait() call
+
+struct conn {
+	struct http_conn http;
+	time_t last_active;
+	struct conn *prev, *next;  // idle list, least recently active first
+};
+
+struct loop {
+	int epfd;
+	int sockfd;
+	const struct server_config *cfg;
+	struct worker_stats *stats;
+	struct file_cache *cache;
+	time_t now;
+	struct conn *idle_head, *idle_tail;
+	struct slab conns;  // where every struct conn comes from
+};
+
+static int set_nonblocking(int fd)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+
+	if (flags == -1)
+		return -1;
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static time_t monotonic_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec;
+}
+
+static void idle_unlink(struct loop *l, struct conn *c)
+{
+	if (c->prev)
+		c->prev->next = c->next;
+	else if (l->idle_head == c)
+		l->idle_head = c->next;
+	if (c->next)
+		c->next->prev = c->prev;
+	else if (l->idle_tail == c)
+		l->idle_tail = c->prev;
+	c->prev = c->next = NULL;
+}
+
+// mark c as just active by moving it to the tail of the idle list
+static void idle_touch(struct loop *l, struct conn *c)
+{
+	c->last_active = l->now;
+	if (l->idle_tail == c)
+		return;
+	idle_unlink(l, c);
+	c->prev = l->idle_tail;
+	if (l->idle_tail)
+		l->idle_tail->next = c;
+	else
+		l->idle_head = c;
+	l->idle_tail = c;
+}
+
+static void conn_close(struct loop *l, struct conn *c)
+{
+	idle_unlink(l, c);
+	http_conn_release(&c->http);
+	close(c->http.fd); // also drops it from the epoll set
+	slab_free(&l->conns, c);
+}
+
+// the list is ordered by activity, so only the head ever needs checking
+static void expire_idle(struct loop *l)
+{
+	while (l->idle_head != NULL &&
+			l->now - l->idle_head->last_active >= l->cfg->idle_timeout)
+		conn_close(l, l->idle_head);
+}
+
+// edge-triggered: keep accepting until the queue is drained
+static void accept_all(struct loop *l)
+{
+	struct sockaddr_storage their_addr;
+	socklen_t sin_size;
+	struct epoll_event ev;
+	struct conn *c;
+	char s[INET6_ADDRSTRLEN];
+	int new_fd;
+
+	while (1) {
+		sin_size = sizeof their_addr;
+		new_fd = accept4(l->sockfd, (struct sockaddr *)&their_addr,
+			&sin_size, SOCK_NONBLOCK);
+		if (new_fd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("accept");
+			return;
+		}
+		__atomic_fetch_add(&l->stats->accepted, 1, __ATOMIC_RELAXED);
+
+		if (!l->cfg->quiet) {
+			inet_ntop(their_addr.ss_family,
+				get_in_addr((struct sockaddr *)&their_addr),
+				s, sizeof s);
+			printf("server: got connection from %s\n", s);
+		}
+
+		if ((c = slab_alloc(&l->conns)) == NULL) {
+			perror("malloc");
+			close(new_fd);
+			continue;
+		}
+		http_conn_init(&c->http, new_fd, l->cache);
+		c->prev = c->next = NULL;
+		idle_touch(l, c);
+
+		// the request has usually arrived by the time we accept, so try
+		// to answer it straight away and only register if we must wait
+		if (http_conn_run(&c->http, l->cfg, l->stats)) {
+			conn_close(l, c);
+			continue;
+		}
+
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		ev.data.ptr = c;
+		if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, new_fd, &ev) == -1) {
+			perror("epoll_ctl");
+			conn_close(l, c);
+		}
+	}
+}
+
+int run_epoll_loop(int sockfd, const struct server_config *cfg,
+	struct worker_stats *stats, struct file_cache *cache)
+{
+	struct epoll_event ev, events[MAXEVENTS];
+	struct conn *c;
+	struct loop l;
+	int n, i;
+
+	if (set_nonblocking(sockfd) == -1) {
+		perror("fcntl");
+		return 1;
+	}
+
+	memset(&l, 0, sizeof l);
+	l.sockfd = sockfd;
+	l.cfg = cfg;
+	l.stats = stats;
+	l.cache = cache;
+	l.now = monotonic_now();
+	slab_init(&l.conns, sizeof(struct conn), CONN_SLAB, &stats->conns);
+
+	if ((l.epfd = epoll_create1(0)) == -1) {
+		perror("epoll_create1");
+		return 1;
+	}
+
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = NULL; // NULL marks the listening socket
+	if (epoll_ctl(l.epfd, EPOLL_CTL_ADD, sockfd, &ev) == -1) {
+		perror("epoll_ctl");
+		close(l.epfd);
+		return 1;
+	}
+
+	while(1) {  // main event loop
+		// wake up once a second to time out idle connections
+		n = epoll_wait(l.epfd, events, MAXEVENTS,
+			cfg->idle_timeout > 0 ? 1000 : -1);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			break;
+		}
+		l.now = monotonic_now();
+
+		for (i = 0; i < n; i++) {
+			c = events[i].data.ptr;
+			if (c == NULL) {
+				accept_all(&l);
+				continue;
+			}
+
+			if ((events[i].events & (EPOLLERR | EPOLLHUP)) ||
+					http_conn_run(&c->http, cfg, stats)) {
+				conn_close(&l, c);
+				continue;
+			}
+			idle_touch(&l, c);
+		}
+
+		if (cfg->idle_timeout > 0)
+			expire_idle(&l);
+	}
+
+	close(l.epfd);
+	slab_destroy(&l.conns);
+	return 1;
+}
@@ -0,0 +1,1004 @@
+/*
+** server_http.c -- HTTP/1.1 request parsing and static file responses
+**
+** Shared by every server mode. A response is a block of header bytes plus an
+** optional byte range of an open file, and the file part goes out with
+** sendfile(2) so the body never passes through user space. A client that
+** accepts gzip or zstd gets a compressed copy of a text file instead, when
+** there is one (server_compress.c); the copy goes out by sendfile too.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
+
+#include "server.h"
+#include "http_scan.h"
+
+#define COPY_CHUNK 65536  // read/write path buffer size
+
+struct mime_type {
+	const char *ext;
+	const char *type;
+};
+
+static const struct mime_type mime_types[] = {
+	{ "html", "text/html" },
+	{ "htm",  "text/html" },
+	{ "txt",  "text/plain" },
+	{ "css",  "text/css" },
+	{ "js",   "application/javascript" },
+	{ "json", "application/json" },
+	{ "pdf",  "application/pdf" },
+	{ "png",  "image/png" },
+	{ "jpg",  "image/jpeg" },
+	{ "jpeg", "image/jpeg" },
+	{ "gif",  "image/gif" },
+	{ "svg",  "image/svg+xml" },
+	{ "xml",  "application/xml" },
+	{ NULL,   NULL }
+};
+
+static const char *mime_type(const char *path)
+{
+	const char *dot = strrchr(path, '.');
+	const struct mime_type *m;
+
+	if (dot != NULL && strchr(dot, '/') == NULL) {
+		for (m = mime_types; m->ext != NULL; m++)
+			if (strcasecmp(dot + 1, m->ext) == 0)
+				return m->type;
+	}
+	return "application/octet-stream";
+}
+
+const char *http_reason(int status)
+{
+	switch (status) {
+	case 200: return "OK";
+	case 206: return "Partial Content";
+	case 400: return "Bad Request";
+	case 403: return "Forbidden";
+	case 404: return "Not Found";
+	case 405: return "Method Not Allowed";
+	case 416: return "Range Not Satisfiable";
+	case 431: return "Request Header Fields Too Large";
+	case 500: return "Internal Server Error";
+	case 505: return "HTTP Version Not Supported";
+	}
+	return "Unknown";
+}
+
+// is token in the comma separated header value? (case-insensitive)
+static int has_token(const char *value, size_t len, const char *token)
+{
+	size_t tlen = strlen(token);
+	const char *p = value, *end = value + len, *tok_end;
+
+	while (p < end) {
+		while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+			p++;
+		tok_end = p;
+		while (tok_end < end && *tok_end != ',')
+			tok_end++;
+		len = tok_end - p;
+		while (len > 0 && (p[len - 1] == ' ' || p[len - 1] == '\t'))
+			len--;
+		if (len == tlen && strncasecmp(p, token, tlen) == 0)
+			return 1;
+		p = tok_end;
+	}
+	return 0;
+}
+
+// a q value of zero, "0" to "0.000": the coding is refused
+static int q_is_zero(const char *p, const char *end)
+{
+	if (p == end || *p++ != '0')
+		return 0;
+	for (; p < end && (*p == '.' || *p == '0'); p++)
+		;
+	return p == end || *p == ' ' || *p == '\t' || *p == ';' || *p == ',';
+}
+
+// "gzip, deflate, br;q=0.9, zstd". returns the ENC_ bits for the codings
+// we have that come without q=0, "*" standing for any not named.
+static unsigned parse_accept_encoding(const char *value, size_t len)
+{
+	const char *p = value, *end = value + len, *name, *q;
+	unsigned yes = 0, named = 0, star = 0, bit;
+	size_t name_len;
+	int refused;
+
+	while (p < end) {
+		while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+			p++;
+		name = p;
+		while (p < end && *p != ',' && *p != ';' && *p != ' ' &&
+				*p != '\t')
+			p++;
+		name_len = p - name;
+		refused = 0;
+		// parameters, of which only q matters
+		while (p < end && *p != ',') {
+			if (*p == ';') {
+				for (q = p + 1; q < end && (*q == ' ' || *q == '\t');
+						q++)
+					;
+				if (end - q >= 2 && (*q == 'q' || *q == 'Q') &&
+						q[1] == '=')
+					refused = q_is_zero(q + 2, end);
+			}
+			p++;
+		}
+		if (name_len == 4 && strncasecmp(name, "gzip", 4) == 0)
+			bit = ENC_GZIP;
+		else if (name_len == 6 && strncasecmp(name, "x-gzip", 6) == 0)
+			bit = ENC_GZIP;
+		else if (name_len == 4 && strncasecmp(name, "zstd", 4) == 0)
+			bit = ENC_ZSTD;
+		else
+			bit = 0;
+		if (name_len == 1 && *name == '*')
+			star = !refused;
+		named |= bit;
+		if (!refused)
+			yes |= bit;
+	}
+	if (star)
+		yes |= (ENC_GZIP | ENC_ZSTD) & ~named;
+	return yes;
+}
+
+// "GET /path HTTP/1.1"
+static int parse_request_line(const char *line, size_t len,
+	struct http_request *req)
+{
+	const char *sp1, *sp2, *end = line + len;
+
+	if ((sp1 = memchr(line, ' ', len)) == NULL)
+		return -1;
+	if ((sp2 = memchr(sp1 + 1, ' ', end - sp1 - 1)) == NULL)
+		return -1;
+
+	req->method = line;
+	req->method_len = sp1 - line;
+	req->target = sp1 + 1;
+	req->target_len = sp2 - sp1 - 1;
+
+	if (req->method_len == 0 || req->target_len == 0)
+		return -1;
+	if (end - sp2 - 1 != 8 || memcmp(sp2 + 1, "HTTP/", 5) != 0 ||
+			sp2[7] != '.')
+		return -1;
+	req->version_major = sp2[6] - '0';
+	req->version_minor = sp2[8] - '0';
+	return 0;
+}
+
+// digits of an unsigned decimal, -1 if there are none or it overflows
+static off_t parse_offset(const char **p, const char *end)
+{
+	off_t n = 0;
+
+	if (*p == end || **p < '0' || **p > '9')
+		return -1;
+	for (; *p < end && **p >= '0' && **p <= '9'; (*p)++) {
+		if (n > (LLONG_MAX - 9) / 10)
+			return -1;
+		n = n * 10 + **p - '0';
+	}
+	return n;
+}
+
+// "bytes=first-last", "bytes=first-" or "bytes=-suffix". anything else,
+// multiple ranges included, is ignored and the whole file is sent, which
+// is always an allowed answer to a Range request.
+static void parse_range(const char *value, size_t len,
+	struct http_request *req)
+{
+	const char *p = value + 6, *end = value + len;
+	off_t first = -1, last = -1;
+
+	while (end > value && (end[-1] == ' ' || end[-1] == '\t'))
+		end--;
+	if (len < 7 || strncasecmp(value, "bytes=", 6) != 0)
+		return;
+	if (*p != '-' && (first = parse_offset(&p, end)) == -1)
+		return;
+	if (p == end || *p++ != '-')
+		return;
+	if (p < end && (last = parse_offset(&p, end)) == -1)
+		return;
+	if (p != end || (first == -1 && last == -1) ||
+			(first != -1 && last != -1 && last < first))
+		return;
+	req->range_first = first;
+	req->range_last = last;
+}
+
+// a decimal length. repeats have to agree: two different lengths would let
+// whatever sits in front of us frame the body differently than we do.
+static int parse_content_length(const char *value, size_t len,
+	struct http_request *req)
+{
+	const char *p = value, *end = value + len;
+	off_t n;
+
+	while (end > value && (end[-1] == ' ' || end[-1] == '\t'))
+		end--;
+	if ((n = parse_offset(&p, end)) == -1 || p != end)
+		return -1;
+	if (req->content_length != -1 && req->content_length != n)
+		return -1;
+	req->content_length = n;
+	return 0;
+}
+
+// only the headers we act on are looked at, the rest just have to be well
+// formed. colon is where the line scan found the first ':'.
+static int parse_header(const char *line, size_t len, long colon,
+	struct http_request *req, int *conn_close, int *conn_keep_alive)
+{
+	const char *value;
+	size_t name_len, value_len;
+
+	if (colon <= 0 || colon >= (long)len)
+		return -1;
+	name_len = colon;
+	value = line + colon + 1;
+	value_len = len - name_len - 1;
+	while (value_len > 0 && (*value == ' ' || *value == '\t')) {
+		value++;
+		value_len--;
+	}
+
+	if (name_len == 10 && strncasecmp(line, "Connection", 10) == 0) {
+		*conn_close |= has_token(value, value_len, "close");
+		*conn_keep_alive |= has_token(value, value_len, "keep-alive");
+	} else if (name_len == 5 && strncasecmp(line, "Range", 5) == 0) {
+		parse_range(value, value_len, req);
+	} else if (name_len == 8 && strncasecmp(line, "If-Range", 8) == 0) {
+		while (value_len > 0 && (value[value_len - 1] == ' ' ||
+				value[value_len - 1] == '\t'))
+			value_len--;
+		req->if_range = value;
+		req->if_range_len = value_len;
+	} else if (name_len == 15 &&
+			strncasecmp(line, "Accept-Encoding", 15) == 0) {
+		req->accept_encoding = parse_accept_encoding(value, value_len);
+	} else if (name_len == 14 &&
+			strncasecmp(line, "Content-Length", 14) == 0) {
+		return parse_content_length(value, value_len, req);
+	} else if (name_len == 17 &&
+			strncasecmp(line, "Transfer-Encoding", 17) == 0) {
+		req->chunked = 1;
+	}
+	return 0;
+}
+
+int http_parse_request(const char *buf, size_t len, struct http_request *req)
+{
+	struct http_lines lines;
+	const char *line;
+	size_t start, line_len;
+	long colon;
+	int first = 1, conn_close = 0, conn_keep_alive = 0;
+
+	memset(req, 0, sizeof *req);
+	req->range_first = req->range_last = -1;
+	req->content_length = -1;
+
+	// one pass over the buffer finds every line end and colon. the line
+	// terminator is CRLF, but bare LF is accepted too (our own http_client
+	// sends a mix of both).
+	http_lines_init(&lines, buf, len);
+	while (http_lines_next(&lines, &start, &line_len, &colon)) {
+		line = buf + start;
+		if (line_len > 0 && line[line_len - 1] == '\r')
+			line_len--;
+
+		if (first) {
+			if (parse_request_line(line, line_len, req) == -1)
+				return -1;
+			first = 0;
+		} else if (line_len == 0) {
+			if (req->chunked && req->content_length != -1)
+				return -1;
+			// HTTP/1.1 is persistent unless told otherwise, 1.0
+			// only on request. a body isn't read, so a request
+			// with one is the last on its connection.
+			if (req->version_minor >= 1)
+				req->keep_alive = !conn_close;
+			else
+				req->keep_alive = conn_keep_alive && !conn_close;
+			if (req->chunked || req->content_length > 0)
+				req->keep_alive = 0;
+			return lines.line_start;
+		} else if (parse_header(line, line_len, colon, req, &conn_close,
+				&conn_keep_alive) == -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int hexval(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+// turn the request target into a path under docroot. rejects anything that
+// could climb out of it. returns an HTTP status, 200 on success.
+static int resolve_path(const char *docroot, const char *target,
+	size_t target_len, char *path, size_t size)
+{
+	size_t n, i;
+	int hi, lo;
+	char c;
+
+	if (target[0] != '/')
+		return 400;
+
+	n = snprintf(path, size, "%s", docroot);
+	for (i = 0; i < target_len && n < size - 1; i++) {
+		c = target[i];
+		if (c == '?' || c == '#')
+			break;
+		if (c == '%') {
+			if (i + 2 >= target_len ||
+					(hi = hexval(target[i + 1])) < 0 ||
+					(lo = hexval(target[i + 2])) < 0)
+				return 400;
+			c = hi << 4 | lo;
+			i += 2;
+		}
+		if (c == '\0')
+			return 400;
+		path[n++] = c;
+	}
+	if (n >= size - 1)
+		return 404;
+	path[n] = '\0';
+
+	// no ".." path segments, decoded or not
+	for (i = strlen(docroot); path[i] != '\0'; i++) {
+		if (path[i] == '/' && path[i + 1] == '.' && path[i + 2] == '.' &&
+				(path[i + 3] == '/' || path[i + 3] == '\0'))
+			return 403;
+	}
+	return 200;
+}
+
+static void response_init(struct http_response *res, int status,
+	int keep_alive)
+{
+	res->status = status;
+	res->keep_alive = keep_alive;
+	res->head = res->head_buf;
+	res->head_len = 0;
+	res->head_off = 0;
+	res->body = NULL;
+	res->body_len = 0;
+	res->entry = NULL;
+	res->cache = NULL;
+	res->file_fd = -1;
+	res->file_off = 0;
+	res->file_len = 0;
+}
+
+void http_error_response(int status, struct http_response *res)
+{
+	const char *reason = http_reason(status);
+	int body_len = strlen(reason) + 5;  // "404 Not Found\n"
+
+	response_init(res, status, 0);
+	res->head_len = snprintf(res->head_buf, sizeof res->head_buf,
+		"HTTP/1.1 %d %s\r\n"
+		"Server: " SERVER_NAME "\r\n"
+		"Content-Type: text/plain\r\n"
+		"Content-Length: %d\r\n"
+		"%s"
+		"Connection: close\r\n"
+		"\r\n"
+		"%d %s\n",
+		status, reason, body_len,
+		status == 405 ? "Allow: GET, HEAD\r\n" : "",
+		status, reason);
+}
+
+static const char *encoding_name(int encoding)
+{
+	switch (encoding) {
+	case ENC_GZIP: return "gzip";
+	case ENC_ZSTD: return "zstd";
+	}
+	return NULL;
+}
+
+void http_validators(const struct stat *st, int encoding,
+	struct http_validators *v)
+{
+	struct tm tm;
+
+	snprintf(v->etag, sizeof v->etag, "\"%llx-%llx-%llx.%lx%s%s\"",
+		(unsigned long long)st->st_ino, (unsigned long long)st->st_size,
+		(unsigned long long)st->st_mtim.tv_sec, st->st_mtim.tv_nsec,
+		encoding != ENC_IDENTITY ? "-" : "",
+		encoding != ENC_IDENTITY ? encoding_name(encoding) : "");
+	gmtime_r(&st->st_mtim.tv_sec, &tm);
+	strftime(v->last_modified, sizeof v->last_modified,
+		"%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+// a compressible file's responses depend on Accept-Encoding, and caches
+// on the way have to know that whichever coding this one went out in
+static const char *vary(const char *mime)
+{
+	return compress_eligible(mime) ? "Vary: Accept-Encoding\r\n" : "";
+}
+
+int http_file_head(char *buf, size_t size, const struct http_file *f,
+	const struct http_validators *v, int keep_alive)
+{
+	const char *coding = encoding_name(f->encoding);
+
+	return snprintf(buf, size,
+		"HTTP/1.1 200 OK\r\n"
+		"Server: " SERVER_NAME "\r\n"
+		"Content-Type: %s\r\n"
+		"Content-Length: %lld\r\n"
+		"%s%s%s"
+		"%s"
+		"Accept-Ranges: bytes\r\n"
+		"ETag: %s\r\n"
+		"Last-Modified: %s\r\n"
+		"Connection: %s\r\n"
+		"\r\n",
+		f->mime, (long long)f->size,
+		coding != NULL ? "Content-Encoding: " : "",
+		coding != NULL ? coding : "", coding != NULL ? "\r\n" : "",
+		vary(f->mime), v->etag, v->last_modified,
+		keep_alive ? "keep-alive" : "close");
+}
+
+static int same_value(const char *a, size_t len, const char *b)
+{
+	return strlen(b) == len && memcmp(a, b, len) == 0;
+}
+
+// apply req's Range to a file of size bytes. returns 200 to send all of
+// it, 206 with *off and *len set to the part to send, or 416.
+static int resolve_range(const struct http_request *req, off_t size,
+	const struct http_validators *v, off_t *off, off_t *len)
+{
+	off_t first = req->range_first, last = req->range_last;
+
+	if (first == -1 && last == -1)
+		return 200;
+	// a range of something that has changed since is no use to anyone
+	if (req->if_range != NULL &&
+			!same_value(req->if_range, req->if_range_len, v->etag) &&
+			!same_value(req->if_range, req->if_range_len,
+				v->last_modified))
+		return 200;
+	if (first == -1) {
+		// the last `last` bytes
+		if (last == 0 || size == 0)
+			return 416;
+		first = last < size ? size - last : 0;
+		last = size - 1;
+	} else if (first >= size) {
+		return 416;
+	} else if (last == -1 || last >= size) {
+		last = size - 1;
+	}
+	*off = first;
+	*len = last - first + 1;
+	return 206;
+}
+
+// 206 header block for bytes [off, off + len) of a size byte file
+static void range_head(struct http_response *res, const char *mime,
+	const struct http_validators *v, off_t off, off_t len, off_t size)
+{
+	res->head_len = snprintf(res->head_buf, sizeof res->head_buf,
+		"HTTP/1.1 206 Partial Content\r\n"
+		"Server: " SERVER_NAME "\r\n"
+		"Content-Type: %s\r\n"
+		"Content-Length: %lld\r\n"
+		"Content-Range: bytes %lld-%lld/%lld\r\n"
+		"%s"
+		"Accept-Ranges: bytes\r\n"
+		"ETag: %s\r\n"
+		"Last-Modified: %s\r\n"
+		"Connection: %s\r\n"
+		"\r\n",
+		mime, (long long)len, (long long)off,
+		(long long)(off + len - 1), (long long)size, vary(mime), v->etag,
+		v->last_modified, res->keep_alive ? "keep-alive" : "close");
+}
+
+// 416 says how big the file really is, so the client can ask again. it
+// closes the connection like any other error.
+static void range_error(off_t size, struct http_response *res)
+{
+	const char *reason = http_reason(416);
+	int body_len = strlen(reason) + 5;
+
+	response_init(res, 416, 0);
+	res->head_len = snprintf(res->head_buf, sizeof res->head_buf,
+		"HTTP/1.1 416 %s\r\n"
+		"Server: " SERVER_NAME "\r\n"
+		"Content-Type: text/plain\r\n"
+		"Content-Length: %d\r\n"
+		"Content-Range: bytes */%lld\r\n"
+		"Connection: close\r\n"
+		"\r\n"
+		"416 %s\n",
+		reason, body_len, (long long)size, reason);
+}
+
+// answer from a cache entry: its header block and mapped body, nothing to
+// format or open. a range is formatted fresh, its body is still the mapping.
+static void cached_response(struct file_cache *cache, struct cache_entry *e,
+	const struct http_request *req, int head_only,
+	struct http_response *res)
+{
+	int keep_alive = req->keep_alive;
+	off_t off, len;
+
+	switch (resolve_range(req, e->size, &e->validators, &off, &len)) {
+	case 416:
+		range_error(e->size, res);
+		cache_release(cache, e);
+		return;
+	case 206:
+		response_init(res, 206, keep_alive);
+		range_head(res, e->mime, &e->validators, off, len, e->size);
+		res->entry = e;
+		res->cache = cache;
+		if (!head_only) {
+			res->body = e->body + off;
+			res->body_len = len;
+		}
+		return;
+	}
+
+	response_init(res, 200, keep_alive);
+	res->head = e->head[keep_alive ? 1 : 0];
+	res->head_len = e->head_len[keep_alive ? 1 : 0];
+	res->entry = e;
+	res->cache = cache;
+	if (!head_only) {
+		res->body = e->body;
+		res->body_len = e->size;
+	}
+}
+
+// the codings req may get path in. none for a range, which is always of
+// the file as it is
+static unsigned accepted_codings(const struct http_request *req,
+	const char *path)
+{
+	if (req->range_first != -1 || req->range_last != -1 ||
+			!compress_eligible(mime_type(path)))
+		return 0;
+	return req->accept_encoding;
+}
+
+void http_build_response(const struct server_config *cfg,
+	struct file_cache *cache, const struct http_request *req,
+	struct http_response *res)
+{
+	struct cache_entry *e;
+	char path[PATH_MAX];
+	struct http_file f;
+	int status, fd, head_only;
+	int keep_alive = req->keep_alive;
+	unsigned accept;
+	struct http_validators v;
+	off_t off = 0, len;
+
+	if (req->version_major != 1) {
+		http_error_response(505, res);
+		return;
+	}
+
+	if (req->method_len == 3 && memcmp(req->method, "GET", 3) == 0)
+		head_only = 0;
+	else if (req->method_len == 4 && memcmp(req->method, "HEAD", 4) == 0)
+		head_only = 1;
+	else {
+		http_error_response(405, res);
+		return;
+	}
+
+	status = resolve_path(cfg->docroot, req->target, req->target_len,
+		path, sizeof path - sizeof "/index.html");
+	if (status != 200) {
+		http_error_response(status, res);
+		return;
+	}
+
+	if (cache != NULL && (e = cache_get(cache, path,
+			accepted_codings(req, path))) != NULL) {
+		cached_response(cache, e, req, head_only, res);
+		return;
+	}
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+		http_error_response(errno == EACCES ? 403 : 404, res);
+		return;
+	}
+	if (fstat(fd, &f.st) == -1) {
+		close(fd);
+		http_error_response(500, res);
+		return;
+	}
+	if (S_ISDIR(f.st.st_mode)) {
+		close(fd);
+		strcat(path, path[strlen(path) - 1] == '/' ?
+			"index.html" : "/index.html");
+		if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1 ||
+				fstat(fd, &f.st) == -1) {
+			if (fd != -1)
+				close(fd);
+			http_error_response(404, res);
+			return;
+		}
+	}
+	if (!S_ISREG(f.st.st_mode)) {
+		close(fd);
+		http_error_response(403, res);
+		return;
+	}
+
+	f.path = path;
+	f.mime = mime_type(path);
+	f.encoding = ENC_IDENTITY;
+	f.fd = fd;
+	f.size = f.st.st_size;
+	accept = accepted_codings(req, path);
+	if (accept != 0)
+		compress_variant(cfg, accept, &f);
+
+	if (cache != NULL && (e = cache_put(cache, accept, &f)) != NULL) {
+		close(f.fd);
+		cached_response(cache, e, req, head_only, res);
+		return;
+	}
+
+	len = f.size;
+	http_validators(&f.st, f.encoding, &v);
+	status = resolve_range(req, f.size, &v, &off, &len);
+	if (status == 416) {
+		close(f.fd);
+		range_error(f.size, res);
+		return;
+	}
+
+	response_init(res, status, keep_alive);
+	if (status == 206)
+		range_head(res, f.mime, &v, off, len, f.size);
+	else
+		res->head_len = http_file_head(res->head_buf,
+			sizeof res->head_buf, &f, &v, keep_alive);
+
+	if (head_only || len == 0) {
+		close(f.fd);
+		return;
+	}
+	res->file_fd = f.fd;
+	res->file_off = off;
+	res->file_len = len;
+}
+
+ssize_t http_send_body(int sockfd, struct http_response *res, int copy)
+{
+	char buf[COPY_CHUNK];
+	ssize_t n, sent;
+
+	if (!copy) {
+		n = sendfile(sockfd, res->file_fd, &res->file_off,
+			res->file_len);
+		if (n == 0) {
+			errno = EIO; // file shrank under us
+			return -1;
+		}
+		if (n > 0)
+			res->file_len -= n;
+		return n;
+	}
+
+	// read/write path, kept around to compare against sendfile
+	n = pread(res->file_fd, buf, res->file_len < sizeof buf ?
+		res->file_len : sizeof buf, res->file_off);
+	if (n <= 0)
+		return n == 0 ? (errno = EIO, -1) : -1;
+	if ((sent = send(sockfd, buf, n, MSG_NOSIGNAL)) > 0) {
+		// anything the socket didn't take is read again next time
+		res->file_off += sent;
+		res->file_len -= sent;
+	}
+	return sent;
+}
+
+void http_response_done(struct http_response *res)
+{
+	if (res->file_fd != -1)
+		close(res->file_fd);
+	res->file_fd = -1;
+	if (res->entry != NULL)
+		cache_release(res->cache, res->entry);
+	res->entry = NULL;
+	res->body = NULL;
+	res->body_len = 0;
+}
+
+void http_conn_init(struct http_conn *c, int fd, struct file_cache *cache)
+{
+	c->fd = fd;
+	c->cache = cache;
+	c->closing = 0;
+	c->requests = 0;
+	c->in_len = 0;
+	c->res_done = 0;
+	c->res_count = 0;
+}
+
+int http_conn_parse(struct http_conn *c, const struct server_config *cfg)
+{
+	struct http_request req;
+	size_t used = 0;
+	int rv, queued = 0;
+	struct http_response *res;
+
+	while (!c->closing && c->res_count < PIPELINE_MAX) {
+		res = &c->res[c->res_count];
+		rv = http_parse_request(c->in + used, c->in_len - used, &req);
+		if (rv == 0) {
+			if (c->in_len - used < sizeof c->in)
+				break; // keep reading
+			http_error_response(431, res);
+		} else if (rv < 0) {
+			http_error_response(400, res);
+		} else {
+			used += rv;
+			if (cfg->idle_timeout == 0 ||
+					++c->requests >= (unsigned)cfg->max_requests)
+				req.keep_alive = 0;
+			http_build_response(cfg, c->cache, &req, res);
+		}
+		c->res_count++;
+		queued++;
+		if (!res->keep_alive)
+			c->closing = 1;
+	}
+
+	if (used > 0) {
+		c->in_len -= used;
+		memmove(c->in, c->in + used, c->in_len);
+	}
+	return queued;
+}
+
+// retire responses at the front of the queue that have gone out in full
+static void conn_retire(struct http_conn *c, struct worker_stats *stats)
+{
+	struct http_response *res;
+
+	while (c->res_done < c->res_count) {
+		res = &c->res[c->res_done];
+		if (res->head_off < res->head_len || res->body_len > 0 ||
+				res->file_len > 0)
+			break;
+		__atomic_fetch_add(&stats->served, 1, __ATOMIC_RELAXED);
+		http_response_done(res);
+		c->res_done++;
+	}
+	if (c->res_done == c->res_count)
+		c->res_done = c->res_count = 0;
+}
+
+// mark n bytes sent: head, in-memory body, then file body of each response
+// in turn
+static void conn_advance_sent(struct http_conn *c, size_t n)
+{
+	struct http_response *res;
+	size_t part;
+	int i;
+
+	for (i = c->res_done; n > 0; i++) {
+		res = &c->res[i];
+		part = res->head_len - res->head_off;
+		part = n < part ? n : part;
+		res->head_off += part;
+		n -= part;
+
+		part = n < res->body_len ? n : res->body_len;
+		res->body += part;
+		res->body_len -= part;
+		n -= part;
+
+		part = n < res->file_len ? n : res->file_len;
+		res->file_off += part;
+		res->file_len -= part;
+		n -= part;
+	}
+}
+
+void http_conn_sent(struct http_conn *c, size_t n, struct worker_stats *stats)
+{
+	conn_advance_sent(c, n);
+	conn_retire(c, stats);
+}
+
+int http_conn_gather(struct http_conn *c, struct iovec *iov, int *file_next)
+{
+	struct http_response *res;
+	int i, n = 0;
+
+	*file_next = 0;
+	for (i = c->res_done; i < c->res_count; i++) {
+		res = &c->res[i];
+		if (res->head_off < res->head_len) {
+			iov[n].iov_base = (char *)res->head + res->head_off;
+			iov[n].iov_len = res->head_len - res->head_off;
+			n++;
+		}
+		if (res->body_len > 0) {
+			iov[n].iov_base = (char *)res->body;
+			iov[n].iov_len = res->body_len;
+			n++;
+		}
+		if (res->file_len > 0) {
+			*file_next = 1;
+			break;
+		}
+	}
+	return n;
+}
+
+ssize_t http_conn_send(struct http_conn *c, const struct server_config *cfg,
+	struct worker_stats *stats)
+{
+	struct iovec iov[2 * PIPELINE_MAX];
+	struct msghdr msg;
+	int file_next;
+	ssize_t n;
+
+	memset(&msg, 0, sizeof msg);
+	msg.msg_iov = iov;
+	msg.msg_iovlen = http_conn_gather(c, iov, &file_next);
+
+	if (msg.msg_iovlen > 0) {
+		// MSG_MORE lets the last header share a segment with the file
+		// body that follows it
+		n = sendmsg(c->fd, &msg,
+			MSG_NOSIGNAL | (file_next ? MSG_MORE : 0));
+		if (n > 0)
+			conn_advance_sent(c, n);
+	} else {
+		n = http_send_body(c->fd, &c->res[c->res_done], cfg->copy_body);
+	}
+	if (n != -1)
+		conn_retire(c, stats);
+	return n;
+}
+
+// send queued responses. returns 1 once the queue is empty, 0 if the
+// socket would block, -1 on error.
+static int conn_flush(struct http_conn *c, const struct server_config *cfg,
+	struct worker_stats *stats)
+{
+	while (c->res_done < c->res_count) {
+		if (http_conn_send(c, cfg, stats) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			if (errno != EPIPE && errno != ECONNRESET)
+				perror("send");
+			return -1;
+		}
+	}
+	return 1;
+}
+
+int http_conn_run(struct http_conn *c, const struct server_config *cfg,
+	struct worker_stats *stats)
+{
+	ssize_t n;
+	int rv;
+
+	while (1) {
+		// answer what we have, in order, before reading any further
+		if ((rv = conn_flush(c, cfg, stats)) != 1)
+			return rv == -1;
+		if (http_conn_parse(c, cfg) > 0)
+			continue;
+		if (c->closing)
+			return 1;
+
+		n = recv(c->fd, c->in + c->in_len, sizeof c->in - c->in_len, 0);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0; // wait for more
+			return 1;
+		}
+		if (n == 0)
+			return 1; // peer is done, and so are we
+		c->in_len += n;
+	}
+}
+
+// http_conn_run() as a -m coro handler: the same loop written straight
+// through, waiting where that one returns 0. it runs without a file cache,
+// which belongs to one thread while the task may move between them.
+int co_http_handler(struct co_task *t)
+{
+	struct http_conn *c = &((struct co_http_conn *)t)->http;
+	const struct server_config *cfg = co_config(t);
+	ssize_t n;
+
+	CO_BEGIN(t);
+	http_conn_init(c, t->fd, NULL);
+	while (1) {
+		// answer what we have, in order, before reading any further
+		while (c->res_done < c->res_count) {
+			if (http_conn_send(c, cfg, co_stats(t)) != -1 ||
+					errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				if (errno != EPIPE && errno != ECONNRESET)
+					perror("send");
+				goto done;
+			}
+			CO_WAIT(t, EPOLLOUT);
+		}
+		if (http_conn_parse(c, cfg) > 0)
+			continue;
+		if (c->closing)
+			break;
+
+		n = recv(t->fd, c->in + c->in_len, sizeof c->in - c->in_len, 0);
+		if (n > 0)
+			c->in_len += n;
+		else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			CO_WAIT(t, EPOLLIN);
+		else if (n == 0 || errno != EINTR)
+			break; // peer is done, or timed out, and so are we
+	}
+done:
+	http_conn_release(c);
+	CO_END(t);
+}
+
+void http_conn_release(struct http_conn *c)
+{
+	int i;
+
+	for (i = c->res_done; i < c->res_count; i++)
+		http_response_done(&c->res[i]);
+	c->res_done = c->res_count = 0;
+}
@@ -0,0 +1,705 @@
+/*
+** server_uring.c -- single process, io_uring completion server loop
+**
+** The same connections as server_epoll.c, but instead of waiting for
+** readiness and then making the calls, the loop hands the kernel the
+** operations themselves and gets their results back, many per
+** io_uring_enter():
+**
+** - one multishot accept keeps producing connections without being asked
+**   again
+** - recvs pick a buffer from a ring of provided buffers when data arrives,
+**   so an idle connection pins no memory
+** - responses go out as a sendmsg of the header blocks and in-memory
+**   bodies, or as a file read linked to the send of what it read, and the
+**   send that finishes a connection is linked to its close
+**
+** Request parsing and response building are server_http.c's, shared with
+** the other modes; only who does the I/O differs. Everything is done with
+** the raw system calls, no liburing.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/io_uring.h>
+
+#include "server.h"
+
+#define URING_ENTRIES 1024  // submission queue slots, twice that for completions
+#define RECV_BUFS 512       // provided receive buffers, a power of two
+#define RECV_BUF_SIZE 4096
+#define RECV_GROUP 0        // the provided buffer group's id
+#define FILE_CHUNK (64 * 1024)  // file body bytes per read + send pair
+#define CHUNK_SLAB 16           // file body buffers per slab page
+
+// what a completion is for, in the low bits of its user_data; the rest
+// is the connection, if any
+enum {
+	OP_ACCEPT,
+	OP_RECV,
+	OP_READ,
+	OP_SEND,
+	OP_CLOSE,
+	OP_TICK
+};
+#define OP_MASK 7
+
+struct conn {
+	struct http_conn http;
+	time_t last_active;
+	struct conn *prev, *next;  // idle list, least recently active first
+	struct conn *starved;      // waiting for a free receive buffer
+	int inflight;   // operations the kernel still holds, freed at 0
+	int receiving;
+	int sending;
+	// linked closes issued and completed. a close cancelled by a short
+	// send can complete after the retry has chained another, so one is
+	// pending as long as the two differ
+	unsigned close_issued, close_completed;
+	int fd_closed;
+	int done;       // finished with, waiting for inflight to drain
+	// a receive buffer not yet fully copied into http.in
+	int held;
+	unsigned held_bid;
+	size_t held_off, held_len;
+	struct msghdr msg;
+	struct iovec iov[2 * PIPELINE_MAX];
+	size_t send_len;
+	char *chunk;    // FILE_CHUNK bytes for file bodies, taken on first use
+};
+
+struct ring {
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	unsigned entries;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned queued;  // sqes not yet passed to io_uring_enter()
+	void *sq_map, *cq_map;
+	size_t sq_map_len, cq_map_len, sqes_len;
+	struct io_uring_buf_ring *bufs;
+	char *buf_mem;
+	unsigned short buf_tail;
+};
+
+struct loop {
+	struct ring ring;
+	int sockfd;
+	int accept_single;  // no multishot accept here, one at a time
+	const struct server_config *cfg;
+	struct worker_stats *stats;
+	struct file_cache *cache;
+	time_t now;
+	struct conn *idle_head, *idle_tail;
+	struct conn *starved_head, *starved_tail;
+	struct __kernel_timespec tick;
+	struct slab conns;   // struct conn
+	struct slab chunks;  // FILE_CHUNK buffers
+};
+
+static int sys_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned submit, unsigned wait, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned op, void *arg, unsigned n)
+{
+	return syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+static time_t monotonic_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec;
+}
+
+static void ring_free(struct ring *r)
+{
+	if (r->bufs != NULL)
+		munmap(r->bufs, RECV_BUFS * sizeof(struct io_uring_buf));
+	free(r->buf_mem);
+	if (r->sqes != NULL)
+		munmap(r->sqes, r->sqes_len);
+	if (r->cq_map != NULL && r->cq_map != r->sq_map)
+		munmap(r->cq_map, r->cq_map_len);
+	if (r->sq_map != NULL)
+		munmap(r->sq_map, r->sq_map_len);
+	if (r->fd != -1)
+		close(r->fd);
+}
+
+static void buf_recycle(struct ring *r, unsigned bid)
+{
+	struct io_uring_buf *b = &r->bufs->bufs[r->buf_tail & (RECV_BUFS - 1)];
+
+	b->addr = (unsigned long)(r->buf_mem + (size_t)bid * RECV_BUF_SIZE);
+	b->len = RECV_BUF_SIZE;
+	b->bid = bid;
+	// the entry is filled in before the kernel can see it
+	__atomic_store_n(&r->bufs->tail, ++r->buf_tail, __ATOMIC_RELEASE);
+}
+
+// set up the rings and the provided buffers. returns -1 with errno set,
+// having released everything, if the kernel can't.
+static int ring_init(struct ring *r)
+{
+	struct io_uring_params p;
+	struct io_uring_buf_reg reg;
+	unsigned *array, i;
+	int err;
+
+	memset(r, 0, sizeof *r);
+	memset(&p, 0, sizeof p);
+	// only this thread submits, and it reaps completions as it does
+	p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+	if ((r->fd = sys_setup(URING_ENTRIES, &p)) == -1 && errno == EINVAL) {
+		memset(&p, 0, sizeof p);  // an older kernel, do without
+		r->fd = sys_setup(URING_ENTRIES, &p);
+	}
+	if (r->fd == -1)
+		return -1;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+			!(p.features & IORING_FEAT_NODROP)) {
+		close(r->fd);
+		errno = ENOSYS;
+		return -1;
+	}
+
+	r->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_map_len = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	if (r->cq_map_len > r->sq_map_len)
+		r->sq_map_len = r->cq_map_len;
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sq_map = mmap(NULL, r->sq_map_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sq_map == MAP_FAILED || r->sqes == MAP_FAILED) {
+		err = errno;
+		r->sq_map = r->sq_map == MAP_FAILED ? NULL : r->sq_map;
+		r->sqes = r->sqes == MAP_FAILED ? NULL : r->sqes;
+		ring_free(r);
+		errno = err;
+		return -1;
+	}
+	r->cq_map = r->sq_map;  // one mapping holds both rings
+
+	r->sq_head = (unsigned *)((char *)r->sq_map + p.sq_off.head);
+	r->sq_tail = (unsigned *)((char *)r->sq_map + p.sq_off.tail);
+	r->sq_mask = (unsigned *)((char *)r->sq_map + p.sq_off.ring_mask);
+	r->cq_head = (unsigned *)((char *)r->cq_map + p.cq_off.head);
+	r->cq_tail = (unsigned *)((char *)r->cq_map + p.cq_off.tail);
+	r->cq_mask = (unsigned *)((char *)r->cq_map + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)((char *)r->cq_map + p.cq_off.cqes);
+	r->entries = p.sq_entries;
+	// sqe i always sits in slot i, so the index array never changes
+	array = (unsigned *)((char *)r->sq_map + p.sq_off.array);
+	for (i = 0; i < p.sq_entries; i++)
+		array[i] = i;
+
+	r->bufs = mmap(NULL, RECV_BUFS * sizeof(struct io_uring_buf),
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (r->bufs == MAP_FAILED) {
+		err = errno;
+		r->bufs = NULL;
+		ring_free(r);
+		errno = err;
+		return -1;
+	}
+	if ((r->buf_mem = malloc((size_t)RECV_BUFS * RECV_BUF_SIZE)) == NULL) {
+		ring_free(r);
+		errno = ENOMEM;
+		return -1;
+	}
+	memset(&reg, 0, sizeof reg);
+	reg.ring_addr = (unsigned long)r->bufs;
+	reg.ring_entries = RECV_BUFS;
+	reg.bgid = RECV_GROUP;
+	if (sys_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+		err = errno;
+		ring_free(r);
+		errno = err;
+		return -1;
+	}
+	for (i = 0; i < RECV_BUFS; i++)
+		buf_recycle(r, i);
+	return 0;
+}
+
+static int ring_submit(struct ring *r, unsigned wait)
+{
+	int n;
+
+	do {
+		n = sys_enter(r->fd, r->queued, wait,
+			wait ? IORING_ENTER_GETEVENTS : 0);
+	} while (n == -1 && errno == EINTR && wait == 0);
+	if (n > 0)
+		r->queued -= (unsigned)n < r->queued ? (unsigned)n : r->queued;
+	return n;
+}
+
+// the next free sqe, zeroed, submitting what's queued if the ring is full
+static struct io_uring_sqe *get_sqe(struct ring *r, void *ptr, int op)
+{
+	struct io_uring_sqe *sqe;
+	unsigned tail = *r->sq_tail;
+
+	while (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >=
+			r->entries) {
+		if (ring_submit(r, 0) == -1 && errno != EAGAIN &&
+				errno != EBUSY) {
+			perror("io_uring_enter");
+			exit(1);
+		}
+	}
+	sqe = &r->sqes[tail & *r->sq_mask];
+	memset(sqe, 0, sizeof *sqe);
+	sqe->user_data = (unsigned long)ptr | op;
+	// the sqe is written before the kernel can see it
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	r->queued++;
+	return sqe;
+}
+
+static void idle_unlink(struct loop *l, struct conn *c)
+{
+	if (c->prev)
+		c->prev->next = c->next;
+	else if (l->idle_head == c)
+		l->idle_head = c->next;
+	if (c->next)
+		c->next->prev = c->prev;
+	else if (l->idle_tail == c)
+		l->idle_tail = c->prev;
+	c->prev = c->next = NULL;
+}
+
+// mark c as just active by moving it to the tail of the idle list
+static void idle_touch(struct loop *l, struct conn *c)
+{
+	c->last_active = l->now;
+	if (l->idle_tail == c)
+		return;
+	idle_unlink(l, c);
+	c->prev = l->idle_tail;
+	if (l->idle_tail)
+		l->idle_tail->next = c;
+	else
+		l->idle_head = c;
+	l->idle_tail = c;
+}
+
+static void starved_remove(struct loop *l, struct conn *c)
+{
+	struct conn **p, *prev = NULL;
+
+	for (p = &l->starved_head; *p != NULL; prev = *p, p = &(*p)->starved) {
+		if (*p == c) {
+			*p = c->starved;
+			if (l->starved_tail == c)
+				l->starved_tail = prev;
+			c->starved = NULL;
+			return;
+		}
+	}
+}
+
+static int close_pending(const struct conn *c)
+{
+	return c->close_issued != c->close_completed;
+}
+
+static void arm_accept(struct loop *l)
+{
+	struct io_uring_sqe *sqe = get_sqe(&l->ring, NULL, OP_ACCEPT);
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = l->sockfd;
+	if (!l->accept_single)
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+static void arm_tick(struct loop *l)
+{
+	struct io_uring_sqe *sqe = get_sqe(&l->ring, NULL, OP_TICK);
+
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->addr = (unsigned long)&l->tick;
+	sqe->len = 1;
+}
+
+static void arm_recv(struct loop *l, struct conn *c)
+{
+	struct io_uring_sqe *sqe = get_sqe(&l->ring, c, OP_RECV);
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = c->http.fd;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = RECV_GROUP;
+	c->receiving = 1;
+	c->inflight++;
+}
+
+// give a receive buffer back, and to the first connection waiting for one.
+// every buffer that comes back has to do this, or a starved connection
+// waits for some other one to make progress.
+static void buf_return(struct loop *l, unsigned bid)
+{
+	struct conn *s = l->starved_head;
+
+	buf_recycle(&l->ring, bid);
+	if (s != NULL) {
+		starved_remove(l, s);
+		arm_recv(l, s);
+	}
+}
+
+// no more I/O on c. whatever the kernel still holds for it completes
+// (a shutdown cuts a waiting recv short) before it is freed.
+static void conn_finish(struct loop *l, struct conn *c)
+{
+	if (c->done)
+		return;
+	c->done = 1;
+	idle_unlink(l, c);
+	if (c->fd_closed || close_pending(c))
+		return;
+	if (c->inflight > 0)
+		shutdown(c->http.fd, SHUT_RDWR);
+	close(c->http.fd);
+	c->fd_closed = 1;
+}
+
+// free c once it's finished and the kernel is done with it. queued
+// responses are only released here, since a send may still point into a
+// cached body.
+static void conn_put(struct loop *l, struct conn *c)
+{
+	if (!c->done || c->inflight > 0)
+		return;
+	starved_remove(l, c);
+	if (c->held)
+		buf_return(l, c->held_bid);
+	http_conn_release(&c->http);
+	if (c->chunk != NULL)
+		slab_free(&l->chunks, c->chunk);
+	slab_free(&l->conns, c);
+}
+
+// queue the next stretch of responses: header blocks and cached bodies in
+// one sendmsg, or a file chunk read linked to its send. if that empties
+// the queue of a connection that's closing, the close goes in the same
+// chain.
+static void start_send(struct loop *l, struct conn *c)
+{
+	struct http_response *res;
+	struct io_uring_sqe *sqe;
+	int i, n, file_next, last;
+	size_t len;
+
+	n = http_conn_gather(&c->http, c->iov, &file_next);
+	if (n > 0) {
+		memset(&c->msg, 0, sizeof c->msg);
+		c->msg.msg_iov = c->iov;
+		c->msg.msg_iovlen = n;
+		for (c->send_len = 0, i = 0; i < n; i++)
+			c->send_len += c->iov[i].iov_len;
+		last = !file_next;
+
+		sqe = get_sqe(&l->ring, c, OP_SEND);
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = c->http.fd;
+		sqe->addr = (unsigned long)&c->msg;
+		// MSG_MORE lets the last header share a segment with the file
+		// body that follows it
+		sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL |
+			(file_next ? MSG_MORE : 0);
+	} else {
+		res = &c->http.res[c->http.res_done];
+		if (c->chunk == NULL &&
+				(c->chunk = slab_alloc(&l->chunks)) == NULL) {
+			perror("malloc");
+			conn_finish(l, c);
+			return;
+		}
+		len = res->file_len < FILE_CHUNK ? res->file_len : FILE_CHUNK;
+		c->send_len = len;
+		last = len == res->file_len &&
+			c->http.res_done + 1 == c->http.res_count;
+
+		sqe = get_sqe(&l->ring, c, OP_READ);
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = res->file_fd;
+		sqe->addr = (unsigned long)c->chunk;
+		sqe->len = len;
+		sqe->off = res->file_off;
+		// a short read cancels the send
+		sqe->flags = IOSQE_IO_LINK;
+		c->inflight++;
+
+		sqe = get_sqe(&l->ring, c, OP_SEND);
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = c->http.fd;
+		sqe->addr = (unsigned long)c->chunk;
+		sqe->len = len;
+		sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL |
+			(last ? 0 : MSG_MORE);
+	}
+	c->sending = 1;
+	c->inflight++;
+
+	if (last && c->http.closing) {
+		// a short send cancels the close, and then it's ours to do
+		sqe->flags |= IOSQE_IO_LINK;
+		sqe = get_sqe(&l->ring, c, OP_CLOSE);
+		sqe->opcode = IORING_OP_CLOSE;
+		sqe->fd = c->http.fd;
+		c->close_issued++;
+		c->inflight++;
+	}
+}
+
+// move c along as far as it goes without waiting: queued responses go out
+// first, in order, then buffered requests are parsed, then it reads more
+static void conn_progress(struct loop *l, struct conn *c)
+{
+	struct ring *r = &l->ring;
+	size_t room, n;
+
+	while (!c->done && !c->sending) {
+		if (c->http.res_done < c->http.res_count) {
+			start_send(l, c);
+			return;
+		}
+		if (c->held) {
+			room = sizeof c->http.in - c->http.in_len;
+			n = c->held_len < room ? c->held_len : room;
+			memcpy(c->http.in + c->http.in_len, r->buf_mem +
+				(size_t)c->held_bid * RECV_BUF_SIZE + c->held_off, n);
+			c->http.in_len += n;
+			c->held_off += n;
+			if ((c->held_len -= n) == 0) {
+				c->held = 0;
+				buf_return(l, c->held_bid);
+			}
+		}
+		if (http_conn_parse(&c->http, l->cfg) > 0)
+			continue;
+		if (c->http.closing) {
+			conn_finish(l, c);
+			return;
+		}
+		if (!c->held && !c->receiving)
+			arm_recv(l, c);
+		return;
+	}
+}
+
+static void on_accept(struct loop *l, int res, unsigned flags)
+{
+	struct sockaddr_storage their_addr;
+	socklen_t sin_size = sizeof their_addr;
+	char s[INET6_ADDRSTRLEN];
+	struct conn *c;
+
+	if (!(flags & IORING_CQE_F_MORE)) {
+		// multishot needs 5.19; before that each accept is one-off
+		if (res == -EINVAL && !l->accept_single)
+			l->accept_single = 1;
+		arm_accept(l);
+	}
+	if (res < 0) {
+		if (res != -EINVAL && res != -ECONNABORTED && res != -EINTR) {
+			errno = -res;
+			perror("accept");
+		}
+		return;
+	}
+	__atomic_fetch_add(&l->stats->accepted, 1, __ATOMIC_RELAXED);
+
+	if (!l->cfg->quiet && getpeername(res, (struct sockaddr *)&their_addr,
+			&sin_size) == 0) {
+		inet_ntop(their_addr.ss_family,
+			get_in_addr((struct sockaddr *)&their_addr), s, sizeof s);
+		printf("server: got connection from %s\n", s);
+	}
+
+	if ((c = slab_alloc(&l->conns)) == NULL) {
+		perror("malloc");
+		close(res);
+		return;
+	}
+	memset(c, 0, sizeof *c);
+	http_conn_init(&c->http, res, l->cache);
+	idle_touch(l, c);
+	arm_recv(l, c);
+}
+
+static void on_recv(struct loop *l, struct conn *c, int res, unsigned flags)
+{
+	c->receiving = 0;
+	if (res == -ENOBUFS && !c->done) {
+		// every buffer is taken: wait in line for one to come back
+		if (l->starved_tail)
+			l->starved_tail->starved = c;
+		else
+			l->starved_head = c;
+		l->starved_tail = c;
+		return;
+	}
+	if (res > 0) {
+		c->held = 1;
+		c->held_bid = flags >> IORING_CQE_BUFFER_SHIFT;
+		c->held_off = 0;
+		c->held_len = res;
+	}
+	if (c->done)
+		return;
+	if (res <= 0) {
+		conn_finish(l, c); // peer is done, and so are we
+		return;
+	}
+	idle_touch(l, c);
+	conn_progress(l, c);
+}
+
+static void on_send(struct loop *l, struct conn *c, int res)
+{
+	c->sending = 0;
+	if (c->done)
+		return;
+	if (res < 0) {
+		if (res != -EPIPE && res != -ECONNRESET && res != -ECANCELED) {
+			errno = -res;
+			perror("send");
+		}
+		conn_finish(l, c);
+		return;
+	}
+	http_conn_sent(&c->http, res, l->stats);
+	idle_touch(l, c);
+	conn_progress(l, c);
+}
+
+// linked closes complete in the order they were chained, so this one is
+// the newest once the counts meet
+static void on_close(struct conn *c, int res)
+{
+	c->close_completed++;
+	if (res == 0) {
+		c->fd_closed = 1;
+	} else if (c->done && !close_pending(c) && !c->fd_closed) {
+		// the send before it fell short, so the close never ran
+		close(c->http.fd);
+		c->fd_closed = 1;
+	}
+}
+
+// the list is ordered by activity, so only the head ever needs checking
+static void expire_idle(struct loop *l)
+{
+	struct conn *c;
+
+	while ((c = l->idle_head) != NULL &&
+			l->now - c->last_active >= l->cfg->idle_timeout) {
+		conn_finish(l, c);
+		conn_put(l, c);
+	}
+}
+
+static void dispatch(struct loop *l, const struct io_uring_cqe *cqe)
+{
+	struct conn *c = (struct conn *)(unsigned long)(cqe->user_data & ~OP_MASK);
+
+	switch (cqe->user_data & OP_MASK) {
+	case OP_ACCEPT:
+		on_accept(l, cqe->res, cqe->flags);
+		return;
+	case OP_TICK:
+		if (l->cfg->idle_timeout > 0)
+			expire_idle(l);
+		arm_tick(l);
+		return;
+	case OP_RECV:
+		on_recv(l, c, cqe->res, cqe->flags);
+		break;
+	case OP_READ:
+		// a short read already cancelled its send, which says so
+		break;
+	case OP_SEND:
+		on_send(l, c, cqe->res);
+		break;
+	case OP_CLOSE:
+		on_close(c, cqe->res);
+		break;
+	}
+	c->inflight--;
+	conn_put(l, c);
+}
+
+int run_uring_loop(int sockfd, const struct server_config *cfg,
+	struct worker_stats *stats, struct file_cache *cache)
+{
+	struct loop l;
+	struct ring *r = &l.ring;
+	unsigned head, tail;
+
+	memset(&l, 0, sizeof l);
+	if (ring_init(r) == -1)
+		return -1;
+	l.sockfd = sockfd;
+	l.cfg = cfg;
+	l.stats = stats;
+	l.cache = cache;
+	l.now = monotonic_now();
+	// wake up once a second to time out idle connections
+	l.tick.tv_sec = 1;
+	slab_init(&l.conns, sizeof(struct conn), CONN_SLAB, &stats->conns);
+	slab_init(&l.chunks, FILE_CHUNK, CHUNK_SLAB, &stats->buffers);
+
+	arm_accept(&l);
+	arm_tick(&l);
+
+	while(1) {  // main event loop
+		if (ring_submit(r, 1) == -1 && errno != EINTR &&
+				errno != EAGAIN && errno != EBUSY) {
+			perror("io_uring_enter");
+			break;
+		}
+		l.now = monotonic_now();
+
+		head = *r->cq_head;
+		tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++)
+			dispatch(&l, &r->cqes[head & *r->cq_mask]);
+		// the entries are read before the kernel may reuse them
+		__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	ring_free(r);
+	slab_destroy(&l.chunks);
+	slab_destroy(&l.conns);
+	return 1;
+}
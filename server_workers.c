@@ -0,0 +1,184 @@
+/*
+** server_workers.c -- N epoll workers sharing PORT through SO_REUSEPORT
+**
+** Each worker thread owns its own listening socket, so the kernel hashes
+** incoming connections across them and there is no shared accept queue or
+** lock. Worker i can optionally be pinned to cpu i. With -m uring each
+** worker runs an io_uring loop instead, or epoll if the kernel has none.
+** With -m coro there is one listener and one scheduler, and the workers
+** share its connections between them (server_coro.c).
+*/
+
+#define _GNU_SOURCE  // pthread_setaffinity_np()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "server.h"
+
+struct worker {
+	pthread_t thread;
+	int id;
+	int sockfd;
+	const struct server_config *cfg;
+	struct worker_stats stats;
+	struct file_cache *cache;
+	struct co_sched *sched;  // -m coro
+};
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+
+	if (w->cfg->mode == MODE_CORO) {
+		co_worker_run(w->sched, w->id, &w->stats);
+		fprintf(stderr, "server: worker %d exited\n", w->id);
+		return NULL;
+	}
+	if (w->cfg->mode == MODE_URING && run_uring_loop(w->sockfd, w->cfg,
+			&w->stats, w->cache) == -1)
+		fprintf(stderr, "server: worker %d: io_uring unavailable (%s), "
+			"using epoll\n", w->id, strerror(errno));
+	run_epoll_loop(w->sockfd, w->cfg, &w->stats, w->cache);
+	fprintf(stderr, "server: worker %d exited\n", w->id);
+	return NULL;
+}
+
+static void pin_worker(struct worker *w)
+{
+	cpu_set_t set;
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	int cpu = w->id % (ncpu > 0 ? ncpu : 1);
+	int rv;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if ((rv = pthread_setaffinity_np(w->thread, sizeof set, &set)) != 0)
+		fprintf(stderr, "server: pinning worker %d: %s\n", w->id,
+			strerror(rv));
+}
+
+static unsigned long load(const unsigned long *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void print_stats(const struct worker *workers, int n)
+{
+	unsigned long accepted, served, stolen;
+	unsigned long total_acc = 0, total_srv = 0, total_stl = 0;
+	const struct cache_stats *cs;
+	int coro = workers[0].cfg->mode == MODE_CORO;
+	int i;
+
+	printf("worker   accepted     served%s\n", coro ? "     stolen" : "");
+	for (i = 0; i < n; i++) {
+		accepted = load(&workers[i].stats.accepted);
+		served = load(&workers[i].stats.served);
+		stolen = load(&workers[i].stats.stolen);
+		printf("%6d %10lu %10lu", i, accepted, served);
+		if (coro)
+			printf(" %10lu", stolen);
+		printf("\n");
+		total_acc += accepted;
+		total_srv += served;
+		total_stl += stolen;
+	}
+	printf(" total %10lu %10lu", total_acc, total_srv);
+	if (coro)
+		printf(" %10lu", total_stl);
+	printf("\n");
+
+	printf("worker  conns  in use  mallocs  buffers  in use  mallocs\n");
+	for (i = 0; i < n; i++) {
+		const struct worker_stats *st = &workers[i].stats;
+
+		printf("%6d %6lu %7lu %8lu %8lu %7lu %8lu\n", i,
+			load(&st->conns.allocs), load(&st->conns.in_use),
+			load(&st->conns.sys_allocs), load(&st->buffers.allocs),
+			load(&st->buffers.in_use), load(&st->buffers.sys_allocs));
+	}
+
+	if (workers[0].cache == NULL)
+		return;
+	printf("worker       hits     misses  evictions   invalid   bytes\n");
+	for (i = 0; i < n; i++) {
+		cs = cache_stats(workers[i].cache);
+		printf("%6d %10lu %10lu %10lu %9lu %7lu\n", i,
+			load(&cs->hits), load(&cs->misses),
+			load(&cs->evictions), load(&cs->invalidations),
+			load(&cs->bytes));
+	}
+}
+
+int run_workers(const struct server_config *cfg)
+{
+	struct worker *workers;
+	struct co_sched *sched = NULL;
+	sigset_t set;
+	int i, rv, sig, sockfd;
+
+	if ((workers = calloc(cfg->workers, sizeof *workers)) == NULL) {
+		perror("calloc");
+		return 1;
+	}
+
+	// coroutine workers share one listener and one set of connections
+	if (cfg->mode == MODE_CORO) {
+		if ((sockfd = open_listener(PORT, cfg->backlog, 0)) == -1)
+			return 2;
+		if ((sched = co_sched_create(sockfd, cfg, cfg->workers,
+				co_http_handler, sizeof(struct co_http_conn))) == NULL)
+			return 1;
+	}
+
+	// open every listener up front so a bind failure stops us before any
+	// thread is running
+	for (i = 0; i < cfg->workers; i++) {
+		workers[i].id = i;
+		workers[i].cfg = cfg;
+		workers[i].sched = sched;
+		if (sched != NULL)
+			continue;
+		if (cfg->cache_size > 0 && (workers[i].cache =
+				cache_create(cfg->cache_size)) == NULL) {
+			perror("cache_create");
+			return 1;
+		}
+		if ((workers[i].sockfd = open_listener(PORT, cfg->backlog, 1)) == -1)
+			return 2;
+	}
+
+	// workers inherit this mask, so only the main thread sees the signals
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	for (i = 0; i < cfg->workers; i++) {
+		if ((rv = pthread_create(&workers[i].thread, NULL, worker_main,
+				&workers[i])) != 0) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(rv));
+			return 1;
+		}
+		if (cfg->pin_cpus)
+			pin_worker(&workers[i]);
+	}
+
+	printf("server: waiting for connections (%d %s workers)...\n",
+		cfg->workers, cfg->mode == MODE_URING ? "io_uring" :
+		cfg->mode == MODE_CORO ? "coroutine" : "epoll");
+	fflush(stdout);
+
+	sigwait(&set, &sig);
+	print_stats(workers, cfg->workers);
+
+	// the workers never return on their own, exiting takes them down
+	return 0;
+}
@@ -0,0 +1,89 @@
+/*
+** spsc_ring.h -- lock-free single-producer single-consumer ring of indexes
+**
+** One thread pushes, one other thread pops, and neither ever waits on a
+** lock. head is written only by the consumer and tail only by the
+** producer, each on its own cache line, and each side keeps a stale copy
+** of the other's index so it only has to read the shared line when the
+** ring looks full (or empty) from its copy.
+*/
+
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define SPSC_CACHELINE 64
+
+struct spsc_ring {
+	// the producer's line
+	uint32_t tail __attribute__((aligned(SPSC_CACHELINE)));
+	uint32_t head_seen;
+	// the consumer's line
+	uint32_t head __attribute__((aligned(SPSC_CACHELINE)));
+	uint32_t tail_seen;
+	// read-only after init
+	uint32_t mask __attribute__((aligned(SPSC_CACHELINE)));
+	uint32_t *slots;
+};
+
+// room for at least size entries. returns -1 if out of memory.
+static inline int spsc_init(struct spsc_ring *r, uint32_t size)
+{
+	uint32_t cap = 1;
+
+	while (cap < size)
+		cap <<= 1;
+	r->head = r->tail = r->head_seen = r->tail_seen = 0;
+	r->mask = cap - 1;
+	r->slots = malloc(cap * sizeof *r->slots);
+	return r->slots != NULL ? 0 : -1;
+}
+
+static inline void spsc_destroy(struct spsc_ring *r)
+{
+	free(r->slots);
+	r->slots = NULL;
+}
+
+// producer side. returns 0 if the ring is full.
+static inline int spsc_push(struct spsc_ring *r, uint32_t v)
+{
+	uint32_t tail = r->tail;
+
+	if (tail - r->head_seen > r->mask) {
+		r->head_seen = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		if (tail - r->head_seen > r->mask)
+			return 0;
+	}
+	r->slots[tail & r->mask] = v;
+	// the slot is written before the consumer can see it
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+// consumer side. returns 0 if the ring is empty.
+static inline int spsc_pop(struct spsc_ring *r, uint32_t *v)
+{
+	uint32_t head = r->head;
+
+	if (head == r->tail_seen) {
+		r->tail_seen = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+		if (head == r->tail_seen)
+			return 0;
+	}
+	*v = r->slots[head & r->mask];
+	// the slot is read before the producer may reuse it
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+// entries waiting, as seen from any thread; only a hint while both run
+static inline uint32_t spsc_depth(struct spsc_ring *r)
+{
+	return __atomic_load_n(&r->tail, __ATOMIC_RELAXED) -
+		__atomic_load_n(&r->head, __ATOMIC_RELAXED);
+}
+
+#endif
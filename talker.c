@@ -1,67 +1,614 @@
 /*
 ** talker.c -- a datagram "client" demo
+**
+** Every message looks its destination up again, as a long-running sender
+** would, but through the DNS cache, so only the first one (or the first
+** after the TTL runs out) waits for the resolver.
+**
+** With -f or -g it is a load generator instead: messages come from a file
+** (or stdin) or are made up on the spot, and go out in batches with one
+** sendmmsg() per batch on a connected socket, optionally paced to a
+** target rate. With -G, runs of equal-sized messages that sit next to each
+** other in memory are handed over as one buffer with UDP_SEGMENT set, so
+** the kernel cuts them into datagrams (in the NIC, where it can) and one
+** trip through the stack carries up to TALK_GSO_SEGS of them.
+**
+** With -T it sends one file reliably and in order over rudp (see rudp.h)
+** to a listener started with -T; -L and -D make this end's packets go
+** missing or arrive late, to see how the transfer copes with a bad link.
 */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
+#include <signal.h>
+#include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dns_cache.h"
+#include "rudp.h"
 
 #define SERVERPORT "4950"	// the port users will be connecting to
 
-int main(int argc, char *argv[])
+#define TALK_BATCH 64		// messages per sendmmsg() unless -b says otherwise
+#define TALK_GSO_SEGS 64	// the kernel's limit on segments per GSO send
+#define TALK_GSO_BYTES 65000	// and what fits in one IP packet's length field
+
+static struct dns_cache *dns;
+static int sockfd = -1;
+static int sockfamily;
+
+static volatile sig_atomic_t stopping;
+
+// where the fast path's messages come from
+struct talk_source {
+	char *arena;		// file messages back to back, or the generator's slots
+	size_t *offsets;	// message i is arena[offsets[i]..offsets[i+1])
+	size_t count;		// messages in the arena
+	size_t next;
+	int synthetic;		// made-up payloads of size bytes
+	size_t size;
+	uint64_t seq;
+	int cycle;		// start over at the end of the file
+};
+
+struct talk_options {
+	const char *file;	// -f: one message per line, "-" for stdin
+	size_t size;		// -g: synthetic payload size
+	unsigned long long count;	// -n: stop after this many, 0 for no limit
+	double seconds;		// -t: stop after this long, 0 for no limit
+	double rate;		// -r: datagrams per second, 0 for flat out
+	int batch;		// -b
+	int gso;		// -G
+	const char *reliable;	// -T: file to send over rudp
+	struct rudp_config link;	// -L, -D
+};
+
+static void on_signal(int sig)
 {
-	int sockfd;
-	struct addrinfo hints, *servinfo, *p;
-	int rv;
-	int numbytes;
+	(void)sig;
+	stopping = 1;
+}
 
-	if (argc != 3) {
-		fprintf(stderr,"usage: talker hostname message\n");
-		exit(1);
-	}
+static double now(void)
+{
+	struct timespec ts;
 
-	memset(&hints, 0, sizeof hints);
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = SOCK_DGRAM;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-	if ((rv = getaddrinfo(argv[1], SERVERPORT, &hints, &servinfo)) != 0) {
+// resolve host and send msg to the first address we can make a socket for
+static int talk(const char *host, const char *msg)
+{
+	struct dns_entry *e;
+	const struct addrinfo *p;
+	int rv;
+	int numbytes;
+
+	if ((rv = dns_resolve(dns, host, SERVERPORT, SOCK_DGRAM, &e)) != 0) {
 		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
 		return 1;
 	}
 
-	// loop through all the results and make a socket
-	for(p = servinfo; p != NULL; p = p->ai_next) {
+	// loop through all the results and make a socket, keeping the one
+	// from the last message if the family still fits
+	for(p = dns_addrs(e); p != NULL; p = p->ai_next) {
+		if (sockfd != -1 && p->ai_family == sockfamily)
+			break;
+		if (sockfd != -1)
+			close(sockfd);
 		if ((sockfd = socket(p->ai_family, p->ai_socktype,
 				p->ai_protocol)) == -1) {
 			perror("talker: socket");
 			continue;
 		}
-
+		sockfamily = p->ai_family;
 		break;
 	}
 
 	if (p == NULL) {
 		fprintf(stderr, "talker: failed to bind socket\n");
+		dns_release(dns, e);
 		return 2;
 	}
 
-	if ((numbytes = sendto(sockfd, argv[2], strlen(argv[2]), 0,
+	if ((numbytes = sendto(sockfd, msg, strlen(msg), 0,
 			 p->ai_addr, p->ai_addrlen)) == -1) {
 		perror("talker: sendto");
 		exit(1);
 	}
 
-	freeaddrinfo(servinfo);
+	dns_release(dns, e);
+
+	printf("talker: sent %d bytes to %s\n", numbytes, host);
+	return 0;
+}
+
+// read every non-empty line of path into one arena, without the newlines,
+// so consecutive messages are contiguous
+static int load_messages(struct talk_source *src, const char *path)
+{
+	FILE *fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+	size_t used = 0, cap = 0, ocap = 0, linecap = 0;
+	size_t *offsets;
+	char *line = NULL, *arena;
+	ssize_t n;
+
+	if (fp == NULL) {
+		perror(path);
+		return -1;
+	}
+	while ((n = getline(&line, &linecap, fp)) != -1) {
+		if (n > 0 && line[n - 1] == '\n')
+			n--;
+		if (n == 0)
+			continue;
+		if (used + n > cap) {
+			cap = (used + n) * 2;
+			if ((arena = realloc(src->arena, cap)) == NULL)
+				break;
+			src->arena = arena;
+		}
+		if (src->count + 2 > ocap) {
+			ocap = ocap ? ocap * 2 : 1024;
+			if ((offsets = realloc(src->offsets,
+					ocap * sizeof *src->offsets)) == NULL)
+				break;
+			src->offsets = offsets;
+		}
+		src->offsets[src->count++] = used;
+		memcpy(src->arena + used, line, n);
+		used += n;
+	}
+	// the loop only leaves early when a realloc() fails
+	if (n != -1)
+		perror("talker: malloc");
+	free(line);
+	if (fp != stdin)
+		fclose(fp);
+	if (n != -1)
+		return -1;
+	if (src->count == 0) {
+		fprintf(stderr, "talker: no messages in %s\n", path);
+		return -1;
+	}
+	src->offsets[src->count] = used;
+	return 0;
+}
+
+// slots enough for every segment of a full batch, so a batch never wraps
+// onto a slot it still has to send
+static int make_generator(struct talk_source *src, size_t size, size_t slots)
+{
+	size_t i;
+
+	src->synthetic = 1;
+	src->size = size;
+	src->count = slots;
+	if ((src->arena = malloc(slots * size)) == NULL)
+		return -1;
+	for (i = 0; i < slots * size; i++)
+		src->arena[i] = 'a' + i % 26;
+	return 0;
+}
+
+// the next message, NULL when a file without -n/-t has been sent once
+static const char *next_message(struct talk_source *src, size_t *len)
+{
+	char *msg;
+
+	if (src->synthetic) {
+		uint64_t seq = src->seq++;
+
+		msg = src->arena + src->next * src->size;
+		src->next = (src->next + 1) % src->count;
+		// a sequence number up front lets the receiver spot losses
+		memcpy(msg, &seq, src->size < sizeof seq ? src->size : sizeof seq);
+		*len = src->size;
+		return msg;
+	}
+	if (src->next == src->count) {
+		if (!src->cycle)
+			return NULL;
+		src->next = 0;
+	}
+	*len = src->offsets[src->next + 1] - src->offsets[src->next];
+	return src->arena + src->offsets[src->next++];
+}
+
+// send one batch. returns how many of its n entries went out, fewer than n
+// with errno set on an error; *datagrams counts the ones they held
+static int send_batch(struct mmsghdr *msgs, int n, const int *segs,
+	unsigned long long *datagrams)
+{
+	int sent = 0, rv, i;
+
+	while (sent < n) {
+		if ((rv = sendmmsg(sockfd, msgs + sent, n - sent, 0)) == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		for (i = sent; i < sent + rv; i++)
+			*datagrams += segs[i];
+		sent += rv;
+	}
+	return sent;
+}
+
+// the same without segmentation offload: each entry's datagrams go out one
+// send() at a time. returns 0, or -1 with errno set
+static int send_split(const struct mmsghdr *msgs, int n, const int *segs,
+	unsigned long long *datagrams)
+{
+	const struct iovec *v;
+	size_t seg_len;
+	int i, k;
+
+	for (i = 0; i < n; i++) {
+		v = msgs[i].msg_hdr.msg_iov;
+		seg_len = v->iov_len / segs[i];
+		for (k = 0; k < segs[i]; k++) {
+			while (send(sockfd, (char *)v->iov_base + k * seg_len,
+					seg_len, 0) == -1) {
+				if (errno != EINTR)
+					return -1;
+			}
+			(*datagrams)++;
+		}
+	}
+	return 0;
+}
+
+static int connect_to(const char *host)
+{
+	struct dns_entry *e;
+	const struct addrinfo *p;
+	int rv;
+
+	if ((rv = dns_resolve(dns, host, SERVERPORT, SOCK_DGRAM, &e)) != 0) {
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+		return -1;
+	}
+	// a connected socket skips the route lookup on every send
+	for (p = dns_addrs(e); p != NULL; p = p->ai_next) {
+		if ((sockfd = socket(p->ai_family, p->ai_socktype,
+				p->ai_protocol)) == -1)
+			continue;
+		if (connect(sockfd, p->ai_addr, p->ai_addrlen) == 0)
+			break;
+		close(sockfd);
+		sockfd = -1;
+	}
+	dns_release(dns, e);
+	if (p == NULL) {
+		fprintf(stderr, "talker: failed to connect socket\n");
+		return -1;
+	}
+	return 0;
+}
+
+static int blast(const char *host, const struct talk_options *opt)
+{
+	struct talk_source src;
+	struct mmsghdr *msgs;
+	struct iovec *iov;
+	char (*control)[CMSG_SPACE(sizeof(uint16_t))];
+	int *segs;
+	int max_segs = 1, n, i, sent, gso = opt->gso, probe;
+	socklen_t probe_len = sizeof probe;
+	unsigned long long datagrams = 0, queued, calls = 0, bytes = 0;
+	const char *msg, *held = NULL;
+	size_t len, held_len = 0;
+	double start, due, elapsed;
+	struct sigaction sa;
+
+	memset(&src, 0, sizeof src);
+	if (gso && opt->size > 0)
+		max_segs = opt->size > TALK_GSO_BYTES ? 1 :
+			TALK_GSO_BYTES / opt->size;
+	else if (gso)
+		max_segs = TALK_GSO_SEGS;
+	if (max_segs > TALK_GSO_SEGS)
+		max_segs = TALK_GSO_SEGS;
+	if (opt->file != NULL) {
+		if (load_messages(&src, opt->file) == -1)
+			return 1;
+		src.cycle = opt->count > 0 || opt->seconds > 0;
+	} else if (make_generator(&src, opt->size,
+			(size_t)opt->batch * max_segs) == -1) {
+		perror("talker: malloc");
+		return 1;
+	}
+	if (connect_to(host) == -1)
+		return 2;
+	if (gso && getsockopt(sockfd, SOL_UDP, UDP_SEGMENT, &probe,
+			&probe_len) == -1) {
+		fprintf(stderr, "talker: no UDP GSO in this kernel, "
+			"sending without it\n");
+		gso = 0;
+		max_segs = 1;
+	}
+
+	msgs = calloc(opt->batch, sizeof *msgs);
+	iov = calloc(opt->batch, sizeof *iov);
+	control = calloc(opt->batch, sizeof *control);
+	segs = calloc(opt->batch, sizeof *segs);
+	if (msgs == NULL || iov == NULL || control == NULL || segs == NULL) {
+		perror("talker: malloc");
+		return 1;
+	}
+
+	sa.sa_handler = on_signal;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = 0;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	start = now();
+	while (!stopping) {
+		// fill a batch; with GSO each entry takes every following message
+		// of the same size that directly follows it in memory
+		queued = datagrams;
+		for (n = 0; n < opt->batch; n++) {
+			if (opt->count > 0 && queued >= opt->count)
+				break;
+			if (held != NULL) {
+				msg = held;
+				len = held_len;
+				held = NULL;
+			} else if ((msg = next_message(&src, &len)) == NULL) {
+				break;
+			}
+			iov[n].iov_base = (char *)msg;
+			iov[n].iov_len = len;
+			segs[n] = 1;
+			memset(&msgs[n].msg_hdr, 0, sizeof msgs[n].msg_hdr);
+			msgs[n].msg_hdr.msg_iov = &iov[n];
+			msgs[n].msg_hdr.msg_iovlen = 1;
+			while (gso && segs[n] < max_segs &&
+					(opt->count == 0 || queued + segs[n] < opt->count) &&
+					iov[n].iov_len + len <= TALK_GSO_BYTES) {
+				const char *more;
+				size_t more_len;
+
+				if ((more = next_message(&src, &more_len)) == NULL)
+					break;
+				if (more != msg + len * segs[n] || more_len != len) {
+					held = more;
+					held_len = more_len;
+					break;
+				}
+				iov[n].iov_len += len;
+				segs[n]++;
+			}
+			if (segs[n] > 1) {
+				struct cmsghdr *cm;
+
+				msgs[n].msg_hdr.msg_control = control[n];
+				msgs[n].msg_hdr.msg_controllen = sizeof control[n];
+				cm = CMSG_FIRSTHDR(&msgs[n].msg_hdr);
+				cm->cmsg_level = SOL_UDP;
+				cm->cmsg_type = UDP_SEGMENT;
+				cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+				*(uint16_t *)CMSG_DATA(cm) = len;
+			}
+			queued += segs[n];
+		}
+		if (n == 0)
+			break;
+
+		// pace to the target rate: this batch is due once the ones
+		// before it have had their share of time
+		if (opt->rate > 0 && (due = start + datagrams / opt->rate) > now()) {
+			double wait = due - now();
+			struct timespec ts = { (time_t)wait,
+				(long)((wait - (time_t)wait) * 1e9) };
+
+			nanosleep(&ts, NULL);
+		}
+
+		if ((sent = send_batch(msgs, n, segs, &datagrams)) < n &&
+				gso && (errno == EIO || errno == EINVAL ||
+				errno == ENOPROTOOPT)) {
+			// no segmentation offload here: what's left of this
+			// batch goes out one by one, the rest without GSO
+			fprintf(stderr, "talker: UDP GSO unavailable (%s), "
+				"sending without it\n", strerror(errno));
+			gso = 0;
+			max_segs = 1;
+			if (send_split(msgs + sent, n - sent, segs + sent,
+					&datagrams) == 0)
+				sent = n;
+		}
+		calls++;
+		for (i = 0; i < sent; i++)
+			bytes += iov[i].iov_len;
+		if (sent < n) {
+			perror("talker: sendmmsg");
+			break;
+		}
+		if (opt->seconds > 0 && now() - start >= opt->seconds)
+			break;
+	}
+
+	elapsed = now() - start;
+	printf("talker: sent %llu datagrams, %llu bytes in %.3f s: "
+		"%.0f pkt/s, %.2f MB/s, %.1f datagrams per call%s\n",
+		datagrams, bytes, elapsed, datagrams / elapsed,
+		bytes / elapsed / 1e6, calls ? (double)datagrams / calls : 0.0,
+		gso ? " (GSO)" : "");
+
+	free(msgs);
+	free(iov);
+	free(control);
+	free(segs);
+	free(src.arena);
+	free(src.offsets);
+	return 0;
+}
+
+static int send_reliable(const char *host, const struct talk_options *opt)
+{
+	struct rudp_stats st;
+	struct stat sb;
+	char *data = NULL;
+	int fd, rv;
 
-	printf("talker: sent %d bytes to %s\n", numbytes, argv[1]);
-	close(sockfd);
+	if ((fd = open(opt->reliable, O_RDONLY)) == -1 || fstat(fd, &sb) == -1) {
+		perror("talker: open");
+		return 1;
+	}
+	if (sb.st_size > 0 && (data = mmap(NULL, sb.st_size, PROT_READ,
+			MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		perror("talker: mmap");
+		close(fd);
+		return 1;
+	}
+	close(fd);
+	if (connect_to(host) == -1) {
+		if (data != NULL)
+			munmap(data, sb.st_size);
+		return 2;
+	}
 
+	rv = rudp_send(sockfd, data, sb.st_size, &opt->link, &st);
+	if (data != NULL)
+		munmap(data, sb.st_size);
+	if (rv == -1) {
+		fprintf(stderr, "talker: receiver stopped answering\n");
+		return 1;
+	}
+	printf("talker: sent %llu bytes reliably in %.3f s: %.2f MB/s\n",
+		st.bytes, st.elapsed, st.elapsed > 0 ? st.bytes / st.elapsed / 1e6 : 0);
+	printf("talker: %llu packets, %llu retransmits, %llu lost, "
+		"%llu timeouts, srtt %.2f ms, max cwnd %.0f, %llu dropped by shim\n",
+		st.packets, st.retransmits, st.losses, st.timeouts,
+		st.srtt * 1e3, st.max_cwnd, st.shim_dropped);
 	return 0;
 }
+
+static void usage(void)
+{
+	fprintf(stderr,"usage: talker hostname message...\n"
+		"       talker hostname -    (one message per line of stdin)\n"
+		"       talker (-f file|- | -g size) [-n count] [-t secs] "
+		"[-r pps] [-b batch] [-G] hostname\n"
+		"       talker -T file [-L loss%%] [-D delay_ms] hostname\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct talk_options opt = { NULL, 0, 0, 0, 0, TALK_BATCH, 0, NULL,
+		{ 0, 0, 1 } };
+	struct dns_stats stats;
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t n;
+	int i, c, rv = 0;
+
+	while ((c = getopt(argc, argv, "f:g:n:t:r:b:GT:L:D:")) != -1) {
+		switch (c) {
+		case 'f':
+			opt.file = optarg;
+			break;
+		case 'g':
+			if ((opt.size = strtoul(optarg, NULL, 10)) < 1 ||
+					opt.size > 65507)
+				usage();
+			break;
+		case 'n':
+			opt.count = strtoull(optarg, NULL, 10);
+			break;
+		case 't':
+			opt.seconds = atof(optarg);
+			break;
+		case 'r':
+			opt.rate = atof(optarg);
+			break;
+		case 'b':
+			if ((opt.batch = atoi(optarg)) < 1)
+				usage();
+			break;
+		case 'G':
+			opt.gso = 1;
+			break;
+		case 'T':
+			opt.reliable = optarg;
+			break;
+		case 'L':
+			opt.link.loss = atof(optarg) / 100;
+			break;
+		case 'D':
+			opt.link.delay = atof(optarg) / 1e3;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if ((dns = dns_cache_create(1, DNS_TTL, DNS_NEGATIVE_TTL)) == NULL) {
+		perror("talker: dns_cache_create");
+		return 1;
+	}
+
+	if (opt.reliable != NULL) {
+		if (optind != argc - 1 || opt.file != NULL || opt.size > 0)
+			usage();
+		rv = send_reliable(argv[optind], &opt);
+		if (sockfd != -1)
+			close(sockfd);
+		dns_cache_destroy(dns);
+		return rv;
+	}
+
+	if (opt.file != NULL || opt.size > 0) {
+		if (optind != argc - 1 || (opt.file != NULL && opt.size > 0))
+			usage();
+		rv = blast(argv[optind], &opt);
+		close(sockfd);
+		dns_cache_destroy(dns);
+		return rv;
+	}
+
+	if (argc - optind < 2)
+		usage();
+
+	if (argc - optind == 2 && strcmp(argv[optind + 1], "-") == 0) {
+		while (rv == 0 && (n = getline(&line, &cap, stdin)) != -1) {
+			if (n > 0 && line[n - 1] == '\n')
+				line[n - 1] = '\0';
+			rv = talk(argv[optind], line);
+		}
+		free(line);
+	} else {
+		for (i = optind + 1; rv == 0 && i < argc; i++)
+			rv = talk(argv[optind], argv[i]);
+	}
+
+	dns_get_stats(dns, &stats);
+	if (stats.hits + stats.misses > 1)
+		printf("talker: dns %lu hits, %lu misses\n",
+			stats.hits, stats.misses);
+
+	if (sockfd != -1)
+		close(sockfd);
+	dns_cache_destroy(dns);
+
+	return rv;
+}
@@ -0,0 +1,305 @@
+/*
+** url_parser.c -- re-entrant, allocation-free URL parser
+**
+** Replaces getUriDetails(), which cut argv[1] up with strtok (so only one
+** URL could be parsed at a time, by one thread), left the port and path
+** unset when the URL had none, and glued the pieces back together with
+** strlen/strcat into fresh mallocs. urlParse() walks the string once and
+** records where each piece is; callers copy out only what they need, into
+** their own buffers.
+**
+** Characters are classified with one table lookup. Scheme, userinfo, host
+** and port are checked strictly against RFC 3986. Path, query and fragment
+** take any visible byte, UTF-8 and stray '|' or '{' included, as browsers
+** and most servers do, but never a space or a control character.
+*/
+
+#include <limits.h>
+#include <string.h>
+#include <strings.h>
+
+#include "url_parser.h"
+
+#define U_ALPHA   0x01             // first character of a scheme
+#define U_SCHEME  0x02             // the rest of it
+#define U_HOST    0x04             // reg-name and userinfo: unreserved, sub-delims, '%'
+#define U_HEX     0x08
+#define U_PATH    0x10             // visible, but not '?' or '#'
+#define U_QUERY   0x20             // visible, but not '#'
+
+#define IS_ALPHA(c) (((c) >= 'a' && (c) <= 'z') || ((c) >= 'A' && (c) <= 'Z'))
+#define IS_DIGIT(c) ((c) >= '0' && (c) <= '9')
+#define IS_HEX(c) (IS_DIGIT(c) || ((c) >= 'a' && (c) <= 'f') || ((c) >= 'A' && (c) <= 'F'))
+#define IS_UNRESERVED(c) (IS_ALPHA(c) || IS_DIGIT(c) || (c) == '-' || (c) == '.' || \
+                          (c) == '_' || (c) == '~')
+#define IS_SUB_DELIM(c) ((c) == '!' || (c) == '$' || (c) == '&' || (c) == '\'' || \
+                         (c) == '(' || (c) == ')' || (c) == '*' || (c) == '+' || \
+                         (c) == ',' || (c) == ';' || (c) == '=')
+#define IS_VISIBLE(c) ((c) > ' ' && (c) != 0x7f)
+
+#define CLASS(c) ((IS_ALPHA(c) ? U_ALPHA : 0) | \
+                  (IS_ALPHA(c) || IS_DIGIT(c) || (c) == '+' || (c) == '-' || (c) == '.' ? U_SCHEME : 0) | \
+                  (IS_UNRESERVED(c) || IS_SUB_DELIM(c) || (c) == '%' ? U_HOST : 0) | \
+                  (IS_HEX(c) ? U_HEX : 0) | \
+                  (IS_VISIBLE(c) && (c) != '?' && (c) != '#' ? U_PATH : 0) | \
+                  (IS_VISIBLE(c) && (c) != '#' ? U_QUERY : 0))
+#define CLASS4(c) CLASS(c), CLASS((c) + 1), CLASS((c) + 2), CLASS((c) + 3)
+#define CLASS16(c) CLASS4(c), CLASS4((c) + 4), CLASS4((c) + 8), CLASS4((c) + 12)
+#define CLASS64(c) CLASS16(c), CLASS16((c) + 16), CLASS16((c) + 32), CLASS16((c) + 48)
+
+static const unsigned char urlClass[256] = {
+    CLASS64(0), CLASS64(64), CLASS64(128), CLASS64(192)
+};
+
+static const struct urlSpan absent = { -1, 0 };
+
+static struct urlSpan span(const unsigned char *base, const unsigned char *from,
+                           const unsigned char *to) {
+    struct urlSpan s;
+    s.off = from - base;
+    s.len = to - from;
+    return s;
+}
+
+// userinfo or reg-name: U_HOST characters (plus ':' in userinfo), each '%'
+// followed by two hex digits
+static int validHostChars(const unsigned char *p, const unsigned char *end, int colonOk) {
+    for (; p < end; p++) {
+        if (*p == '%') {
+            if (end - p < 3 || !(urlClass[p[1]] & U_HEX) || !(urlClass[p[2]] & U_HEX)) {
+                return 0;
+            }
+            p += 2;
+        } else if (!(urlClass[*p] & U_HOST) && !(colonOk && *p == ':')) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// the inside of [...]: hex digits, ':' and '.' for an embedded IPv4, at
+// least two colons, and optionally a %25zone. getaddrinfo() has the final
+// word on whether it's a real address
+static int validIpv6(const unsigned char *p, const unsigned char *end) {
+    int colons = 0;
+
+    for (; p < end && *p != '%'; p++) {
+        if (*p == ':') {
+            colons++;
+        } else if (!(urlClass[*p] & U_HEX) && *p != '.') {
+            return 0;
+        }
+    }
+    if (colons < 2) {
+        return 0;
+    }
+    if (p < end) {
+        if (end - p < 4 || p[1] != '2' || p[2] != '5') {
+            return 0;
+        }
+        return validHostChars(p + 3, end, 0);
+    }
+    return 1;
+}
+
+int urlParse(const char *url, size_t len, struct urlParts *parts) {
+    const unsigned char *base = (const unsigned char *)url;
+    const unsigned char *p = base, *end = base + len, *start, *authEnd, *at, *close;
+    int port = -1;
+
+    if (len > INT_MAX) {
+        return -1;
+    }
+    parts->scheme = parts->userinfo = parts->host = parts->port = absent;
+    parts->query = parts->fragment = absent;
+    parts->ipv6 = 0;
+
+    // scheme ":"
+    if (p == end || !(urlClass[*p] & U_ALPHA)) {
+        return -1;
+    }
+    while (++p < end && (urlClass[*p] & U_SCHEME)) {
+    }
+    if (p == end || *p != ':') {
+        return -1;
+    }
+    parts->scheme = span(base, base, p);
+    p++;
+
+    // "//" authority, up to the path, query or fragment
+    if (end - p >= 2 && p[0] == '/' && p[1] == '/') {
+        p += 2;
+        for (authEnd = p; authEnd < end && *authEnd != '/' && *authEnd != '?' &&
+                          *authEnd != '#'; authEnd++) {
+        }
+        if ((at = memchr(p, '@', authEnd - p)) != NULL) {
+            if (!validHostChars(p, at, 1)) {
+                return -1;
+            }
+            parts->userinfo = span(base, p, at);
+            p = at + 1;
+        }
+        if (p < authEnd && *p == '[') {
+            if ((close = memchr(p, ']', authEnd - p)) == NULL || !validIpv6(p + 1, close)) {
+                return -1;
+            }
+            parts->host = span(base, p + 1, close);
+            parts->ipv6 = 1;
+            p = close + 1;
+        } else {
+            for (start = p; p < authEnd && *p != ':'; p++) {
+            }
+            if (!validHostChars(start, p, 0)) {
+                return -1;
+            }
+            parts->host = span(base, start, p);
+        }
+        if (p < authEnd && *p == ':') {
+            for (start = ++p, port = 0; p < authEnd && IS_DIGIT(*p); p++) {
+                port = port * 10 + (*p - '0');
+                if (port > 65535) {
+                    return -1;
+                }
+            }
+            parts->port = span(base, start, p);
+            if (p == start) {
+                port = -1;       // "host:" means the default port
+            }
+        }
+        if (p != authEnd) {
+            return -1;
+        }
+    }
+
+    for (start = p; p < end && (urlClass[*p] & U_PATH); p++) {
+    }
+    parts->path = span(base, start, p);
+    if (p < end && *p == '?') {
+        for (start = ++p; p < end && (urlClass[*p] & U_QUERY); p++) {
+        }
+        parts->query = span(base, start, p);
+    }
+    if (p < end && *p == '#') {
+        for (start = ++p; p < end && (urlClass[*p] & U_QUERY); p++) {
+        }
+        parts->fragment = span(base, start, p);
+    }
+    if (p != end) {
+        return -1;       // a space, a control character or a second '#'
+    }
+
+    if (port == -1) {
+        if (urlSchemeIs(url, parts, "http")) {
+            port = 80;
+        } else if (urlSchemeIs(url, parts, "https")) {
+            port = 443;
+        }
+    }
+    parts->portNumber = port;
+    return 0;
+}
+
+int urlSchemeIs(const char *url, const struct urlParts *parts, const char *scheme) {
+    size_t len = strlen(scheme);
+    return parts->scheme.off >= 0 && (size_t)parts->scheme.len == len &&
+           strncasecmp(url + parts->scheme.off, scheme, len) == 0;
+}
+
+int urlCopy(const char *url, struct urlSpan span, char *out, size_t size) {
+    size_t len = span.off >= 0 ? (size_t)span.len : 0;
+
+    if (len >= size) {
+        return -1;
+    }
+    if (len > 0) {
+        memcpy(out, url + span.off, len);
+    }
+    out[len] = '\0';
+    return len;
+}
+
+static int hexValue(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    return (c | 0x20) - 'a' + 10;
+}
+
+int urlCopyHost(const char *url, const struct urlParts *parts, char *out, size_t size) {
+    struct urlSpan host = parts->host;
+    size_t n = 0, i;
+
+    if (!parts->ipv6 || memchr(url + host.off, '%', host.len) == NULL) {
+        return urlCopy(url, host, out, size);
+    }
+    // the zone is percent-encoded, "%25" for the '%' itself, and
+    // getaddrinfo() wants it decoded. urlParse() checked the hex digits
+    for (i = host.off; i < (size_t)(host.off + host.len); i++, n++) {
+        if (n + 1 >= size) {
+            return -1;
+        }
+        out[n] = url[i];
+        if (url[i] == '%') {
+            out[n] = (char)(hexValue(url[i + 1]) << 4 | hexValue(url[i + 2]));
+            i += 2;
+        }
+    }
+    out[n] = '\0';
+    return n;
+}
+
+int urlCopyTarget(const char *url, const struct urlParts *parts, char *out, size_t size) {
+    struct urlSpan target = parts->path;
+
+    // path and query sit next to each other, '?' between them
+    if (parts->query.off >= 0) {
+        target.len = parts->query.off + parts->query.len - target.off;
+    }
+    if (parts->path.len == 0) {
+        if (size < 2 || urlCopy(url, target, out + 1, size - 1) == -1) {
+            return -1;
+        }
+        out[0] = '/';
+        return target.len + 1;
+    }
+    return urlCopy(url, target, out, size);
+}
+
+int urlCopyHostHeader(const char *url, const struct urlParts *parts, char *out, size_t size) {
+    struct urlSpan host = parts->host;
+    const char *zone;
+    int len, rv;
+
+    if (host.off < 0) {
+        return -1;
+    }
+    // a zone only means something on this machine, so it isn't sent
+    if (parts->ipv6 && (zone = memchr(url + host.off, '%', host.len)) != NULL) {
+        host.len = zone - (url + host.off);
+        if (size < 3 || (len = urlCopy(url, host, out + 1, size - 2)) == -1) {
+            return -1;
+        }
+        out[0] = '[';
+        out[++len] = ']';
+        out[++len] = '\0';
+        if (parts->port.len > 0) {
+            host = parts->port;
+            host.off--;  // with its ':'
+            host.len++;
+            if ((rv = urlCopy(url, host, out + len, size - len)) == -1) {
+                return -1;
+            }
+            len += rv;
+        }
+        return len;
+    }
+    // it's all one piece of the original, brackets and port included
+    if (parts->ipv6) {
+        host.off--;
+        host.len += 2;
+    }
+    if (parts->port.len > 0) {
+        host.len = parts->port.off + parts->port.len - host.off;
+    }
+    return urlCopy(url, host, out, size);
+}
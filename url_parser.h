@@ -0,0 +1,55 @@
+/*
+** url_parser.h -- re-entrant, allocation-free URL parser
+*/
+
+#ifndef URL_PARSER_H
+#define URL_PARSER_H
+
+#include <stddef.h>
+
+// a piece of the URL: len bytes at url + off. off is -1 when the piece is
+// absent, which isn't the same as present and empty ("http://h:/" has an
+// empty port, "http://h/?" an empty query)
+struct urlSpan {
+    int off;
+    int len;
+};
+
+// scheme ":" ["//" [userinfo "@"] host [":" port]] path ["?" query] ["#" fragment]
+struct urlParts {
+    struct urlSpan scheme;
+    struct urlSpan userinfo;
+    struct urlSpan host;           // without the brackets of an IPv6 literal
+    struct urlSpan port;
+    struct urlSpan path;           // always present, may be empty
+    struct urlSpan query;          // without the '?'
+    struct urlSpan fragment;       // without the '#'
+    int portNumber;                // port, or the scheme's default; -1 if neither
+    int ipv6;                      // host was an [IPv6] literal
+};
+
+// parse the len bytes at url, which needn't be NUL terminated and aren't
+// touched. nothing is allocated and there's no hidden state, so any number
+// of threads may parse at once. returns 0, or -1 if url isn't a well formed
+// absolute URL.
+int urlParse(const char *url, size_t len, struct urlParts *parts);
+
+// is the scheme this one? (case-insensitive)
+int urlSchemeIs(const char *url, const struct urlParts *parts, const char *scheme);
+
+// copy a piece out NUL terminated, "" if it is absent. returns its length,
+// -1 if it doesn't fit in size bytes
+int urlCopy(const char *url, struct urlSpan span, char *out, size_t size);
+
+// the host as getaddrinfo() takes it: an IPv6 zone comes percent-decoded,
+// "fe80::1%25lo" as "fe80::1%lo"; anything else as urlCopy() gives it
+int urlCopyHost(const char *url, const struct urlParts *parts, char *out, size_t size);
+
+// the request target: path and ?query, "/" for an empty path
+int urlCopyTarget(const char *url, const struct urlParts *parts, char *out, size_t size);
+
+// the Host header: host, bracketed if IPv6, and :port if one was given. an
+// IPv6 zone is left out, it means nothing to the server
+int urlCopyHostHeader(const char *url, const struct urlParts *parts, char *out, size_t size);
+
+#endif
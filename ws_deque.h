@@ -0,0 +1,120 @@
+/*
+** ws_deque.h -- lock-free work-stealing deque of pointers (Chase-Lev)
+**
+** The owning thread pushes and pops at the bottom, last in first out, so
+** it keeps running what it touched most recently and is still in cache.
+** Any other thread may steal from the top, the oldest entry. Only a pop
+** racing a steal for the last entry needs a compare-and-swap; every other
+** operation is a plain load and store. The memory orders are the ones Lê
+** et al. proved correct for C11 ("Correct and Efficient Work-Stealing for
+** Weak Memory Models", PPoPP 2013). The array doesn't grow: a push that
+** finds it full fails and the owner deals with the entry itself.
+*/
+
+#ifndef WS_DEQUE_H
+#define WS_DEQUE_H
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#define WS_CACHELINE 64
+
+struct ws_deque {
+	// thieves' line
+	long top __attribute__((aligned(WS_CACHELINE)));
+	// the owner's line
+	long bottom __attribute__((aligned(WS_CACHELINE)));
+	// read-only after init
+	long mask __attribute__((aligned(WS_CACHELINE)));
+	void **slots;
+};
+
+// room for at least size entries. returns -1 if out of memory.
+static inline int ws_init(struct ws_deque *q, long size)
+{
+	long cap = 1;
+
+	while (cap < size)
+		cap <<= 1;
+	q->top = q->bottom = 0;
+	q->mask = cap - 1;
+	q->slots = calloc(cap, sizeof *q->slots);
+	return q->slots != NULL ? 0 : -1;
+}
+
+static inline void ws_destroy(struct ws_deque *q)
+{
+	free(q->slots);
+	q->slots = NULL;
+}
+
+// owner only. returns 0 if the deque is full.
+static inline int ws_push(struct ws_deque *q, void *p)
+{
+	long b = __atomic_load_n(&q->bottom, __ATOMIC_RELAXED);
+	long t = __atomic_load_n(&q->top, __ATOMIC_ACQUIRE);
+
+	if (b - t > q->mask)
+		return 0;
+	__atomic_store_n(&q->slots[b & q->mask], p, __ATOMIC_RELAXED);
+	// the slot (and what p points to) is written before a thief can see
+	// the new bottom
+	__atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+// owner only. the newest entry, or NULL if empty (or a thief got the last)
+static inline void *ws_pop(struct ws_deque *q)
+{
+	long b = __atomic_load_n(&q->bottom, __ATOMIC_RELAXED) - 1;
+	long t;
+	void *p = NULL;
+
+	// claim the bottom slot before looking at top, so a thief either sees
+	// the claim or we see its steal
+	__atomic_store_n(&q->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	t = __atomic_load_n(&q->top, __ATOMIC_RELAXED);
+	if (t <= b) {
+		p = __atomic_load_n(&q->slots[b & q->mask], __ATOMIC_RELAXED);
+		if (t == b) {
+			// the last one: race the thieves for it
+			if (!__atomic_compare_exchange_n(&q->top, &t, t + 1, 0,
+					__ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+				p = NULL;
+			__atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELAXED);
+		}
+	} else {
+		__atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELAXED);
+	}
+	return p;
+}
+
+// any thread. the oldest entry, or NULL if empty or another thread won it
+static inline void *ws_steal(struct ws_deque *q)
+{
+	long t = __atomic_load_n(&q->top, __ATOMIC_ACQUIRE);
+	long b;
+	void *p;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	b = __atomic_load_n(&q->bottom, __ATOMIC_ACQUIRE);
+	if (t >= b)
+		return NULL;
+	p = __atomic_load_n(&q->slots[t & q->mask], __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&q->top, &t, t + 1, 0,
+			__ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		return NULL;
+	return p;
+}
+
+// entries waiting, as seen from any thread; only a hint while others run
+static inline long ws_depth(struct ws_deque *q)
+{
+	long n = __atomic_load_n(&q->bottom, __ATOMIC_RELAXED) -
+		__atomic_load_n(&q->top, __ATOMIC_RELAXED);
+
+	return n > 0 ? n : 0;
+}
+
+#endif